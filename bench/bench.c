@@ -0,0 +1,363 @@
+/*
+ * End-to-end benchmark driver.
+ *
+ *  isr3-bench --files LIST --queries LOG [--engine permuterm|kgram|fm]
+ *
+ * Runs the indexing pipeline phase by phase over the files named in LIST (one per line), then every query in LOG, and
+ * prints a JSON report with per-phase wall time, throughput and peak RSS, the size of the wildcard index and query
+ * latency percentiles. `make bench` runs it once per engine over the same inputs.
+ * Use bench/isr3-gen to produce the inputs; `make bench` does all of it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "../isr3.h"
+#include "../kgram.h"
+#include "../fm.h"
+#include "../mem.h"
+
+#define ISR3_BENCH_LINE 4096
+
+struct isr3_bench_phase {
+	const char* name, *unit;
+	double seconds;
+	unsigned long items;
+	long peak_rss_kb;
+};
+
+static int* isr3_bench_sids = NULL;
+
+static double isr3_bench_now(void);
+static long isr3_bench_rss(void);
+static char** isr3_bench_read_lines(const char* path, int* count);
+static void isr3_bench_callback(struct isr3_vocab* vocab, uint32_t word, int search_id);
+static int isr3_bench_query(char* line, isr3_tree_node* root, struct isr3_vocab* vocab, struct isr3_permuterm_index* index, struct isr3_kgram_index* kgram, struct isr3_fm_index* fm, int num_docs);
+static int isr3_bench_cmp_double(const void* a, const void* b);
+static void isr3_bench_phase_json(struct isr3_bench_phase* phase, int last);
+
+int main(int argc, char** argv) {
+	static struct option long_options[] = {
+		{"files", required_argument, NULL, 'f'},
+		{"queries", required_argument, NULL, 'q'},
+		{"engine", required_argument, NULL, 'e'},
+		{NULL, 0, NULL, 0}
+	};
+
+	const char* files_path = NULL, *queries_path = NULL, *engine = "permuterm";
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "f:q:e:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'f': files_path = optarg; break;
+		case 'q': queries_path = optarg; break;
+		case 'e': engine = optarg; break;
+		default:
+			isr3_errf("Usage: %s --files LIST --queries LOG [--engine permuterm|kgram|fm]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (!files_path || !queries_path || (strcmp(engine, "permuterm") && strcmp(engine, "kgram") && strcmp(engine, "fm"))) {
+		isr3_errf("Usage: %s --files LIST --queries LOG [--engine permuterm|kgram|fm]\n", argv[0]);
+		return 1;
+	}
+
+	int num_files = 0, num_queries = 0;
+	char** files = isr3_bench_read_lines(files_path, &num_files), **queries = isr3_bench_read_lines(queries_path, &num_queries);
+
+	if (!files || !queries) {
+		return 1;
+	}
+
+	struct isr3_bench_phase phases[4] = {
+		{"ingest", "bytes", 0, 0, 0},
+		{"sort", "words", 0, 0, 0},
+		{"build", "keys", 0, 0, 0},
+		{"query", "queries", 0, 0, 0},
+	};
+
+	isr3_tree_node* root = NULL;
+	struct isr3_vocab vocab;
+	uint32_t* order = NULL;
+
+	isr3_vocab_init(&vocab);
+
+	struct isr3_permuterm_index* index = strcmp(engine, "permuterm") ? NULL : isr3_permuterm_index_create(&vocab);
+	struct isr3_kgram_index* kgram = strcmp(engine, "kgram") ? NULL : isr3_kgram_index_create(&vocab, 0);
+	struct isr3_fm_index* fm = NULL;
+	unsigned long num_words = 0;
+	double start;
+
+	/* ingest: parse_file/insert_word over every document */
+	start = isr3_bench_now();
+
+	for (int i = 0; i < num_files; ++i) {
+		struct stat info;
+
+		if (!stat(files[i], &info)) {
+			phases[0].items += info.st_size;
+		}
+
+		if (!parse_file(files[i], i, &root, &vocab, NULL)) {
+			isr3_errf("Parsing failed for file [%s].\n", files[i]);
+			return 1;
+		}
+	}
+
+	phases[0].seconds = isr3_bench_now() - start;
+	phases[0].peak_rss_kb = isr3_bench_rss();
+
+	/* sort: isr3_vocab_sort over the vocabulary */
+	start = isr3_bench_now();
+	order = isr3_vocab_sort(&vocab);
+	phases[1].seconds = isr3_bench_now() - start;
+	phases[1].peak_rss_kb = isr3_bench_rss();
+
+	/* build: the bulk loaded permuterm B-tree, the k-gram lists, or the FM-index over the whole vocabulary */
+	start = isr3_bench_now();
+
+	for (uint32_t i = 0; i < vocab.num_words; ++i) {
+		if (index) {
+			int word_len;
+
+			isr3_vocab_word(&vocab, i, &word_len);
+			phases[2].items += word_len + 1;
+		} else if (kgram) {
+			isr3_kgram_index_insert(kgram, i); /* The k-gram lists take the IDs in ascending order. */
+		}
+
+		++num_words;
+	}
+
+	if (index) {
+		isr3_permuterm_index_build(index);
+	} else if (kgram) {
+		phases[2].unit = "postings";
+		phases[2].items = kgram->num_postings;
+	} else if (!index) {
+		if (!(fm = isr3_fm_index_create(&vocab))) {
+			isr3_err("malloc failure\n");
+			return 1;
+		}
+
+		phases[2].unit = "bwt_bytes";
+		phases[2].items = fm->length;
+	}
+
+	phases[1].items = num_words;
+	phases[2].seconds = isr3_bench_now() - start;
+	phases[2].peak_rss_kb = isr3_bench_rss();
+
+	/* query: every line of the query log, with the same term handling as the interactive prompt */
+	double* latencies = malloc(sizeof *latencies * num_queries + 1);
+	unsigned long matches = 0;
+
+	isr3_bench_sids = malloc(sizeof *isr3_bench_sids * num_files + 1);
+
+	if (!latencies || !isr3_bench_sids) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	for (int i = 0; i < num_queries; ++i) {
+		start = isr3_bench_now();
+		matches += isr3_bench_query(queries[i], root, &vocab, index, kgram, fm, num_files);
+		latencies[i] = isr3_bench_now() - start;
+		phases[3].seconds += latencies[i];
+	}
+
+	phases[3].items = num_queries;
+	phases[3].peak_rss_kb = isr3_bench_rss();
+
+	qsort(latencies, num_queries, sizeof *latencies, isr3_bench_cmp_double);
+
+	unsigned long index_bytes = 0;
+	const enum isr3_mem_tag index_tags[] = {ISR3_MEM_PERMUTERM_NODE, ISR3_MEM_PERMUTERM_KEY, ISR3_MEM_KEY_BYTES, ISR3_MEM_PERMUTERM_VALUE, ISR3_MEM_KGRAM_LIST, ISR3_MEM_KGRAM_TABLE, ISR3_MEM_FM};
+
+	for (size_t i = 0; i < sizeof index_tags / sizeof *index_tags; ++i) {
+		index_bytes += isr3_mem_heap_bytes(index_tags[i]);
+	}
+
+	printf("{\n");
+	printf("  \"engine\": \"%s\",\n", engine);
+	printf("  \"corpus\": {\"documents\": %d, \"bytes\": %lu, \"unique_words\": %lu, \"index_entries\": %lu, \"index_heap_bytes\": %lu},\n",
+			num_files, phases[0].items, num_words, phases[2].items, index_bytes);
+	printf("  \"phases\": {\n");
+
+	for (int i = 0; i < 4; ++i) {
+		isr3_bench_phase_json(phases + i, i == 3);
+	}
+
+	printf("  },\n");
+	printf("  \"queries\": {\"count\": %d, \"matches\": %lu", num_queries, matches);
+
+	if (num_queries) {
+		const double percentiles[] = {0.5, 0.9, 0.99};
+		const char* names[] = {"p50", "p90", "p99"};
+
+		printf(", \"latency_us\": {");
+
+		for (int i = 0; i < 3; ++i) {
+			printf("\"%s\": %.2f, ", names[i], latencies[(int) (percentiles[i] * (num_queries - 1))] * 1e6);
+		}
+
+		printf("\"max\": %.2f}", latencies[num_queries - 1] * 1e6);
+	}
+
+	printf("},\n");
+	printf("  \"peak_rss_kb\": %ld\n", isr3_bench_rss());
+	printf("}\n");
+
+	free(latencies);
+	free(isr3_bench_sids);
+	free(order);
+	free_tree(root);
+
+	if (index) {
+		isr3_permuterm_index_free(index);
+	} else if (kgram) {
+		isr3_kgram_index_free(kgram);
+	} else {
+		isr3_fm_index_free(fm);
+	}
+
+	isr3_vocab_destroy(&vocab);
+	return 0;
+}
+
+double isr3_bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+long isr3_bench_rss(void) {
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return 0;
+	}
+
+	return usage.ru_maxrss; /* Kilobytes on Linux. */
+}
+
+char** isr3_bench_read_lines(const char* path, int* count) {
+	FILE* fd = fopen(path, "r");
+	char** output = NULL, line[ISR3_BENCH_LINE];
+	int max = 0;
+
+	if (!fd) {
+		isr3_errf("Failed to open [%s] for reading.\n", path);
+		return NULL;
+	}
+
+	*count = 0;
+
+	while (fgets(line, sizeof line, fd)) {
+		line[strcspn(line, "\n")] = 0;
+
+		if (!*line) {
+			continue;
+		}
+
+		if (*count == max) {
+			max = max ? max * 2 : 256;
+			output = realloc(output, sizeof *output * max);
+		}
+
+		if (!output || !(output[*count] = malloc(strlen(line) + 1))) {
+			isr3_err("malloc failure\n");
+			fclose(fd);
+			return NULL;
+		}
+
+		strcpy(output[(*count)++], line);
+	}
+
+	fclose(fd);
+	return output ? output : malloc(1);
+}
+
+void isr3_bench_callback(struct isr3_vocab* vocab, uint32_t word, int search_id) {
+	/* Same counter method as callback_permuterm(). */
+	struct isr3_postings postings;
+	unsigned int ref_id;
+
+	isr3_vocab_postings(vocab, word, &postings);
+
+	while (isr3_postings_next(&postings, &ref_id)) {
+		if (isr3_bench_sids[ref_id] == search_id - 1) {
+			isr3_bench_sids[ref_id] = search_id;
+		}
+	}
+}
+
+int isr3_bench_query(char* line, isr3_tree_node* root, struct isr3_vocab* vocab, struct isr3_permuterm_index* index, struct isr3_kgram_index* kgram, struct isr3_fm_index* fm, int num_docs) {
+	char query_buf[ISR3_BENCH_LINE], *cur = query_buf;
+	int search_id = 0, matches = 0;
+
+	strcpy(query_buf, line); /* Stemming rewrites the terms in place. */
+	memset(isr3_bench_sids, 0, sizeof *isr3_bench_sids * num_docs);
+
+	while (*cur) {
+		while (*cur && isspace(*cur)) ++cur;
+
+		int length = 0, wildcards = 0;
+
+		while (cur[length] && !isspace(cur[length])) {
+			wildcards += cur[length] == '*' || cur[length] == '?';
+			++length;
+		}
+
+		if (!length) {
+			break;
+		}
+
+		int stem_length = wildcards ? length : stem(cur, 0, length - 1) + 1;
+
+		if (!exact_term(cur, stem_length, wildcards)) {
+			if (kgram) {
+				isr3_kgram_index_search(kgram, cur, stem_length, ++search_id, isr3_bench_callback);
+			} else if (fm) {
+				isr3_fm_index_search(fm, cur, stem_length, ++search_id, isr3_bench_callback);
+			} else {
+				search_permuterm(cur, stem_length, index, wildcards, &search_id, isr3_bench_callback);
+			}
+		} else {
+			/* Exact terms go straight to the vocabulary, like isr3_segment_set_search(). */
+			uint32_t word = find_word(cur, stem_length, root, vocab);
+
+			if (word != ISR3_VOCAB_NONE) {
+				isr3_bench_callback(vocab, word, search_id + 1);
+			}
+
+			++search_id;
+		}
+		cur += length;
+	}
+
+	for (int i = 0; i < num_docs; ++i) {
+		matches += isr3_bench_sids[i] == search_id;
+	}
+
+	return matches;
+}
+
+int isr3_bench_cmp_double(const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+void isr3_bench_phase_json(struct isr3_bench_phase* phase, int last) {
+	printf("    \"%s\": {\"seconds\": %.6f, \"%s\": %lu, \"%s_per_second\": %.1f, \"peak_rss_kb\": %ld}%s\n",
+			phase->name, phase->seconds, phase->unit, phase->items, phase->unit,
+			phase->seconds > 0 ? phase->items / phase->seconds : 0.0, phase->peak_rss_kb, last ? "" : ",");
+}
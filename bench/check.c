@@ -0,0 +1,390 @@
+/*
+ * Differential test of the permuterm B-tree against a sorted array.
+ *
+ *  isr3-check [--keys N] [--words N] [--searches N] [--seed N]
+ *
+ * Three trees are built from seeded random input: a plain index and a concurrent index from the same distinct keys
+ * inserted in random order, and a bulk loaded index over every rotation of a vocabulary of distinct words (enough of them
+ * to take the parallel build). Keys and words use a few bytes above 0x7f. The reference is the same keys sorted with
+ * memcmp (an inserted key's value is its rank, a rotation's is its word's ID), so every tree has to give:
+ *
+ *  - the reference's values in order from an in-order walk of its nodes,
+ *  - every leaf at the same depth, and every node between one and BTREE_NUM_KEYS keys (with one more child if inner),
+ *  - exactly the reference's range of keys, in order, for every prefix search.
+ *
+ * Exits with 1 on the first difference.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "../isr3.h"
+
+#define ISR3_CHECK_KEY 12 /* Longest key or word. */
+
+/* Some bytes above 0x7f, so the key order is unsigned like word_cmp(). Words never contain the '$'. */
+static const char isr3_check_alphabet[] = "abce\xc3\xa9\xe2\xff$";
+#define ISR3_CHECK_SYMBOLS ((int) sizeof isr3_check_alphabet - 1)
+
+struct isr3_check_key {
+	char* key;
+	int key_len;
+	uint32_t value;
+};
+
+struct isr3_check_walk {
+	struct isr3_check_key* keys;
+	uint32_t next, num_keys; // The reference key the walk expects next.
+	int leaf_depth; // -1 until the first leaf.
+	unsigned long nodes;
+};
+
+static uint64_t isr3_check_state;
+
+static uint32_t* isr3_check_found;
+static uint32_t isr3_check_num_found, isr3_check_max_found;
+
+static uint64_t isr3_check_rand(void);
+static int isr3_check_cmp(const void* a, const void* b);
+static void isr3_check_random_key(char* key, int* key_len, int symbols);
+static int isr3_check_tree(const char* name, struct isr3_permuterm_index* index, struct isr3_check_key* keys, uint32_t num_keys, int searches);
+static int isr3_check_node(struct isr3_permuterm_index* index, uint32_t handle, int depth, struct isr3_check_walk* walk);
+static int isr3_check_search(const char* name, struct isr3_permuterm_index* index, struct isr3_check_key* keys, uint32_t num_keys, char* prefix, int prefix_len);
+static void isr3_check_callback(struct isr3_vocab* vocab, uint32_t word, int search_id);
+
+int main(int argc, char** argv) {
+	static struct option long_options[] = {
+		{"keys", required_argument, NULL, 'k'},
+		{"words", required_argument, NULL, 'w'},
+		{"searches", required_argument, NULL, 'n'},
+		{"seed", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int num_keys = 50000, num_words = 20000, searches = 2000, opt;
+	uint64_t seed = 1;
+
+	while ((opt = getopt_long(argc, argv, "k:w:n:s:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'k': num_keys = atoi(optarg); break;
+		case 'w': num_words = atoi(optarg); break;
+		case 'n': searches = atoi(optarg); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		default:
+			isr3_errf("Usage: %s [--keys N] [--words N] [--searches N] [--seed N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_keys < 1 || num_words < 1) {
+		isr3_err("Need at least one key and one word.\n");
+		return 1;
+	}
+
+	isr3_check_state = seed * 0x9e3779b97f4a7c15ull + 1;
+	isr3_check_max_found = num_keys > num_words * (ISR3_CHECK_KEY + 1) ? num_keys : num_words * (ISR3_CHECK_KEY + 1);
+	isr3_check_found = malloc(sizeof *isr3_check_found * isr3_check_max_found);
+
+	/* Inserted keys: distinct, sorted, and valued by their rank. */
+	struct isr3_check_key* keys = malloc(sizeof *keys * num_keys);
+	char* key_bytes = malloc((size_t) num_keys * ISR3_CHECK_KEY);
+	uint32_t* order = malloc(sizeof *order * num_keys), count = 0;
+
+	if (!isr3_check_found || !keys || !key_bytes || !order) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	for (int i = 0; i < num_keys; ++i) {
+		keys[i].key = key_bytes + (size_t) i * ISR3_CHECK_KEY;
+		isr3_check_random_key(keys[i].key, &keys[i].key_len, ISR3_CHECK_SYMBOLS);
+	}
+
+	qsort(keys, num_keys, sizeof *keys, isr3_check_cmp);
+
+	for (int i = 0; i < num_keys; ++i) {
+		if (!count || isr3_check_cmp(keys + count - 1, keys + i)) {
+			keys[count] = keys[i];
+			keys[count].value = count;
+			++count;
+		}
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t j = isr3_check_rand() % (i + 1);
+
+		order[i] = order[j];
+		order[j] = i;
+	}
+
+	struct isr3_permuterm_index* plain = isr3_permuterm_index_create(NULL), *concurrent = isr3_permuterm_index_create_concurrent(NULL);
+
+	if (!plain || !concurrent) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		isr3_permuterm_index_insert(plain, keys[order[i]].key, keys[order[i]].key_len, order[i]);
+		isr3_permuterm_index_insert(concurrent, keys[order[i]].key, keys[order[i]].key_len, order[i]);
+	}
+
+	int result = isr3_check_tree("plain", plain, keys, count, searches) && isr3_check_tree("concurrent", concurrent, keys, count, searches);
+
+	isr3_permuterm_index_free(plain);
+	isr3_permuterm_index_free(concurrent);
+
+	/* Bulk loaded: a loaded vocabulary of distinct words, and every rotation of word$ as the reference. */
+	char* words = malloc((size_t) num_words * (ISR3_CHECK_KEY + 1));
+	uint32_t num_chars = 0, num_distinct = 0;
+	struct isr3_check_key* word_keys = malloc(sizeof *word_keys * num_words);
+
+	if (!words || !word_keys) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	for (int i = 0; i < num_words; ++i) {
+		word_keys[i].key = words + (size_t) i * (ISR3_CHECK_KEY + 1);
+		isr3_check_random_key(word_keys[i].key, &word_keys[i].key_len, ISR3_CHECK_SYMBOLS - 1);
+	}
+
+	qsort(word_keys, num_words, sizeof *word_keys, isr3_check_cmp);
+
+	for (int i = 0; i < num_words; ++i) {
+		if (!num_distinct || isr3_check_cmp(word_keys + num_distinct - 1, word_keys + i)) {
+			word_keys[num_distinct++] = word_keys[i];
+			num_chars += word_keys[i].key_len;
+		}
+	}
+
+	struct isr3_vocab vocab;
+	uint32_t num_rotations = num_chars + num_distinct, cur_string = 0, cur_rotation = 0;
+	struct isr3_check_key* rotations = malloc(sizeof *rotations * num_rotations);
+	char* doubled = malloc(2 * (size_t) num_rotations);
+
+	if (!rotations || !doubled || !isr3_vocab_load(&vocab, num_distinct, num_distinct, num_chars)) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	/* Words are loaded in a shuffled order, so word IDs don't follow the word order. */
+	for (uint32_t i = 0; i < num_distinct; ++i) {
+		uint32_t j = isr3_check_rand() % (i + 1);
+		struct isr3_check_key tmp = word_keys[i];
+
+		word_keys[i] = word_keys[j];
+		word_keys[j] = tmp;
+	}
+
+	for (uint32_t i = 0; i < num_distinct; ++i) {
+		int word_len = word_keys[i].key_len;
+		char* cur = doubled + 2 * (size_t) (cur_string + i);
+
+		memcpy(vocab.strings + cur_string + i, word_keys[i].key, word_len);
+		vocab.strings[cur_string + i + word_len] = 0;
+		vocab.offsets[i] = cur_string + i;
+		vocab.lengths[i] = word_len;
+		vocab.postings_offsets[i] = i;
+		vocab.postings[i] = 0;
+
+		memcpy(cur, word_keys[i].key, word_len);
+		cur[word_len] = '$';
+		memcpy(cur + word_len + 1, cur, word_len + 1);
+
+		for (int k = 0; k <= word_len; ++k, ++cur_rotation) {
+			rotations[cur_rotation].key = cur + k;
+			rotations[cur_rotation].key_len = word_len + 1;
+			rotations[cur_rotation].value = i;
+		}
+
+		cur_string += word_len;
+	}
+
+	vocab.postings_offsets[num_distinct] = num_distinct;
+
+	/* Rotations are distinct (the '$' marks where the word ends), so the walk has to return their word IDs in this order. */
+	qsort(rotations, num_rotations, sizeof *rotations, isr3_check_cmp);
+
+	struct isr3_permuterm_index* bulk = isr3_permuterm_index_create(&vocab);
+
+	if (!bulk) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	isr3_permuterm_index_build(bulk);
+	result = result && isr3_check_tree("bulk", bulk, rotations, num_rotations, searches);
+
+	isr3_permuterm_index_free(bulk);
+	isr3_vocab_destroy(&vocab);
+
+	free(rotations);
+	free(doubled);
+	free(word_keys);
+	free(words);
+	free(keys);
+	free(key_bytes);
+	free(order);
+	free(isr3_check_found);
+
+	return !result;
+}
+
+uint64_t isr3_check_rand(void) {
+	isr3_check_state ^= isr3_check_state >> 12;
+	isr3_check_state ^= isr3_check_state << 25;
+	isr3_check_state ^= isr3_check_state >> 27;
+
+	return isr3_check_state * 0x2545F4914F6CDD1Dull;
+}
+
+int isr3_check_cmp(const void* a, const void* b) {
+	const struct isr3_check_key* x = a, *y = b;
+	int result = memcmp(x->key, y->key, x->key_len < y->key_len ? x->key_len : y->key_len);
+
+	return result ? result : x->key_len - y->key_len;
+}
+
+void isr3_check_random_key(char* key, int* key_len, int symbols) {
+	/* Short keys over a small alphabet share long prefixes, like rotations do. */
+	*key_len = 1 + isr3_check_rand() % ISR3_CHECK_KEY;
+
+	for (int i = 0; i < *key_len; ++i) {
+		key[i] = isr3_check_alphabet[isr3_check_rand() % symbols];
+	}
+}
+
+int isr3_check_tree(const char* name, struct isr3_permuterm_index* index, struct isr3_check_key* keys, uint32_t num_keys, int searches) {
+	struct isr3_check_walk walk = {keys, 0, num_keys, -1, 0};
+
+	if (!index->root || !isr3_check_node(index, index->root, 0, &walk)) {
+		isr3_errf("%s: the tree is malformed.\n", name);
+		return 0;
+	}
+
+	if (walk.next != num_keys) {
+		isr3_errf("%s: the walk ended after %u of %u keys.\n", name, walk.next, num_keys);
+		return 0;
+	}
+
+	/* Single symbols, every prefix of a key's first bytes, and prefixes no key has. */
+	char prefix[ISR3_CHECK_KEY + 2]; // A rotation is a word and its '$', plus one extra byte.
+
+	for (int i = 0; i < ISR3_CHECK_SYMBOLS; ++i) {
+		if (!isr3_check_search(name, index, keys, num_keys, (char*) isr3_check_alphabet + i, 1)) {
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < searches; ++i) {
+		struct isr3_check_key* key = keys + isr3_check_rand() % num_keys;
+		int prefix_len = 1 + isr3_check_rand() % key->key_len;
+
+		memcpy(prefix, key->key, prefix_len);
+
+		if (i % 4 == 3) {
+			prefix[prefix_len++] = isr3_check_alphabet[isr3_check_rand() % ISR3_CHECK_SYMBOLS];
+		}
+
+		if (!isr3_check_search(name, index, keys, num_keys, prefix, prefix_len)) {
+			return 0;
+		}
+	}
+
+	printf("isr3-check tree=%s keys=%u nodes=%lu height=%d searches=%d result=ok\n", name, num_keys, walk.nodes, walk.leaf_depth + 1, searches + ISR3_CHECK_SYMBOLS);
+
+	return 1;
+}
+
+int isr3_check_node(struct isr3_permuterm_index* index, uint32_t handle, int depth, struct isr3_check_walk* walk) {
+	struct isr3_permuterm_node* node = isr3_pool_get(&index->nodes, handle);
+
+	walk->nodes++;
+
+	if (node->num_keys < 1 || node->num_keys > BTREE_NUM_KEYS) {
+		isr3_errf("node at depth %d has %d keys\n", depth, node->num_keys);
+		return 0;
+	}
+
+	if (node->is_leaf) {
+		if (walk->leaf_depth >= 0 && walk->leaf_depth != depth) {
+			isr3_errf("leaves at depths %d and %d\n", walk->leaf_depth, depth);
+			return 0;
+		}
+
+		walk->leaf_depth = depth;
+	}
+
+	for (int i = 0; i <= node->num_keys; ++i) {
+		if (!node->is_leaf && (!node->children[i] || !isr3_check_node(index, node->children[i], depth + 1, walk))) {
+			return 0;
+		}
+
+		if (i == node->num_keys) {
+			break;
+		}
+
+		struct isr3_permuterm_key* key = isr3_pool_get(&index->keys, node->keys[i]);
+
+		/* The keys are distinct, so none of them may have merged a second value. */
+		if (walk->next == walk->num_keys || key->value != walk->keys[walk->next].value || key->more_values) {
+			isr3_errf("the walk found value %u as key %u\n", key->value, walk->next);
+			return 0;
+		}
+
+		walk->next++;
+	}
+
+	return 1;
+}
+
+int isr3_check_search(const char* name, struct isr3_permuterm_index* index, struct isr3_check_key* keys, uint32_t num_keys, char* prefix, int prefix_len) {
+	struct isr3_check_key probe = {prefix, prefix_len, 0};
+	uint32_t low = 0, high = num_keys;
+
+	/* The reference range: the first key not below the prefix, up to the first key which doesn't start with it. */
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (isr3_check_cmp(keys + mid, &probe) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	for (high = low; high < num_keys && keys[high].key_len >= prefix_len && !memcmp(keys[high].key, prefix, prefix_len); ++high);
+
+	isr3_check_num_found = 0;
+	isr3_permuterm_index_search(index, prefix, prefix_len, 0, isr3_check_callback);
+
+	int result = isr3_check_num_found == high - low;
+
+	for (uint32_t i = 0; result && i < isr3_check_num_found; ++i) {
+		result = isr3_check_found[i] == keys[low + i].value;
+	}
+
+	if (!result) {
+		isr3_errf("%s: searching for [", name);
+
+		for (int i = 0; i < prefix_len; ++i) {
+			fprintf(stderr, "%02x", (unsigned char) prefix[i]);
+		}
+
+		fprintf(stderr, "] found %u keys, the reference has %u.\n", isr3_check_num_found, high - low);
+	}
+
+	return result;
+}
+
+void isr3_check_callback(struct isr3_vocab* vocab, uint32_t word, int search_id) {
+	if (isr3_check_num_found < isr3_check_max_found) {
+		isr3_check_found[isr3_check_num_found] = word;
+	}
+
+	isr3_check_num_found++;
+}
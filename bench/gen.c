@@ -0,0 +1,309 @@
+/*
+ * Deterministic benchmark input generator.
+ *
+ *  isr3-gen corpus  [options] --out DIR   writes DIR/doc000000.txt .. and prints the file names to stdout
+ *  isr3-gen queries [options]             prints a query log to stdout, one query per line
+ *
+ * Both modes rebuild the same synthetic vocabulary from the seed, so queries hit the words of a corpus generated with the
+ * same --vocab/--seed. Word frequencies in documents and queries follow a Zipf distribution over the vocabulary rank.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "../debug.h"
+
+#define ISR3_GEN_MAX_WORD 16
+
+struct isr3_gen_options {
+	unsigned int vocab, docs, doc_len, queries, terms;
+	double zipf;
+	uint64_t seed;
+	const char* out;
+	unsigned int mix[5]; /* Percentages of exact, prefix, suffix, infix and two-wildcard terms. */
+};
+
+static uint64_t isr3_gen_state;
+
+static uint64_t isr3_gen_rand(void);
+static unsigned int isr3_gen_range(unsigned int n);
+static char** isr3_gen_vocab(unsigned int count);
+static double* isr3_gen_zipf(unsigned int count, double exponent);
+static unsigned int isr3_gen_pick(double* cdf, unsigned int count);
+static int isr3_gen_corpus(struct isr3_gen_options* opts, char** vocab, double* cdf);
+static int isr3_gen_queries(struct isr3_gen_options* opts, char** vocab, double* cdf);
+static void usage(const char* name);
+
+int main(int argc, char** argv) {
+	static struct option long_options[] = {
+		{"vocab", required_argument, NULL, 'v'},
+		{"zipf", required_argument, NULL, 'z'},
+		{"docs", required_argument, NULL, 'd'},
+		{"doc-len", required_argument, NULL, 'l'},
+		{"queries", required_argument, NULL, 'q'},
+		{"terms", required_argument, NULL, 't'},
+		{"mix", required_argument, NULL, 'm'},
+		{"seed", required_argument, NULL, 's'},
+		{"out", required_argument, NULL, 'o'},
+		{NULL, 0, NULL, 0}
+	};
+
+	struct isr3_gen_options opts = {20000, 500, 1000, 2000, 3, 1.0, 1, NULL, {40, 20, 15, 15, 10}};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "v:z:d:l:q:t:m:s:o:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'v': opts.vocab = strtoul(optarg, NULL, 10); break;
+		case 'z': opts.zipf = strtod(optarg, NULL); break;
+		case 'd': opts.docs = strtoul(optarg, NULL, 10); break;
+		case 'l': opts.doc_len = strtoul(optarg, NULL, 10); break;
+		case 'q': opts.queries = strtoul(optarg, NULL, 10); break;
+		case 't': opts.terms = strtoul(optarg, NULL, 10); break;
+		case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+		case 'o': opts.out = optarg; break;
+		case 'm':
+			if (sscanf(optarg, "%u,%u,%u,%u,%u", opts.mix, opts.mix + 1, opts.mix + 2, opts.mix + 3, opts.mix + 4) != 5) {
+				isr3_err("--mix takes five comma separated weights: exact,prefix,suffix,infix,two-wildcard\n");
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc || !opts.vocab || !opts.terms) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	isr3_gen_state = opts.seed * 0x9E3779B97F4A7C15ull + 1;
+
+	char** vocab = isr3_gen_vocab(opts.vocab);
+	double* cdf = isr3_gen_zipf(opts.vocab, opts.zipf);
+
+	if (!vocab || !cdf) {
+		isr3_err("Failed to allocate the vocabulary.\n");
+		return 1;
+	}
+
+	int result = 0;
+
+	if (!strcmp(argv[optind], "corpus")) {
+		result = isr3_gen_corpus(&opts, vocab, cdf);
+	} else if (!strcmp(argv[optind], "queries")) {
+		result = isr3_gen_queries(&opts, vocab, cdf);
+	} else {
+		usage(argv[0]);
+	}
+
+	for (unsigned int i = 0; i < opts.vocab; ++i) {
+		free(vocab[i]);
+	}
+
+	free(vocab);
+	free(cdf);
+
+	return !result;
+}
+
+uint64_t isr3_gen_rand(void) {
+	/* xorshift64* -- fast, and identical on every platform. */
+	isr3_gen_state ^= isr3_gen_state >> 12;
+	isr3_gen_state ^= isr3_gen_state << 25;
+	isr3_gen_state ^= isr3_gen_state >> 27;
+
+	return isr3_gen_state * 0x2545F4914F6CDD1Dull;
+}
+
+unsigned int isr3_gen_range(unsigned int n) {
+	return n ? (unsigned int) (isr3_gen_rand() % n) : 0;
+}
+
+char** isr3_gen_vocab(unsigned int count) {
+	/* Pronounceable-ish words (alternating consonant/vowel runs), so the stemmer and the rotations behave like on real text. */
+	static const char* consonants = "bcdfghklmnprstvwz", *vowels = "aeiou";
+	char** output = malloc(sizeof *output * count);
+
+	if (!output) {
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < count; ++i) {
+		int len = 3 + isr3_gen_range(4) + isr3_gen_range(5); /* 3..10, peaking around 6 */
+
+		if (!(output[i] = malloc(ISR3_GEN_MAX_WORD + 1))) {
+			return NULL;
+		}
+
+		for (int j = 0; j < len; ++j) {
+			output[i][j] = (j % 2) ? vowels[isr3_gen_range(5)] : consonants[isr3_gen_range(17)];
+		}
+
+		output[i][len] = 0;
+	}
+
+	return output;
+}
+
+double* isr3_gen_zipf(unsigned int count, double exponent) {
+	double* output = malloc(sizeof *output * count), total = 0;
+
+	if (!output) {
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < count; ++i) {
+		total += 1.0 / pow(i + 1, exponent);
+		output[i] = total;
+	}
+
+	for (unsigned int i = 0; i < count; ++i) {
+		output[i] /= total;
+	}
+
+	return output;
+}
+
+unsigned int isr3_gen_pick(double* cdf, unsigned int count) {
+	/* Binary search for the first rank whose cumulative probability reaches a uniform sample. */
+	double sample = (isr3_gen_rand() >> 11) * (1.0 / 9007199254740992.0);
+	unsigned int low = 0, high = count - 1;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (cdf[mid] < sample) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+int isr3_gen_corpus(struct isr3_gen_options* opts, char** vocab, double* cdf) {
+	if (!opts->out) {
+		isr3_err("corpus mode needs --out DIR\n");
+		return 0;
+	}
+
+	char* path = malloc(strlen(opts->out) + 32);
+
+	if (!path) {
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < opts->docs; ++i) {
+		sprintf(path, "%s/doc%06u.txt", opts->out, i);
+
+		FILE* fd = fopen(path, "w");
+
+		if (!fd) {
+			isr3_errf("Failed to open [%s] for writing.\n", path);
+			free(path);
+			return 0;
+		}
+
+		/* Document lengths vary uniformly between half and one and a half times --doc-len. */
+		unsigned int len = opts->doc_len / 2 + isr3_gen_range(opts->doc_len + 1);
+
+		for (unsigned int j = 0; j < len; ++j) {
+			fputs(vocab[isr3_gen_pick(cdf, opts->vocab)], fd);
+
+			if (!isr3_gen_range(20)) {
+				fputc(isr3_gen_range(2) ? '.' : ',', fd);
+			}
+
+			fputc((j % 12 == 11) ? '\n' : ' ', fd);
+		}
+
+		fputc('\n', fd);
+		fclose(fd);
+
+		printf("%s\n", path);
+	}
+
+	free(path);
+	return 1;
+}
+
+int isr3_gen_queries(struct isr3_gen_options* opts, char** vocab, double* cdf) {
+	unsigned int mix_total = 0;
+
+	for (int i = 0; i < 5; ++i) {
+		mix_total += opts->mix[i];
+	}
+
+	if (!mix_total) {
+		isr3_err("--mix weights can't all be zero\n");
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < opts->queries; ++i) {
+		unsigned int terms = 1 + isr3_gen_range(opts->terms);
+
+		for (unsigned int j = 0; j < terms; ++j) {
+			const char* word = vocab[isr3_gen_pick(cdf, opts->vocab)];
+			int len = strlen(word), kind = 0;
+			unsigned int roll = isr3_gen_range(mix_total);
+
+			while (roll >= opts->mix[kind]) {
+				roll -= opts->mix[kind++];
+			}
+
+			/* Cut points always leave at least one literal character on each side. */
+			int a = 1 + isr3_gen_range(len - 1), b = a + isr3_gen_range(len - a);
+
+			if (j) {
+				putchar(' ');
+			}
+
+			switch (kind) {
+			case 0: /* exact */
+				printf("%s", word);
+				break;
+			case 1: /* prefix */
+				printf("%.*s*", a, word);
+				break;
+			case 2: /* suffix */
+				printf("*%s", word + a);
+				break;
+			case 3: /* infix */
+				printf("*%.*s*", b - a + 1, word + a - 1);
+				break;
+			default: /* two wildcards: A*B*C */
+				if (len < 4) {
+					printf("%.1s*%s", word, word + 1);
+				} else {
+					printf("%.1s*%.*s*%s", word, len / 2 - 1, word + 1, word + len - 1);
+				}
+
+				break;
+			}
+		}
+
+		putchar('\n');
+	}
+
+	return 1;
+}
+
+void usage(const char* name) {
+	isr3_errf("Usage: %s corpus|queries [options]\n", name);
+	isr3_err("  --vocab N      vocabulary size (default 20000)\n");
+	isr3_err("  --zipf S       Zipf exponent for word frequencies (default 1.0)\n");
+	isr3_err("  --seed N       random seed (default 1)\n");
+	isr3_err("  --docs N       corpus: number of documents (default 500)\n");
+	isr3_err("  --doc-len N    corpus: average words per document (default 1000)\n");
+	isr3_err("  --out DIR      corpus: output directory\n");
+	isr3_err("  --queries N    queries: number of queries (default 2000)\n");
+	isr3_err("  --terms N      queries: up to N terms per query (default 3)\n");
+	isr3_err("  --mix E,P,S,I,T  queries: weights of exact, prefix, suffix, infix and two-wildcard terms (default 40,20,15,15,10)\n");
+}
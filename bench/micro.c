@@ -0,0 +1,332 @@
+/*
+ * Microbenchmarks for the hot kernels.
+ *
+ *  isr3-micro [--filter NAME] [--reps N]
+ *
+ * Every kernel runs over a fixed, seeded input set: a few warmup passes first, then N timed passes, reporting the best pass
+ * as ns/op and MB/s. Alternative implementations of a kernel are listed next to the original under the same name and must
+ * produce the same checksum, so a variant can't win by computing something else.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "../isr3.h"
+
+#define ISR3_MICRO_WORDS 20000
+#define ISR3_MICRO_TEXT (1 << 20)
+#define ISR3_MICRO_WARMUP 3
+
+struct isr3_micro_kernel {
+	const char* name, *variant;
+	unsigned long (*run)(void); /* One pass over the input set, returns a checksum. */
+	unsigned long ops, bytes; /* Work per pass, filled in by isr3_micro_setup(). */
+};
+
+/* Fixed inputs shared by every kernel. */
+static char* isr3_micro_words[ISR3_MICRO_WORDS];
+static int isr3_micro_lengths[ISR3_MICRO_WORDS];
+static struct isr3_permuterm_key isr3_micro_keys[ISR3_MICRO_WORDS];
+static char* isr3_micro_text;
+static FILE* isr3_micro_text_fd;
+static uint64_t isr3_micro_state = 42;
+
+static double isr3_micro_now(void);
+static uint64_t isr3_micro_rand(void);
+static void isr3_micro_setup(struct isr3_micro_kernel* kernels, int count);
+
+static unsigned long isr3_micro_cmp_node(void);
+static unsigned long isr3_micro_cmp_node_memcmp(void);
+static unsigned long isr3_micro_cmp_prefix(void);
+static unsigned long isr3_micro_cmp_prefix_memcmp(void);
+static unsigned long isr3_micro_tokenize(void);
+static unsigned long isr3_micro_stem(void);
+static unsigned long isr3_micro_hash(void);
+static unsigned long isr3_micro_word_cmp(void);
+
+static struct isr3_micro_kernel isr3_micro_kernels[] = {
+	{"cmp_permuterm_node", "original", isr3_micro_cmp_node, 0, 0},
+	{"cmp_permuterm_node", "memcmp", isr3_micro_cmp_node_memcmp, 0, 0},
+	{"cmp_permuterm_prefix", "original", isr3_micro_cmp_prefix, 0, 0},
+	{"cmp_permuterm_prefix", "memcmp", isr3_micro_cmp_prefix_memcmp, 0, 0},
+	{"read_word", "original", isr3_micro_tokenize, 0, 0},
+	{"stem", "original", isr3_micro_stem, 0, 0},
+	{"hash_word", "original", isr3_micro_hash, 0, 0},
+	{"word_cmp", "original", isr3_micro_word_cmp, 0, 0},
+};
+
+int main(int argc, char** argv) {
+	static struct option long_options[] = {
+		{"filter", required_argument, NULL, 'f'},
+		{"reps", required_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0}
+	};
+
+	const char* filter = NULL, *reference_name = NULL;
+	unsigned long reference = 0;
+	int reps = 10, opt, count = sizeof isr3_micro_kernels / sizeof *isr3_micro_kernels;
+
+	while ((opt = getopt_long(argc, argv, "f:r:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'f': filter = optarg; break;
+		case 'r': reps = atoi(optarg); break;
+		default:
+			isr3_errf("Usage: %s [--filter NAME] [--reps N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	isr3_micro_setup(isr3_micro_kernels, count);
+
+	printf("%-22s %-10s %12s %12s %18s\n", "kernel", "variant", "ns/op", "MB/s", "checksum");
+
+	for (int i = 0; i < count; ++i) {
+		struct isr3_micro_kernel* kernel = isr3_micro_kernels + i;
+		unsigned long checksum = 0;
+		double best = 0;
+
+		if (filter && !strstr(kernel->name, filter)) {
+			continue;
+		}
+
+		for (int j = 0; j < ISR3_MICRO_WARMUP; ++j) {
+			checksum = kernel->run();
+		}
+
+		for (int j = 0; j < reps; ++j) {
+			double start = isr3_micro_now();
+			unsigned long result = kernel->run();
+			double elapsed = isr3_micro_now() - start;
+
+			if (result != checksum) {
+				isr3_errf("%s/%s is not deterministic!\n", kernel->name, kernel->variant);
+				return 1;
+			}
+
+			if (!j || elapsed < best) {
+				best = elapsed;
+			}
+		}
+
+		/* Variants are listed right after their original, which they have to agree with. */
+		if (reference_name && !strcmp(kernel->name, reference_name) && checksum != reference) {
+			isr3_errf("%s/%s disagrees with %s/original!\n", kernel->name, kernel->variant, kernel->name);
+			return 1;
+		}
+
+		if (!strcmp(kernel->variant, "original")) {
+			reference_name = kernel->name;
+			reference = checksum;
+		}
+
+		printf("%-22s %-10s %12.2f %12.1f %18lu\n", kernel->name, kernel->variant, best * 1e9 / kernel->ops, kernel->bytes / best / 1e6, checksum);
+	}
+
+	fclose(isr3_micro_text_fd);
+	free(isr3_micro_text);
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		free(isr3_micro_words[i]);
+		free(isr3_micro_keys[i].key);
+	}
+
+	return 0;
+}
+
+double isr3_micro_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t isr3_micro_rand(void) {
+	isr3_micro_state ^= isr3_micro_state >> 12;
+	isr3_micro_state ^= isr3_micro_state << 25;
+	isr3_micro_state ^= isr3_micro_state >> 27;
+
+	return isr3_micro_state * 0x2545F4914F6CDD1Dull;
+}
+
+void isr3_micro_setup(struct isr3_micro_kernel* kernels, int count) {
+	static const char* letters = "etaoinshrdlcumwfgypbvkjxqz";
+	unsigned long word_bytes = 0, key_bytes = 0;
+
+	/* Words with a skewed letter distribution, so comparisons share prefixes about as often as real ones do. */
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		int len = 2 + isr3_micro_rand() % 10;
+
+		isr3_micro_words[i] = malloc(len + 1);
+
+		for (int j = 0; j < len; ++j) {
+			isr3_micro_words[i][j] = letters[(isr3_micro_rand() % 26) * (isr3_micro_rand() % 26) / 26];
+		}
+
+		isr3_micro_words[i][len] = 0;
+		isr3_micro_lengths[i] = len;
+		word_bytes += len;
+
+		/* The matching key is a rotation of the word, like the ones gen_permuterm() produces. */
+		int shift = isr3_micro_rand() % (len + 1);
+
+		isr3_micro_keys[i].key = malloc(len + 1);
+		isr3_micro_keys[i].key_len = len + 1;
+
+		for (int j = 0; j <= len; ++j) {
+			int pos = (j + shift) % (len + 1);
+			isr3_micro_keys[i].key[j] = (pos == len) ? '$' : isr3_micro_words[i][pos];
+		}
+
+		key_bytes += len + 1;
+	}
+
+	/* Plain text for the tokenizer: the same words with spaces, newlines and some punctuation. */
+	isr3_micro_text = malloc(ISR3_MICRO_TEXT + 16);
+	unsigned long text_len = 0, text_words = 0;
+
+	while (text_len < ISR3_MICRO_TEXT) {
+		int i = isr3_micro_rand() % ISR3_MICRO_WORDS;
+
+		memcpy(isr3_micro_text + text_len, isr3_micro_words[i], isr3_micro_lengths[i]);
+		text_len += isr3_micro_lengths[i];
+
+		if (!(isr3_micro_rand() % 16)) {
+			isr3_micro_text[text_len++] = (isr3_micro_rand() % 2) ? '.' : '\'';
+		}
+
+		isr3_micro_text[text_len++] = (text_words++ % 12 == 11) ? '\n' : ' ';
+	}
+
+	if (!(isr3_micro_text_fd = tmpfile())) {
+		isr3_err("Failed to create the tokenizer input file.\n");
+		exit(1);
+	}
+
+	fwrite(isr3_micro_text, 1, text_len, isr3_micro_text_fd);
+
+	for (int i = 0; i < count; ++i) {
+		if (!strcmp(kernels[i].name, "read_word")) {
+			kernels[i].ops = text_words;
+			kernels[i].bytes = text_len;
+		} else if (!strncmp(kernels[i].name, "cmp_permuterm", 13)) {
+			kernels[i].ops = ISR3_MICRO_WORDS;
+			kernels[i].bytes = key_bytes;
+		} else if (!strcmp(kernels[i].name, "word_cmp")) {
+			kernels[i].ops = ISR3_MICRO_WORDS;
+			kernels[i].bytes = word_bytes * 2;
+		} else {
+			kernels[i].ops = ISR3_MICRO_WORDS;
+			kernels[i].bytes = word_bytes;
+		}
+	}
+}
+
+/* Each query is compared against an unrelated key, roughly like the in-node scan of a B-tree search does. The prefix tests
+ * use the query's own key every other time so both outcomes are exercised. */
+
+unsigned long isr3_micro_cmp_node(void) {
+	unsigned long output = 0;
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		struct isr3_permuterm_key* key = isr3_micro_keys + (i * 7) % ISR3_MICRO_WORDS;
+		output = output * 3 + 1 + cmp_permuterm_node(isr3_micro_keys[i].key, isr3_micro_keys[i].key_len, key);
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_cmp_node_memcmp(void) {
+	unsigned long output = 0;
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		struct isr3_permuterm_key* key = isr3_micro_keys + (i * 7) % ISR3_MICRO_WORDS;
+		char* query = isr3_micro_keys[i].key;
+		int query_len = isr3_micro_keys[i].key_len, min_length = query_len > key->key_len ? key->key_len : query_len;
+
+		/* The original compares unsigned bytes, like memcmp. */
+		int result = memcmp(query, key->key, min_length);
+		result = result ? (result < 0 ? -1 : 1) : (query_len > key->key_len) - (query_len < key->key_len);
+
+		output = output * 3 + 1 + result;
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_cmp_prefix(void) {
+	unsigned long output = 0;
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		struct isr3_permuterm_key* key = isr3_micro_keys + ((i % 2) ? i : (i * 7) % ISR3_MICRO_WORDS);
+		output = output * 3 + cmp_permuterm_prefix(isr3_micro_keys[i].key, 1 + i % 3, key);
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_cmp_prefix_memcmp(void) {
+	unsigned long output = 0;
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		struct isr3_permuterm_key* key = isr3_micro_keys + ((i % 2) ? i : (i * 7) % ISR3_MICRO_WORDS);
+		int query_len = 1 + i % 3;
+
+		output = output * 3 + (query_len <= key->key_len && !memcmp(isr3_micro_keys[i].key, key->key, query_len));
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_tokenize(void) {
+	unsigned long output = 0;
+	char* word = NULL;
+	int word_len = 0;
+
+	rewind(isr3_micro_text_fd);
+
+	while (read_word(isr3_micro_text_fd, &word, &word_len) > 0) {
+		output += word_len;
+		free(word);
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_stem(void) {
+	unsigned long output = 0;
+	char buf[16];
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		memcpy(buf, isr3_micro_words[i], isr3_micro_lengths[i] + 1); /* stem() works in place. */
+		output += stem(buf, 0, isr3_micro_lengths[i] - 1);
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_hash(void) {
+	unsigned long output = 0;
+	char hash[ISR3_HASH_LENGTH];
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		hash_word(isr3_micro_words[i], isr3_micro_lengths[i], hash, ISR3_HASH_LENGTH);
+		output ^= *(uint32_t*) hash + i;
+	}
+
+	return output;
+}
+
+unsigned long isr3_micro_word_cmp(void) {
+	unsigned long output = 0;
+
+	for (int i = 0; i < ISR3_MICRO_WORDS; ++i) {
+		int j = (i * 7) % ISR3_MICRO_WORDS;
+		output = output * 3 + 1 + word_cmp(isr3_micro_words[i], isr3_micro_lengths[i], isr3_micro_words[j], isr3_micro_lengths[j]);
+	}
+
+	return output;
+}
@@ -0,0 +1,299 @@
+/*
+ * Stress test for the concurrent (copy-on-write) permuterm index.
+ *
+ *  isr3-stress [--keys N] [--writers N] [--readers N] [--seed N]
+ *
+ * Writer threads insert a seeded set of distinct keys in random order, one at a time under a mutex since the index takes a
+ * single inserter, while reader threads run prefix searches without any lock. A key is committed once its insert returned.
+ * Every search has to return its matches in key order, each key committed before the search began, no key without the
+ * prefix, and a superset of what the same reader last saw for that prefix. Exits with 1 on the first violation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "../isr3.h"
+
+#define ISR3_STRESS_KEY 12 /* Longest key. */
+
+/* Some bytes above 0x7f, so the key order is unsigned like word_cmp(). */
+static const char isr3_stress_alphabet[] = "abce\xc3\xa9\xe2$";
+#define ISR3_STRESS_SYMBOLS ((int) sizeof isr3_stress_alphabet - 1)
+
+struct isr3_stress_key {
+	char key[ISR3_STRESS_KEY];
+	int key_len;
+};
+
+struct isr3_stress_reader {
+	uint64_t state;
+	unsigned long searches;
+	int failed;
+};
+
+/* Shared by every thread. The keys are sorted, so a key's rank is its value in the index. */
+static struct isr3_stress_key* isr3_stress_keys;
+static int isr3_stress_num_keys, isr3_stress_num_writers;
+static uint32_t* isr3_stress_order; // Insert order.
+static unsigned char* isr3_stress_committed;
+static int isr3_stress_done, isr3_stress_failed;
+static struct isr3_permuterm_index* isr3_stress_index;
+static pthread_mutex_t isr3_stress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The values a reader's current search returned. */
+static __thread uint32_t* isr3_stress_found;
+static __thread int isr3_stress_num_found;
+
+static uint64_t isr3_stress_rand(uint64_t* state);
+static int isr3_stress_cmp(const void* a, const void* b);
+static void* isr3_stress_writer(void* arg);
+static void* isr3_stress_reader(void* arg);
+static int isr3_stress_search(struct isr3_stress_reader* reader, int symbol, unsigned char* before, unsigned char* current, unsigned char* seen);
+static void isr3_stress_callback(struct isr3_vocab* vocab, uint32_t word, int search_id);
+
+int main(int argc, char** argv) {
+	static struct option long_options[] = {
+		{"keys", required_argument, NULL, 'k'},
+		{"writers", required_argument, NULL, 'w'},
+		{"readers", required_argument, NULL, 'r'},
+		{"seed", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int num_keys = 50000, num_readers = 4, opt;
+	uint64_t seed = 1;
+
+	isr3_stress_num_writers = 2;
+
+	while ((opt = getopt_long(argc, argv, "k:w:r:s:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'k': num_keys = atoi(optarg); break;
+		case 'w': isr3_stress_num_writers = atoi(optarg); break;
+		case 'r': num_readers = atoi(optarg); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		default:
+			isr3_errf("Usage: %s [--keys N] [--writers N] [--readers N] [--seed N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Readers hold an epoch slot each, see permuterm.h. */
+	if (num_keys < 1 || isr3_stress_num_writers < 1 || num_readers < 1 || num_readers > ISR3_EPOCH_SLOTS) {
+		isr3_errf("Need at least one key, writer and reader, and at most %d readers.\n", ISR3_EPOCH_SLOTS);
+		return 1;
+	}
+
+	uint64_t state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	isr3_stress_keys = malloc(sizeof *isr3_stress_keys * num_keys);
+	isr3_stress_order = malloc(sizeof *isr3_stress_order * num_keys);
+	isr3_stress_committed = calloc(num_keys, 1);
+
+	if (!isr3_stress_keys || !isr3_stress_order || !isr3_stress_committed) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	/* Short keys over a small alphabet share long prefixes, like rotations do. Duplicates are dropped after sorting. */
+	for (int i = 0; i < num_keys; ++i) {
+		struct isr3_stress_key* key = isr3_stress_keys + i;
+
+		key->key_len = 1 + isr3_stress_rand(&state) % ISR3_STRESS_KEY;
+
+		for (int j = 0; j < key->key_len; ++j) {
+			key->key[j] = isr3_stress_alphabet[isr3_stress_rand(&state) % ISR3_STRESS_SYMBOLS];
+		}
+	}
+
+	qsort(isr3_stress_keys, num_keys, sizeof *isr3_stress_keys, isr3_stress_cmp);
+
+	for (int i = 0; i < num_keys; ++i) {
+		if (!isr3_stress_num_keys || isr3_stress_cmp(isr3_stress_keys + isr3_stress_num_keys - 1, isr3_stress_keys + i)) {
+			isr3_stress_keys[isr3_stress_num_keys++] = isr3_stress_keys[i];
+		}
+	}
+
+	for (int i = 0; i < isr3_stress_num_keys; ++i) {
+		uint32_t j = isr3_stress_rand(&state) % (i + 1);
+
+		isr3_stress_order[i] = isr3_stress_order[j];
+		isr3_stress_order[j] = i;
+	}
+
+	if (!(isr3_stress_index = isr3_permuterm_index_create_concurrent(NULL))) {
+		isr3_err("malloc failure\n");
+		return 1;
+	}
+
+	pthread_t writers[isr3_stress_num_writers], readers[num_readers];
+	struct isr3_stress_reader reader_state[num_readers];
+	long writer_ids[isr3_stress_num_writers];
+
+	for (int i = 0; i < num_readers; ++i) {
+		reader_state[i].state = state + 2 * i + 1;
+		reader_state[i].searches = 0;
+		reader_state[i].failed = 0;
+
+		if (pthread_create(readers + i, NULL, isr3_stress_reader, reader_state + i)) {
+			isr3_err("Failed to start a reader.\n");
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < isr3_stress_num_writers; ++i) {
+		writer_ids[i] = i;
+
+		if (pthread_create(writers + i, NULL, isr3_stress_writer, writer_ids + i)) {
+			isr3_err("Failed to start a writer.\n");
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < isr3_stress_num_writers; ++i) {
+		pthread_join(writers[i], NULL);
+	}
+
+	__atomic_store_n(&isr3_stress_done, 1, __ATOMIC_RELEASE);
+
+	unsigned long searches = 0;
+	int failed = 0;
+
+	for (int i = 0; i < num_readers; ++i) {
+		pthread_join(readers[i], NULL);
+		searches += reader_state[i].searches;
+		failed |= reader_state[i].failed;
+	}
+
+	isr3_permuterm_index_free(isr3_stress_index);
+	free(isr3_stress_keys);
+	free(isr3_stress_order);
+	free(isr3_stress_committed);
+
+	printf("isr3-stress keys=%d writers=%d readers=%d searches=%lu result=%s\n", isr3_stress_num_keys, isr3_stress_num_writers, num_readers,
+			searches, failed ? "FAIL" : "ok");
+
+	return failed;
+}
+
+uint64_t isr3_stress_rand(uint64_t* state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 0x2545F4914F6CDD1Dull;
+}
+
+int isr3_stress_cmp(const void* a, const void* b) {
+	const struct isr3_stress_key* x = a, *y = b;
+	int result = memcmp(x->key, y->key, x->key_len < y->key_len ? x->key_len : y->key_len);
+
+	return result ? result : x->key_len - y->key_len;
+}
+
+void* isr3_stress_writer(void* arg) {
+	long writer = *(long*) arg;
+
+	for (int i = writer; i < isr3_stress_num_keys && !__atomic_load_n(&isr3_stress_failed, __ATOMIC_RELAXED); i += isr3_stress_num_writers) {
+		uint32_t key = isr3_stress_order[i];
+
+		pthread_mutex_lock(&isr3_stress_lock);
+		isr3_permuterm_index_insert(isr3_stress_index, isr3_stress_keys[key].key, isr3_stress_keys[key].key_len, key);
+		pthread_mutex_unlock(&isr3_stress_lock);
+
+		__atomic_store_n(isr3_stress_committed + key, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+void* isr3_stress_reader(void* arg) {
+	struct isr3_stress_reader* reader = arg;
+	unsigned char* before = malloc(isr3_stress_num_keys), *current = malloc(isr3_stress_num_keys);
+	unsigned char* seen = calloc((size_t) ISR3_STRESS_SYMBOLS * isr3_stress_num_keys, 1); // What the last search of each prefix found.
+
+	isr3_stress_found = malloc(sizeof *isr3_stress_found * isr3_stress_num_keys);
+
+	if (!before || !current || !seen || !isr3_stress_found) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	/* One last round once every insert is done, which has to find every key. */
+	for (int last = 0; !last && !reader->failed; ) {
+		last = __atomic_load_n(&isr3_stress_done, __ATOMIC_ACQUIRE);
+
+		for (int symbol = 0; symbol < ISR3_STRESS_SYMBOLS && !reader->failed; ++symbol) {
+			int target = last ? symbol : (int) (isr3_stress_rand(&reader->state) % ISR3_STRESS_SYMBOLS);
+
+			if (!isr3_stress_search(reader, target, before, current, seen + (size_t) target * isr3_stress_num_keys)) {
+				reader->failed = 1;
+				__atomic_store_n(&isr3_stress_failed, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (__atomic_load_n(&isr3_stress_failed, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	free(before);
+	free(current);
+	free(seen);
+	free(isr3_stress_found);
+
+	return NULL;
+}
+
+int isr3_stress_search(struct isr3_stress_reader* reader, int symbol, unsigned char* before, unsigned char* current, unsigned char* seen) {
+	char prefix = isr3_stress_alphabet[symbol];
+
+	for (int i = 0; i < isr3_stress_num_keys; ++i) {
+		before[i] = isr3_stress_keys[i].key[0] == prefix && __atomic_load_n(isr3_stress_committed + i, __ATOMIC_ACQUIRE);
+	}
+
+	isr3_stress_num_found = 0;
+	isr3_permuterm_index_search(isr3_stress_index, &prefix, 1, 0, isr3_stress_callback);
+	reader->searches++;
+
+	memset(current, 0, isr3_stress_num_keys);
+
+	if (isr3_stress_num_found > isr3_stress_num_keys) {
+		isr3_errf("Search for [0x%02x] returned %d values for %d keys.\n", (unsigned char) prefix, isr3_stress_num_found, isr3_stress_num_keys);
+		return 0;
+	}
+
+	for (int i = 0; i < isr3_stress_num_found; ++i) {
+		uint32_t key = isr3_stress_found[i];
+
+		if (key >= (uint32_t) isr3_stress_num_keys || isr3_stress_keys[key].key[0] != prefix || (i && key <= isr3_stress_found[i - 1])) {
+			isr3_errf("Search for [0x%02x] returned key %u out of order or without the prefix.\n", (unsigned char) prefix, key);
+			return 0;
+		}
+
+		current[key] = 1;
+	}
+
+	for (int i = 0; i < isr3_stress_num_keys; ++i) {
+		if ((before[i] || seen[i]) && !current[i]) {
+			isr3_errf("Search for [0x%02x] lost key %d [%.*s], which was %s.\n", (unsigned char) prefix, i, isr3_stress_keys[i].key_len, isr3_stress_keys[i].key,
+					before[i] ? "committed before it began" : "found by an earlier search");
+			return 0;
+		}
+	}
+
+	memcpy(seen, current, isr3_stress_num_keys);
+	return 1;
+}
+
+void isr3_stress_callback(struct isr3_vocab* vocab, uint32_t word, int search_id) {
+	/* Every key is distinct, so a search can't return more values than there are keys. */
+	if (isr3_stress_num_found < isr3_stress_num_keys) {
+		isr3_stress_found[isr3_stress_num_found] = word;
+	}
+
+	isr3_stress_num_found++;
+}
@@ -0,0 +1,183 @@
+#include "bufpool.h"
+#include "debug.h"
+#include "mem.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int isr3_buffer_pool_bucket(struct isr3_buffer_pool* pool, int fd, uint64_t page);
+static int isr3_buffer_pool_victim(struct isr3_buffer_pool* pool); /* A free frame, evicting a page if needed. -1 if every frame is pinned. */
+static void isr3_buffer_pool_unlink(struct isr3_buffer_pool* pool, int frame);
+
+struct isr3_buffer_pool* isr3_buffer_pool_create(size_t budget) {
+	/* The frames and their pages count against the budget, the hash table is small next to them. */
+	size_t num_frames = budget / (ISR3_BUFFER_PAGE + sizeof(struct isr3_buffer_frame));
+	struct isr3_buffer_pool* output = NULL;
+
+	if (!num_frames || num_frames > INT32_MAX / 2 || !(output = malloc(sizeof *output))) {
+		return NULL;
+	}
+
+	memset(output, 0, sizeof *output);
+	output->num_frames = num_frames;
+
+	for (output->num_buckets = 16; output->num_buckets < output->num_frames; output->num_buckets *= 2);
+
+	output->frames = isr3_mem_alloc(ISR3_MEM_BUFFER_POOL, sizeof *output->frames * num_frames, 0);
+	output->data = isr3_mem_alloc(ISR3_MEM_BUFFER_POOL, ISR3_BUFFER_PAGE * num_frames, num_frames);
+	output->buckets = isr3_mem_alloc(ISR3_MEM_BUFFER_POOL, sizeof *output->buckets * output->num_buckets, 0);
+
+	if (!output->frames || !output->data || !output->buckets) {
+		isr3_buffer_pool_free(output);
+		return NULL;
+	}
+
+	for (int i = 0; i < output->num_frames; ++i) {
+		output->frames[i].fd = -1;
+		output->frames[i].pins = output->frames[i].referenced = 0;
+	}
+
+	memset(output->buckets, -1, sizeof *output->buckets * output->num_buckets);
+	pthread_mutex_init(&output->lock, NULL);
+
+	return output;
+}
+
+void isr3_buffer_pool_free(struct isr3_buffer_pool* pool) {
+	isr3_mem_free(ISR3_MEM_BUFFER_POOL, pool->frames, sizeof *pool->frames * pool->num_frames, 0);
+	isr3_mem_free(ISR3_MEM_BUFFER_POOL, pool->data, ISR3_BUFFER_PAGE * (size_t) pool->num_frames, pool->num_frames);
+	isr3_mem_free(ISR3_MEM_BUFFER_POOL, pool->buckets, sizeof *pool->buckets * pool->num_buckets, 0);
+
+	if (pool->frames && pool->data && pool->buckets) {
+		pthread_mutex_destroy(&pool->lock);
+	}
+
+	free(pool);
+}
+
+const uint32_t* isr3_buffer_pool_pin(struct isr3_buffer_pool* pool, int fd, uint64_t page, uint32_t* buffer, uint32_t* count, int* frame) {
+	int bucket = isr3_buffer_pool_bucket(pool, fd, page);
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (int cur = pool->buckets[bucket]; cur >= 0; cur = pool->frames[cur].chain) {
+		struct isr3_buffer_frame* hit = pool->frames + cur;
+
+		if (hit->fd == fd && hit->page == page) {
+			hit->pins++;
+			hit->referenced = 1;
+
+			*count = hit->count;
+			*frame = cur;
+
+			pthread_mutex_unlock(&pool->lock);
+			isr3_stats_add(page_hits, 1);
+
+			return pool->data + (size_t) cur * ISR3_BUFFER_PAGE_REFS;
+		}
+	}
+
+	int victim = isr3_buffer_pool_victim(pool);
+	uint32_t* output = victim >= 0 ? pool->data + (size_t) victim * ISR3_BUFFER_PAGE_REFS : buffer;
+	ssize_t read = pread(fd, output, ISR3_BUFFER_PAGE, page * ISR3_BUFFER_PAGE);
+
+	isr3_stats_add(page_misses, 1);
+
+	if (read < (ssize_t) sizeof *output) {
+		pthread_mutex_unlock(&pool->lock);
+		isr3_err("Failed to read postings from disk.\n");
+		return NULL; /* The victim stays free. */
+	}
+
+	if (victim >= 0) {
+		struct isr3_buffer_frame* miss = pool->frames + victim;
+
+		miss->fd = fd;
+		miss->page = page;
+		miss->count = read / sizeof *output;
+		miss->pins = miss->referenced = 1;
+		miss->chain = pool->buckets[bucket];
+		pool->buckets[bucket] = victim;
+	} else {
+		isr3_stats_add(page_bypasses, 1);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	*count = read / sizeof *output;
+	*frame = victim;
+
+	return output;
+}
+
+void isr3_buffer_pool_unpin(struct isr3_buffer_pool* pool, int frame) {
+	if (frame < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->frames[frame].pins--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void isr3_buffer_pool_forget(struct isr3_buffer_pool* pool, int fd) {
+	/* The descriptor may be reused by another file as soon as it's closed, so its pages have to go now. */
+	pthread_mutex_lock(&pool->lock);
+
+	for (int i = 0; i < pool->num_frames; ++i) {
+		if (pool->frames[i].fd == fd) {
+			isr3_buffer_pool_unlink(pool, i);
+			pool->frames[i].fd = -1;
+			pool->frames[i].referenced = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int isr3_buffer_pool_bucket(struct isr3_buffer_pool* pool, int fd, uint64_t page) {
+	uint64_t hash = (page * 0x9e3779b97f4a7c15ull) ^ ((uint64_t) fd * 0xc2b2ae3d27d4eb4full);
+
+	return (hash >> 32) & (pool->num_buckets - 1);
+}
+
+int isr3_buffer_pool_victim(struct isr3_buffer_pool* pool) {
+	/* Two sweeps clear every reference bit, so a frame which isn't pinned turns up by then if there is one. */
+	for (int i = 0; i < 2 * pool->num_frames; ++i) {
+		int cur = pool->hand;
+		struct isr3_buffer_frame* frame = pool->frames + cur;
+
+		pool->hand = (pool->hand + 1) % pool->num_frames;
+
+		if (frame->pins) {
+			continue;
+		}
+
+		if (frame->fd >= 0 && frame->referenced) {
+			frame->referenced = 0; /* Second chance. */
+			continue;
+		}
+
+		if (frame->fd >= 0) {
+			isr3_buffer_pool_unlink(pool, cur);
+			frame->fd = -1;
+			isr3_stats_add(page_evictions, 1);
+		}
+
+		return cur;
+	}
+
+	return -1;
+}
+
+void isr3_buffer_pool_unlink(struct isr3_buffer_pool* pool, int frame) {
+	int* cur = pool->buckets + isr3_buffer_pool_bucket(pool, pool->frames[frame].fd, pool->frames[frame].page);
+
+	while (*cur != frame) {
+		cur = &pool->frames[*cur].chain;
+	}
+
+	*cur = pool->frames[frame].chain;
+}
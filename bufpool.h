@@ -0,0 +1,60 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define ISR3_BUFFER_PAGE 4096 /* Bytes per page of a postings file. */
+#define ISR3_BUFFER_PAGE_REFS (ISR3_BUFFER_PAGE / sizeof(uint32_t))
+
+/*
+ * Buffer pool for postings on disk (`--buffer-pool`).
+ *
+ * Postings files are flat arrays of ref IDs, read in fixed-size pages into a fixed number of frames, as many as fit in the
+ * pool's budget. Frames are found by (file descriptor, page number) through a hash table.
+ *
+ * Every frame has a pin count and a reference bit. A postings cursor pins the page it is walking until it moves on to the
+ * next one, so a page is never evicted while a query reads from it. A miss takes a free frame or evicts with the clock
+ * algorithm: the hand sweeps the frames, clearing reference bits, and takes the first unpinned frame whose bit is already
+ * clear. Pages which are read again before the hand comes around stay, so the postings of hot terms stay in memory however
+ * large the collection is. If every frame is pinned, the page is read into the caller's own buffer instead (a bypass).
+ *
+ * The query loop, the ingest thread and the segment merger all read postings, so the pool takes a mutex. Misses read their
+ * page under it, pages are small enough that this doesn't matter next to the read itself.
+ *
+ * Hits, misses, evictions and bypasses are counted in the stats, see stats.h.
+ */
+
+struct isr3_buffer_frame {
+	int fd; // -1 while the frame is free.
+	uint64_t page;
+	uint32_t count; // Ref IDs read, less than a page at the end of a file.
+	int pins, referenced;
+	int chain; // Next frame in the same hash bucket, -1 at the end.
+};
+
+struct isr3_buffer_pool {
+	pthread_mutex_t lock;
+
+	struct isr3_buffer_frame* frames;
+	uint32_t* data; // ISR3_BUFFER_PAGE_REFS per frame.
+	int num_frames, hand;
+
+	int* buckets; // -1 for an empty bucket.
+	int num_buckets;
+};
+
+struct isr3_buffer_pool* isr3_buffer_pool_create(size_t budget); /* NULL if the budget doesn't fit a single page. */
+void isr3_buffer_pool_free(struct isr3_buffer_pool* pool);
+
+/*
+ * Returns the page and the number of ref IDs in it, NULL if it can't be read. The page is pinned until it is passed to
+ * unpin() with the frame number returned in `frame`, which is -1 if the page was read into `buffer` (a page's worth) instead.
+ */
+const uint32_t* isr3_buffer_pool_pin(struct isr3_buffer_pool* pool, int fd, uint64_t page, uint32_t* buffer, uint32_t* count, int* frame);
+void isr3_buffer_pool_unpin(struct isr3_buffer_pool* pool, int frame);
+
+void isr3_buffer_pool_forget(struct isr3_buffer_pool* pool, int fd); /* Drops the pages of a file before it is closed, none of them may be pinned. */
+
+#endif
@@ -0,0 +1,525 @@
+#include "cache.h"
+#include "isr3.h"
+#include "mem.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static unsigned int isr3_cache_hash(const char* key, int key_len);
+static int isr3_query_term_cmp(const void* a, const void* b);
+static void isr3_query_cache_unlink(struct isr3_query_cache* cache, struct isr3_query_cache_entry* entry);
+static void isr3_query_cache_entry_free(struct isr3_query_cache_entry* entry);
+static void isr3_term_cache_heap_swap(struct isr3_term_cache* cache, unsigned int a, unsigned int b);
+static void isr3_term_cache_heap_down(struct isr3_term_cache* cache, unsigned int pos);
+static void isr3_term_cache_heap_up(struct isr3_term_cache* cache, unsigned int pos);
+static void isr3_term_cache_remove(struct isr3_term_cache* cache, struct isr3_term_cache_entry* entry);
+static void isr3_term_cache_entry_free(struct isr3_term_cache_entry* entry);
+static void isr3_term_cache_grow(struct isr3_term_cache* cache);
+
+static __thread struct isr3_term_cache* isr3_term_cache_collector = NULL;
+
+struct isr3_query_cache* isr3_query_cache_create(unsigned int capacity) {
+	struct isr3_query_cache* output = malloc(sizeof *output);
+
+	if (!output) {
+		return NULL;
+	}
+
+	memset(output, 0, sizeof *output);
+	output->capacity = capacity;
+
+	/* About one entry per bucket when the cache is full. */
+	for (output->num_buckets = 16; output->num_buckets < capacity; output->num_buckets *= 2);
+
+	if (!(output->buckets = calloc(output->num_buckets, sizeof *output->buckets))) {
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+void isr3_query_cache_free(struct isr3_query_cache* cache) {
+	struct isr3_query_cache_entry* cur = cache->head, *tmp = NULL;
+
+	while (cur) {
+		tmp = cur->next;
+		isr3_query_cache_entry_free(cur);
+		cur = tmp;
+	}
+
+	free(cache->buckets);
+	free(cache);
+}
+
+int isr3_query_cache_key(struct isr3_query_term* terms, int num_terms, char* out) {
+	/* AND is commutative and idempotent, so queries which only differ in term order or repeated terms share an entry. */
+	struct isr3_query_term* sorted = malloc(sizeof *sorted * num_terms + 1);
+	int length = 0;
+
+	if (!sorted) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	memcpy(sorted, terms, sizeof *sorted * num_terms);
+	qsort(sorted, num_terms, sizeof *sorted, isr3_query_term_cmp);
+
+	for (int i = 0; i < num_terms; ++i) {
+		if (i && !isr3_query_term_cmp(sorted + i, sorted + i - 1)) {
+			continue;
+		}
+
+		if (i) {
+			out[length++] = ' ';
+		}
+
+		memcpy(out + length, sorted[i].str, sorted[i].len);
+		length += sorted[i].len;
+	}
+
+	free(sorted);
+	return length;
+}
+
+int isr3_query_cache_lookup(struct isr3_query_cache* cache, const char* key, int key_len, unsigned long version, unsigned int** ids, unsigned int* num_ids) {
+	unsigned int hash = isr3_cache_hash(key, key_len);
+	struct isr3_query_cache_entry** cur = &cache->buckets[hash & (cache->num_buckets - 1)];
+
+	for (; *cur; cur = &(*cur)->chain) {
+		struct isr3_query_cache_entry* entry = *cur;
+
+		if (entry->hash != hash || entry->key_len != key_len || memcmp(entry->key, key, key_len)) {
+			continue;
+		}
+
+		if (entry->version != version) {
+			/* The index changed since this result was computed. */
+			isr3_query_cache_unlink(cache, entry);
+			isr3_query_cache_entry_free(entry);
+			cache->invalidations++;
+			break;
+		}
+
+		/* Move to the front of the LRU list. */
+		if (cache->head != entry) {
+			entry->prev->next = entry->next;
+
+			if (entry->next) {
+				entry->next->prev = entry->prev;
+			} else {
+				cache->tail = entry->prev;
+			}
+
+			entry->prev = NULL;
+			entry->next = cache->head;
+			cache->head->prev = entry;
+			cache->head = entry;
+		}
+
+		*ids = entry->ids;
+		*num_ids = entry->num_ids;
+
+		cache->hits++;
+		return 1;
+	}
+
+	cache->misses++;
+	return 0;
+}
+
+void isr3_query_cache_insert(struct isr3_query_cache* cache, const char* key, int key_len, unsigned long version, const unsigned int* ids, unsigned int num_ids) {
+	if (!cache->capacity) {
+		return;
+	}
+
+	if (cache->num_entries >= cache->capacity) {
+		struct isr3_query_cache_entry* victim = cache->tail;
+
+		isr3_query_cache_unlink(cache, victim);
+		isr3_query_cache_entry_free(victim);
+		cache->evictions++;
+	}
+
+	struct isr3_query_cache_entry* entry = isr3_mem_alloc(ISR3_MEM_CACHE, sizeof *entry, 1);
+
+	if (!entry || !(entry->key = isr3_mem_alloc(ISR3_MEM_CACHE, key_len + 1, 0)) || !(entry->ids = isr3_mem_alloc(ISR3_MEM_CACHE, sizeof *ids * num_ids + 1, 0))) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	memcpy(entry->key, key, key_len);
+	memcpy(entry->ids, ids, sizeof *ids * num_ids);
+
+	entry->key_len = key_len;
+	entry->hash = isr3_cache_hash(key, key_len);
+	entry->version = version;
+	entry->num_ids = num_ids;
+
+	struct isr3_query_cache_entry** bucket = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+
+	entry->chain = *bucket;
+	*bucket = entry;
+
+	entry->prev = NULL;
+	entry->next = cache->head;
+
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+
+	cache->head = entry;
+	cache->num_entries++;
+}
+
+void isr3_query_cache_dump(struct isr3_query_cache* cache, FILE* fd) {
+	unsigned long lookups = cache->hits + cache->misses;
+
+	fprintf(fd, "isr3-cache name=query entries=%u capacity=%u hits=%lu misses=%lu hit_rate=%.3f evictions=%lu invalidations=%lu\n",
+			cache->num_entries, cache->capacity, cache->hits, cache->misses, lookups ? (double) cache->hits / lookups : 0.0,
+			cache->evictions, cache->invalidations);
+}
+
+struct isr3_term_cache* isr3_term_cache_create(size_t budget, unsigned int universe) {
+	struct isr3_term_cache* output = malloc(sizeof *output);
+
+	if (!output) {
+		return NULL;
+	}
+
+	memset(output, 0, sizeof *output);
+	output->budget = budget;
+	output->universe = universe;
+	output->num_buckets = 16;
+
+	if (!(output->buckets = calloc(output->num_buckets, sizeof *output->buckets)) || !(output->heap = malloc(sizeof *output->heap * output->num_buckets))
+			|| !(output->scratch = calloc((universe + 31) / 32 + 1, sizeof *output->scratch))) {
+		free(output->buckets);
+		free(output->heap);
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+void isr3_term_cache_free(struct isr3_term_cache* cache) {
+	for (unsigned int i = 0; i < cache->num_entries; ++i) {
+		isr3_term_cache_entry_free(cache->heap[i]);
+	}
+
+	if (cache->rejected_set) {
+		isr3_mem_free(ISR3_MEM_CACHE, cache->rejected_set, sizeof *cache->rejected_set + sizeof *cache->rejected_set->data * (cache->rejected_set->bitmap ? (cache->rejected_set->universe + 31) / 32 : cache->rejected_set->num_ids), 1);
+	}
+
+	free(cache->scratch);
+	free(cache->buckets);
+	free(cache->heap);
+	free(cache);
+}
+
+struct isr3_doc_set* isr3_term_cache_lookup(struct isr3_term_cache* cache, const char* key, int key_len, unsigned long version) {
+	unsigned int hash = isr3_cache_hash(key, key_len);
+
+	for (struct isr3_term_cache_entry* entry = cache->buckets[hash & (cache->num_buckets - 1)]; entry; entry = entry->chain) {
+		if (entry->hash != hash || entry->key_len != key_len || memcmp(entry->key, key, key_len)) {
+			continue;
+		}
+
+		if (entry->version != version) {
+			isr3_term_cache_remove(cache, entry);
+			isr3_term_cache_entry_free(entry);
+			cache->invalidations++;
+			break;
+		}
+
+		/* A hit restores the entry's full value on top of the current L, so it only ever moves away from the eviction end. */
+		entry->value = cache->inflation + (double) entry->cost / entry->size;
+		isr3_term_cache_heap_down(cache, entry->heap_pos);
+
+		cache->hits++;
+		return entry->set;
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+void isr3_term_cache_collect_begin(struct isr3_term_cache* cache) {
+	cache->scratch_cost = 0;
+	isr3_term_cache_collector = cache;
+}
+
+void isr3_term_cache_collect(struct isr3_vocab* vocab, uint32_t word, int search_id) {
+	struct isr3_term_cache* cache = isr3_term_cache_collector;
+	struct isr3_postings postings;
+	unsigned int cur_ref = 0;
+	unsigned long walked = 0;
+
+	(void) search_id;
+
+	isr3_vocab_postings(vocab, word, &postings);
+
+	while (isr3_postings_next(&postings, &cur_ref)) {
+		if (cur_ref < cache->universe) {
+			cache->scratch[cur_ref / 32] |= (uint32_t) 1 << (cur_ref % 32);
+		}
+
+		++walked;
+	}
+
+	cache->scratch_cost += walked + 1;
+	isr3_stats_add(postings, walked);
+}
+
+struct isr3_doc_set* isr3_term_cache_collect_end(struct isr3_term_cache* cache, const char* key, int key_len, unsigned long version) {
+	unsigned int num_words = (cache->universe + 31) / 32, num_ids = 0;
+
+	isr3_term_cache_collector = NULL;
+
+	for (unsigned int i = 0; i < num_words; ++i) {
+		num_ids += __builtin_popcount(cache->scratch[i]);
+	}
+
+	int bitmap = num_words < num_ids;
+	size_t set_size = sizeof(struct isr3_doc_set) + sizeof(uint32_t) * (bitmap ? num_words : num_ids);
+	struct isr3_doc_set* set = isr3_mem_alloc(ISR3_MEM_CACHE, set_size, 1);
+
+	if (!set) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	set->num_ids = num_ids;
+	set->universe = cache->universe;
+	set->bitmap = bitmap;
+
+	if (bitmap) {
+		memcpy(set->data, cache->scratch, sizeof *set->data * num_words);
+	} else {
+		for (unsigned int i = 0, n = 0; i < num_words; ++i) {
+			for (uint32_t bits = cache->scratch[i]; bits; bits &= bits - 1) {
+				set->data[n++] = i * 32 + __builtin_ctz(bits);
+			}
+		}
+	}
+
+	memset(cache->scratch, 0, sizeof *cache->scratch * num_words);
+
+	if (cache->rejected_set) {
+		isr3_mem_free(ISR3_MEM_CACHE, cache->rejected_set, sizeof *cache->rejected_set + sizeof *cache->rejected_set->data * (cache->rejected_set->bitmap ? num_words : cache->rejected_set->num_ids), 1);
+		cache->rejected_set = NULL;
+	}
+
+	size_t size = sizeof(struct isr3_term_cache_entry) + key_len + 1 + set_size;
+
+	if (size > cache->budget) {
+		cache->rejected++;
+		cache->rejected_set = set;
+		return set;
+	}
+
+	while (cache->used + size > cache->budget) {
+		struct isr3_term_cache_entry* victim = cache->heap[0];
+
+		cache->inflation = victim->value;
+		isr3_term_cache_remove(cache, victim);
+		isr3_term_cache_entry_free(victim);
+		cache->evictions++;
+	}
+
+	struct isr3_term_cache_entry* entry = isr3_mem_alloc(ISR3_MEM_CACHE, sizeof *entry, 1);
+
+	if (!entry || !(entry->key = isr3_mem_alloc(ISR3_MEM_CACHE, key_len + 1, 0))) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	memcpy(entry->key, key, key_len);
+
+	entry->key_len = key_len;
+	entry->hash = isr3_cache_hash(key, key_len);
+	entry->version = version;
+	entry->set = set;
+	entry->size = size;
+	entry->cost = cache->scratch_cost;
+	entry->value = cache->inflation + (double) entry->cost / entry->size;
+
+	if (cache->num_entries >= cache->num_buckets) {
+		isr3_term_cache_grow(cache);
+	}
+
+	struct isr3_term_cache_entry** bucket = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+
+	entry->chain = *bucket;
+	*bucket = entry;
+
+	entry->heap_pos = cache->num_entries;
+	cache->heap[cache->num_entries++] = entry;
+	isr3_term_cache_heap_up(cache, entry->heap_pos);
+
+	cache->used += size;
+	return set;
+}
+
+unsigned int isr3_doc_set_decode(struct isr3_doc_set* set, unsigned int* out) {
+	if (!set->bitmap) {
+		memcpy(out, set->data, sizeof *set->data * set->num_ids);
+		return set->num_ids;
+	}
+
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < (set->universe + 31) / 32; ++i) {
+		for (uint32_t bits = set->data[i]; bits; bits &= bits - 1) {
+			out[count++] = i * 32 + __builtin_ctz(bits);
+		}
+	}
+
+	return count;
+}
+
+void isr3_term_cache_dump(struct isr3_term_cache* cache, FILE* fd) {
+	unsigned long lookups = cache->hits + cache->misses;
+
+	fprintf(fd, "isr3-cache name=term entries=%u bytes=%zu budget=%zu hits=%lu misses=%lu hit_rate=%.3f evictions=%lu invalidations=%lu rejected=%lu\n",
+			cache->num_entries, cache->used, cache->budget, cache->hits, cache->misses, lookups ? (double) cache->hits / lookups : 0.0,
+			cache->evictions, cache->invalidations, cache->rejected);
+}
+
+unsigned int isr3_cache_hash(const char* key, int key_len) {
+	uint32_t output = 0;
+
+	if (key_len) {
+		hash_word((char*) key, key_len, (char*) &output, sizeof output);
+	}
+
+	return output;
+}
+
+int isr3_query_term_cmp(const void* a, const void* b) {
+	const struct isr3_query_term* x = a, *y = b;
+	return word_cmp(x->str, x->len, y->str, y->len);
+}
+
+void isr3_query_cache_unlink(struct isr3_query_cache* cache, struct isr3_query_cache_entry* entry) {
+	struct isr3_query_cache_entry** cur = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+
+	while (*cur != entry) {
+		cur = &(*cur)->chain;
+	}
+
+	*cur = entry->chain;
+
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	cache->num_entries--;
+}
+
+void isr3_query_cache_entry_free(struct isr3_query_cache_entry* entry) {
+	isr3_mem_free(ISR3_MEM_CACHE, entry->ids, sizeof *entry->ids * entry->num_ids + 1, 0);
+	isr3_mem_free(ISR3_MEM_CACHE, entry->key, entry->key_len + 1, 0);
+	isr3_mem_free(ISR3_MEM_CACHE, entry, sizeof *entry, 1);
+}
+
+void isr3_term_cache_heap_swap(struct isr3_term_cache* cache, unsigned int a, unsigned int b) {
+	struct isr3_term_cache_entry* tmp = cache->heap[a];
+
+	cache->heap[a] = cache->heap[b];
+	cache->heap[b] = tmp;
+	cache->heap[a]->heap_pos = a;
+	cache->heap[b]->heap_pos = b;
+}
+
+void isr3_term_cache_heap_down(struct isr3_term_cache* cache, unsigned int pos) {
+	for (;;) {
+		unsigned int smallest = pos, left = 2 * pos + 1, right = 2 * pos + 2;
+
+		if (left < cache->num_entries && cache->heap[left]->value < cache->heap[smallest]->value) {
+			smallest = left;
+		}
+
+		if (right < cache->num_entries && cache->heap[right]->value < cache->heap[smallest]->value) {
+			smallest = right;
+		}
+
+		if (smallest == pos) {
+			return;
+		}
+
+		isr3_term_cache_heap_swap(cache, pos, smallest);
+		pos = smallest;
+	}
+}
+
+void isr3_term_cache_heap_up(struct isr3_term_cache* cache, unsigned int pos) {
+	while (pos && cache->heap[pos]->value < cache->heap[(pos - 1) / 2]->value) {
+		isr3_term_cache_heap_swap(cache, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+}
+
+void isr3_term_cache_remove(struct isr3_term_cache* cache, struct isr3_term_cache_entry* entry) {
+	struct isr3_term_cache_entry** cur = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+	unsigned int pos = entry->heap_pos;
+
+	while (*cur != entry) {
+		cur = &(*cur)->chain;
+	}
+
+	*cur = entry->chain;
+
+	/* Move the last heap entry into the hole, then restore the heap in whichever direction it's off. */
+	if (pos != --cache->num_entries) {
+		isr3_term_cache_heap_swap(cache, pos, cache->num_entries);
+		isr3_term_cache_heap_down(cache, pos);
+		isr3_term_cache_heap_up(cache, pos);
+	}
+
+	cache->used -= entry->size;
+}
+
+void isr3_term_cache_entry_free(struct isr3_term_cache_entry* entry) {
+	size_t set_size = entry->size - sizeof *entry - (entry->key_len + 1);
+
+	isr3_mem_free(ISR3_MEM_CACHE, entry->set, set_size, 1);
+	isr3_mem_free(ISR3_MEM_CACHE, entry->key, entry->key_len + 1, 0);
+	isr3_mem_free(ISR3_MEM_CACHE, entry, sizeof *entry, 1);
+}
+
+void isr3_term_cache_grow(struct isr3_term_cache* cache) {
+	unsigned int num_buckets = cache->num_buckets * 2;
+	struct isr3_term_cache_entry** buckets = calloc(num_buckets, sizeof *buckets), **heap = realloc(cache->heap, sizeof *heap * num_buckets);
+
+	if (!buckets || !heap) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < cache->num_buckets; ++i) {
+		for (struct isr3_term_cache_entry* cur = cache->buckets[i], *next = NULL; cur; cur = next) {
+			next = cur->chain;
+			cur->chain = buckets[cur->hash & (num_buckets - 1)];
+			buckets[cur->hash & (num_buckets - 1)] = cur;
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->heap = heap;
+	cache->num_buckets = num_buckets;
+}
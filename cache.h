@@ -0,0 +1,127 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct isr3_vocab;
+
+#define ISR3_QUERY_CACHE_ENTRIES 1024 /* Default number of queries the result cache remembers. */
+#define ISR3_TERM_CACHE_BYTES (8 << 20) /* Default memory budget of the term cache. */
+
+/*
+ * Query result cache.
+ *
+ * Maps a normalized query (see isr3_query_cache_key()) to the ref IDs it matched. Entries remember the index version they
+ * were computed against and are dropped when they're looked up against any other version, so adding documents never has
+ * to touch the cache. The least recently used entry is evicted once the cache holds `capacity` entries.
+ *
+ * The cache belongs to the query loop and isn't thread-safe.
+ */
+
+struct isr3_query_term {
+	char* str; // Stemmed in place unless the term has wildcards.
+	int len, wildcards;
+};
+
+struct isr3_query_cache_entry {
+	char* key;
+	int key_len;
+	unsigned int hash;
+	unsigned long version;
+
+	unsigned int* ids, num_ids;
+
+	struct isr3_query_cache_entry* chain; // Next entry in the same hash bucket.
+	struct isr3_query_cache_entry* prev, *next; // LRU order, most recently used first.
+};
+
+struct isr3_query_cache {
+	struct isr3_query_cache_entry** buckets, *head, *tail;
+	unsigned int num_buckets, num_entries, capacity;
+
+	unsigned long hits, misses, evictions, invalidations;
+};
+
+struct isr3_query_cache* isr3_query_cache_create(unsigned int capacity);
+void isr3_query_cache_free(struct isr3_query_cache* cache);
+
+/* Writes the normalized query (terms sorted and deduplicated, separated by spaces) to `out` and returns its length. `out` needs room for the whole query. */
+int isr3_query_cache_key(struct isr3_query_term* terms, int num_terms, char* out);
+
+/* Returns 1 and the cached IDs (owned by the cache, valid until the next insert) on a hit. */
+int isr3_query_cache_lookup(struct isr3_query_cache* cache, const char* key, int key_len, unsigned long version, unsigned int** ids, unsigned int* num_ids);
+void isr3_query_cache_insert(struct isr3_query_cache* cache, const char* key, int key_len, unsigned long version, const unsigned int* ids, unsigned int num_ids);
+
+/* One `isr3-cache name=query ..` line with the hit rate and size, next to the stats output. */
+void isr3_query_cache_dump(struct isr3_query_cache* cache, FILE* fd);
+
+/*
+ * Term cache.
+ *
+ * Maps a wildcard pattern, as the query spells it, to the union of the postings of every word it matches, over all segments
+ * and whichever engine answered it. Broad wildcards like `a*` walk thousands of words and their postings on every query,
+ * but shrink to a small doc ID set, so they're worth keeping even when whole queries never repeat.
+ *
+ * Entries are evicted GreedyDual-Size style once they exceed `budget` bytes: each entry is worth L + cost / size, where cost
+ * is the work the search took (postings walked and words visited) and size its bytes, and the cheapest entry goes first.
+ * L is raised to the value of every evicted entry, so entries which aren't used age out even if they were expensive once.
+ * Versions work as in the query cache.
+ */
+
+/* Either a sorted list of IDs or a bitmap over all ref IDs, whichever is smaller. */
+struct isr3_doc_set {
+	unsigned int num_ids, universe;
+	int bitmap;
+	uint32_t data[];
+};
+
+struct isr3_term_cache_entry {
+	char* key;
+	int key_len;
+	unsigned int hash;
+	unsigned long version;
+
+	struct isr3_doc_set* set;
+	size_t size; // Everything this entry allocated.
+	unsigned long cost;
+	double value; // GreedyDual-Size priority, L + cost / size.
+	unsigned int heap_pos;
+
+	struct isr3_term_cache_entry* chain;
+};
+
+struct isr3_term_cache {
+	struct isr3_term_cache_entry** buckets, **heap; // `heap` is a min-heap on `value`.
+	unsigned int num_buckets, num_entries, universe;
+	size_t budget, used;
+	double inflation; // L
+
+	uint32_t* scratch; // Bitmap the collector fills while a pattern is searched.
+	unsigned long scratch_cost;
+	struct isr3_doc_set* rejected_set; // The last set which didn't fit, until the next one.
+
+	unsigned long hits, misses, evictions, invalidations, rejected;
+};
+
+struct isr3_term_cache* isr3_term_cache_create(size_t budget, unsigned int universe);
+void isr3_term_cache_free(struct isr3_term_cache* cache);
+
+/* Returns the cached set (owned by the cache, valid until the next insert) or NULL. */
+struct isr3_doc_set* isr3_term_cache_lookup(struct isr3_term_cache* cache, const char* key, int key_len, unsigned long version);
+
+/*
+ * Searching a pattern into the cache: isr3_term_cache_collect() is the search callback between begin() and end(), and end()
+ * turns the words it collected into a set, which is inserted if it fits the budget. The returned set stays valid until the
+ * next insert either way. Only one cache can collect at a time.
+ */
+void isr3_term_cache_collect_begin(struct isr3_term_cache* cache);
+void isr3_term_cache_collect(struct isr3_vocab* vocab, uint32_t word, int search_id);
+struct isr3_doc_set* isr3_term_cache_collect_end(struct isr3_term_cache* cache, const char* key, int key_len, unsigned long version);
+
+/* Writes the IDs of `set` in ascending order to `out` and returns how many there are. */
+unsigned int isr3_doc_set_decode(struct isr3_doc_set* set, unsigned int* out);
+
+void isr3_term_cache_dump(struct isr3_term_cache* cache, FILE* fd);
+
+#endif
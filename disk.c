@@ -0,0 +1,920 @@
+#include "disk.h"
+#include "isr3.h"
+#include "mem.h"
+#include "perf.h"
+#include "segment.h"
+#include "sort.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ISR3_DISK_FINAL UINT32_MAX /* Output "run" of the last pass of a merge, which writes the index itself. */
+
+/* A run being merged, positioned on its current record. */
+struct isr3_disk_run {
+	FILE* fd;
+	uint32_t left; // Postings runs only: the words after the current one.
+	int index; // Position among the runs of the merge, ties go to the earlier run.
+	struct isr3_segment_record rec; // The current word and its postings, or the current rotation (in `rec.word`).
+	uint32_t word_id; // Rotation runs only: the word the rotation belongs to.
+};
+
+struct isr3_disk_build {
+	const char* dir;
+	int fan_in; // Runs merged at once.
+	unsigned int num_post_runs, num_rot_runs; // Run files ever created, for their names and the cleanup.
+
+	/* The index files, written by the last pass of each merge. */
+	FILE* lex, *post, *rot;
+	struct isr3_disk_header hdr;
+
+	/* Rotations of the words written so far which aren't in a run yet, see isr3_permuterm_index_build(). */
+	char* chars; // 2 * max_items bytes: word$word$ per word.
+	struct isr3_sort_item* items;
+	size_t num_items, max_items;
+
+	uint32_t* refs; // Postings of a word found in more than one run.
+	uint32_t max_refs;
+};
+
+static int isr3_disk_parse(struct isr3_disk_build* build, char** files, int num_files, size_t budget);
+static unsigned long isr3_disk_resident(void);
+static int isr3_disk_reduce(struct isr3_disk_build* build, unsigned int* num_runs, int (*merge)(struct isr3_disk_build* build, unsigned int first, unsigned int count, unsigned int output));
+static int isr3_disk_merge_postings(struct isr3_disk_build* build, unsigned int first, unsigned int count, unsigned int output);
+static int isr3_disk_merge_rotations(struct isr3_disk_build* build, unsigned int first, unsigned int count, unsigned int output);
+static int isr3_disk_add_word(struct isr3_disk_build* build, char* word, uint32_t word_len, const uint32_t* refs, uint32_t num_refs);
+static int isr3_disk_spill_rotations(struct isr3_disk_build* build);
+static int isr3_disk_finish(struct isr3_disk_build* build);
+static void isr3_disk_cleanup(struct isr3_disk_build* build);
+
+static int isr3_disk_next_word(struct isr3_disk_run* run); /* 1 on the next record, 0 past the last one and -1 if the run is truncated. */
+static int isr3_disk_next_rotation(struct isr3_disk_run* run);
+static void isr3_disk_close_runs(struct isr3_disk_run* runs, unsigned int count);
+static void isr3_disk_heap_push(struct isr3_disk_run** heap, int* size, struct isr3_disk_run* run);
+static struct isr3_disk_run* isr3_disk_heap_pop(struct isr3_disk_run** heap, int* size);
+static int isr3_disk_run_cmp(struct isr3_disk_run* a, struct isr3_disk_run* b);
+static char* isr3_disk_path(const char* dir, const char* name, unsigned int run); /* `dir`/`name`, or a run file if `run` isn't ISR3_DISK_FINAL. */
+
+static void isr3_disk_index_scan(struct isr3_disk_index* index, char* probe, int probe_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+static int isr3_disk_index_read(struct isr3_disk_index* index, uint64_t first, uint64_t count, uint32_t* records);
+static int isr3_disk_rotation_cmp(struct isr3_disk_index* index, const uint32_t* record, char* probe, int probe_len, int* rot_len);
+
+int isr3_disk_build(const char* dir, char** files, int num_files, size_t budget) {
+	struct isr3_disk_build build;
+
+	if (budget < ISR3_DISK_BUDGET_MIN) {
+		isr3_errf("A memory budget of %zu bytes is too small, builds need at least %d.\n", budget, ISR3_DISK_BUDGET_MIN);
+		return 0;
+	}
+
+	memset(&build, 0, sizeof build);
+
+	build.dir = dir;
+	build.fan_in = budget / 4 / ISR3_DISK_RUN_BUFFER;
+
+	if (build.fan_in < 2) {
+		build.fan_in = 2;
+	}
+
+	/* Each rotation costs two bytes of word$word$, its sort item and the sort's scratch copy of the item. */
+	build.max_items = budget / 2 / (2 + 2 * sizeof *build.items);
+
+	if (!isr3_disk_parse(&build, files, num_files, budget)) {
+		isr3_disk_cleanup(&build);
+		return 0;
+	}
+
+	char* lex_path = isr3_disk_path(dir, "index.lex", ISR3_DISK_FINAL), *post_path = isr3_disk_path(dir, "index.post", ISR3_DISK_FINAL);
+	char* rot_path = isr3_disk_path(dir, "index.rot", ISR3_DISK_FINAL);
+
+	build.lex = fopen(lex_path, "wb");
+	build.post = fopen(post_path, "wb");
+	build.rot = fopen(rot_path, "wb");
+
+	free(lex_path);
+	free(post_path);
+	free(rot_path);
+
+	build.chars = malloc(2 * build.max_items);
+	build.items = malloc(sizeof *build.items * build.max_items);
+
+	if (!build.chars || !build.items) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	/* Room for the header, it is rewritten once the counts are known. */
+	int result = build.lex && build.post && build.rot && fwrite(&build.hdr, sizeof build.hdr, 1, build.lex) == 1;
+
+	if (!result) {
+		isr3_errf("Failed to create the index files in [%s].\n", dir);
+	}
+
+	isr3_debugf("merging %u postings runs, %d at a time\n", build.num_post_runs, build.fan_in);
+
+	result = result && isr3_disk_reduce(&build, &build.num_post_runs, isr3_disk_merge_postings) && isr3_disk_spill_rotations(&build);
+
+	free(build.chars);
+	free(build.items);
+	free(build.refs);
+
+	isr3_debugf("merging %u rotation runs, %d at a time\n", build.num_rot_runs, build.fan_in);
+
+	result = result && isr3_disk_reduce(&build, &build.num_rot_runs, isr3_disk_merge_rotations);
+	result = isr3_disk_finish(&build) && result;
+
+	if (!result) {
+		isr3_disk_cleanup(&build);
+	}
+
+	return result;
+}
+
+int isr3_disk_parse(struct isr3_disk_build* build, char** files, int num_files, size_t budget) {
+	/* Files are parsed into a private segment which is written out as a run, and emptied, once it takes half the budget. */
+	struct isr3_segment seg;
+	int result = 1;
+
+	memset(&seg, 0, sizeof seg);
+	isr3_vocab_init(&seg.vocab);
+
+	for (int i = 0; i < num_files && result; ++i) {
+		isr3_debugf("Parsing input file %s..\n", files[i]);
+
+		if (!parse_file(files[i], i, &seg.root, &seg.vocab, NULL)) {
+			isr3_errf("Parsing failed for file [%s].\n", files[i]);
+			result = 0;
+			break;
+		}
+
+		seg.num_docs++;
+
+		if (i < num_files - 1 && isr3_disk_resident() < budget / 2) {
+			continue;
+		}
+
+		char* path = isr3_disk_path(build->dir, "post", build->num_post_runs++);
+
+		isr3_debugf("writing postings run [%s] with %u documents\n", path, seg.num_docs);
+		result = isr3_segment_write(&seg, path);
+
+		free(path);
+		isr3_vocab_destroy(&seg.vocab);
+		free_tree(seg.root);
+
+		seg.root = NULL;
+		seg.num_docs = 0;
+	}
+
+	isr3_vocab_destroy(&seg.vocab);
+	free_tree(seg.root);
+
+	return result;
+}
+
+unsigned long isr3_disk_resident(void) {
+	/* Everything the segment being parsed holds. Nothing else is tracked while an index is being built. */
+	return isr3_mem_heap_bytes(ISR3_MEM_TREE_NODE) + isr3_mem_heap_bytes(ISR3_MEM_VOCAB) + isr3_mem_heap_bytes(ISR3_MEM_WORD_STRING)
+		+ isr3_mem_heap_bytes(ISR3_MEM_REF_ENTRY);
+}
+
+int isr3_disk_reduce(struct isr3_disk_build* build, unsigned int* num_runs, int (*merge)(struct isr3_disk_build* build, unsigned int first, unsigned int count, unsigned int output)) {
+	/* Consecutive runs are merged into longer ones until the last pass can take all of them. */
+	unsigned int first = 0;
+
+	while (*num_runs - first > (unsigned int) build->fan_in) {
+		unsigned int last = *num_runs;
+
+		for (unsigned int i = first; i < last; i += build->fan_in) {
+			unsigned int count = last - i < (unsigned int) build->fan_in ? last - i : (unsigned int) build->fan_in;
+
+			if (!merge(build, i, count, (*num_runs)++)) {
+				return 0;
+			}
+		}
+
+		first = last;
+	}
+
+	return merge(build, first, *num_runs - first, ISR3_DISK_FINAL);
+}
+
+int isr3_disk_merge_postings(struct isr3_disk_build* build, unsigned int first, unsigned int count, unsigned int output) {
+	unsigned long start = isr3_stats_now();
+	struct isr3_perf_sample counters;
+	struct isr3_disk_run* runs = calloc(count + 1, sizeof *runs), **heap = malloc(sizeof *heap * count + 1), **same = malloc(sizeof *same * count + 1);
+	struct isr3_segment_header hdr, run_hdr;
+	char* path = NULL, *tmp_path = NULL;
+	FILE* fd = NULL;
+	int result = 1, size = 0;
+	uint32_t num_docs = 0;
+
+	if (!runs || !heap || !same) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	isr3_perf_begin(&counters);
+
+	if (output != ISR3_DISK_FINAL) {
+		path = isr3_disk_path(build->dir, "post", output);
+		tmp_path = malloc(strlen(path) + 5);
+
+		if (!tmp_path) {
+			isr3_err("malloc failure\n");
+			exit(1);
+		}
+
+		sprintf(tmp_path, "%s.tmp", path);
+		result = !!(fd = isr3_segment_file_open(tmp_path, &hdr));
+	}
+
+	for (unsigned int i = 0; i < count && result; ++i) {
+		char* run_path = isr3_disk_path(build->dir, "post", first + i);
+
+		runs[i].index = i;
+
+		if ((runs[i].fd = isr3_segment_file_read(run_path, &run_hdr))) {
+			setvbuf(runs[i].fd, NULL, _IOFBF, ISR3_DISK_RUN_BUFFER);
+
+			runs[i].left = run_hdr.num_words;
+			num_docs += run_hdr.num_docs;
+
+			int next = isr3_disk_next_word(runs + i);
+
+			if (next > 0) {
+				isr3_disk_heap_push(heap, &size, runs + i);
+			}
+
+			result = next >= 0;
+		} else {
+			result = 0;
+		}
+
+		free(run_path);
+	}
+
+	while (result && size) {
+		/* Every run holding the smallest word comes off the heap, in run order, so their postings simply follow each other. */
+		int num_same = 0;
+
+		same[num_same++] = isr3_disk_heap_pop(heap, &size);
+
+		while (size && !word_cmp(heap[0]->rec.word, heap[0]->rec.word_len, same[0]->rec.word, same[0]->rec.word_len)) {
+			same[num_same++] = isr3_disk_heap_pop(heap, &size);
+		}
+
+		uint32_t* refs = same[0]->rec.refs, num_refs = same[0]->rec.num_refs;
+
+		if (num_same > 1) {
+			for (int i = 1; i < num_same; ++i) {
+				num_refs += same[i]->rec.num_refs;
+			}
+
+			if (num_refs > build->max_refs) {
+				uint32_t* grown = realloc(build->refs, sizeof *grown * num_refs);
+
+				if (!grown) {
+					isr3_err("malloc failure\n");
+					exit(1);
+				}
+
+				build->refs = grown;
+				build->max_refs = num_refs;
+			}
+
+			refs = build->refs;
+			num_refs = 0;
+
+			for (int i = 0; i < num_same; ++i) {
+				memcpy(refs + num_refs, same[i]->rec.refs, sizeof *refs * same[i]->rec.num_refs);
+				num_refs += same[i]->rec.num_refs;
+			}
+		}
+
+		if (output != ISR3_DISK_FINAL) {
+			result = isr3_segment_file_word(fd, &hdr, same[0]->rec.word, same[0]->rec.word_len, refs, num_refs);
+		} else {
+			result = isr3_disk_add_word(build, same[0]->rec.word, same[0]->rec.word_len, refs, num_refs);
+		}
+
+		for (int i = 0; i < num_same && result; ++i) {
+			int next = isr3_disk_next_word(same[i]);
+
+			if (next > 0) {
+				isr3_disk_heap_push(heap, &size, same[i]);
+			}
+
+			result = next >= 0;
+		}
+	}
+
+	if (output == ISR3_DISK_FINAL) {
+		build->hdr.num_docs += num_docs;
+	} else if (fd) {
+		hdr.num_docs = num_docs;
+
+		if (result) {
+			result = isr3_segment_file_close(fd, &hdr, tmp_path, path);
+		} else {
+			fclose(fd);
+			unlink(tmp_path);
+		}
+	}
+
+	if (!result) {
+		isr3_errf("Failed to merge postings runs %u to %u.\n", first, first + count - 1);
+	}
+
+	isr3_disk_close_runs(runs, count);
+
+	/* Merged runs are never read again. */
+	for (unsigned int i = 0; i < count && result; ++i) {
+		char* run_path = isr3_disk_path(build->dir, "post", first + i);
+
+		unlink(run_path);
+		free(run_path);
+	}
+
+	free(runs);
+	free(heap);
+	free(same);
+	free(path);
+	free(tmp_path);
+
+	isr3_perf_end(ISR3_PHASE_FLUSH, &counters);
+	isr3_stats_phase_end(ISR3_PHASE_FLUSH, start);
+	return result;
+}
+
+int isr3_disk_merge_rotations(struct isr3_disk_build* build, unsigned int first, unsigned int count, unsigned int output) {
+	unsigned long start = isr3_stats_now();
+	struct isr3_perf_sample counters;
+	struct isr3_disk_run* runs = calloc(count + 1, sizeof *runs), **heap = malloc(sizeof *heap * count + 1);
+	char* path = NULL, *tmp_path = NULL;
+	FILE* fd = build->rot;
+	int result = 1, size = 0;
+
+	if (!runs || !heap) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	isr3_perf_begin(&counters);
+
+	if (output != ISR3_DISK_FINAL) {
+		path = isr3_disk_path(build->dir, "rot", output);
+		tmp_path = malloc(strlen(path) + 5);
+
+		if (!tmp_path) {
+			isr3_err("malloc failure\n");
+			exit(1);
+		}
+
+		sprintf(tmp_path, "%s.tmp", path);
+		result = !!(fd = fopen(tmp_path, "wb"));
+	}
+
+	for (unsigned int i = 0; i < count && result; ++i) {
+		char* run_path = isr3_disk_path(build->dir, "rot", first + i);
+
+		runs[i].index = i;
+
+		if ((runs[i].fd = fopen(run_path, "rb"))) {
+			setvbuf(runs[i].fd, NULL, _IOFBF, ISR3_DISK_RUN_BUFFER);
+
+			int next = isr3_disk_next_rotation(runs + i);
+
+			if (next > 0) {
+				isr3_disk_heap_push(heap, &size, runs + i);
+			}
+
+			result = next >= 0;
+		} else {
+			result = 0;
+		}
+
+		free(run_path);
+	}
+
+	/* Rotations of distinct words are never equal, so each one comes off the heap on its own. */
+	while (result && size) {
+		struct isr3_disk_run* run = isr3_disk_heap_pop(heap, &size);
+
+		if (output != ISR3_DISK_FINAL) {
+			uint32_t fields[2] = {run->word_id, run->rec.word_len};
+
+			result = fwrite(fields, sizeof *fields, 2, fd) == 2 && fwrite(run->rec.word, 1, run->rec.word_len, fd) == run->rec.word_len;
+		} else {
+			/* The '$' ends up where the rotated characters begin. */
+			uint32_t fields[2] = {run->word_id, run->rec.word_len - 1 - ((char*) memchr(run->rec.word, '$', run->rec.word_len) - run->rec.word)};
+
+			result = fwrite(fields, sizeof *fields, 2, fd) == 2;
+			build->hdr.num_rotations++;
+		}
+
+		int next = result ? isr3_disk_next_rotation(run) : 0;
+
+		if (next > 0) {
+			isr3_disk_heap_push(heap, &size, run);
+		}
+
+		result = result && next >= 0;
+	}
+
+	if (output != ISR3_DISK_FINAL) {
+		int failed = !fd || fclose(fd);
+
+		if (!result || failed || rename(tmp_path, path)) {
+			unlink(tmp_path);
+			result = 0;
+		}
+	}
+
+	if (!result) {
+		isr3_errf("Failed to merge rotation runs %u to %u.\n", first, first + count - 1);
+	}
+
+	isr3_disk_close_runs(runs, count);
+
+	for (unsigned int i = 0; i < count && result; ++i) {
+		char* run_path = isr3_disk_path(build->dir, "rot", first + i);
+
+		unlink(run_path);
+		free(run_path);
+	}
+
+	free(runs);
+	free(heap);
+	free(path);
+	free(tmp_path);
+
+	isr3_perf_end(ISR3_PHASE_PERMUTERM, &counters);
+	isr3_stats_phase_end(ISR3_PHASE_PERMUTERM, start);
+	return result;
+}
+
+int isr3_disk_add_word(struct isr3_disk_build* build, char* word, uint32_t word_len, const uint32_t* refs, uint32_t num_refs) {
+	/* Words arrive in sorted order, so the next ID is the word's place in the final vocabulary. */
+	uint32_t fields[2] = {word_len, num_refs}, id = build->hdr.num_words;
+	size_t keys = word_len + 1;
+
+	if (id == ISR3_VOCAB_NONE) {
+		isr3_err("vocabulary is out of word IDs\n");
+		return 0;
+	}
+
+	if (fwrite(fields, sizeof *fields, 2, build->lex) != 2 || fwrite(word, 1, word_len, build->lex) != word_len || fwrite(refs, sizeof *refs, num_refs, build->post) != num_refs) {
+		isr3_err("Failed to write the index.\n");
+		return 0;
+	}
+
+	if (build->num_items + keys > build->max_items && !isr3_disk_spill_rotations(build)) {
+		return 0;
+	}
+
+	if (keys > build->max_items) {
+		isr3_errf("The memory budget has no room for the rotations of [%s].\n", word);
+		return 0;
+	}
+
+	char* cur = build->chars + 2 * build->num_items;
+
+	memcpy(cur, word, word_len);
+	cur[word_len] = '$';
+	memcpy(cur + keys, cur, keys);
+
+	for (size_t i = 0; i < keys; ++i) {
+		struct isr3_sort_item* item = build->items + build->num_items++;
+
+		item->str = cur + i;
+		item->len = keys;
+		item->id = id;
+	}
+
+	build->hdr.num_words++;
+	build->hdr.num_chars += word_len;
+	build->hdr.num_postings += num_refs;
+
+	return 1;
+}
+
+int isr3_disk_spill_rotations(struct isr3_disk_build* build) {
+	unsigned long start = isr3_stats_now();
+	struct isr3_perf_sample counters;
+
+	if (!build->num_items) {
+		return 1;
+	}
+
+	isr3_perf_begin(&counters);
+	isr3_sort_items(build->items, build->num_items);
+
+	char* path = isr3_disk_path(build->dir, "rot", build->num_rot_runs++), *tmp_path = malloc(strlen(path) + 5);
+
+	if (!tmp_path) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	sprintf(tmp_path, "%s.tmp", path);
+
+	FILE* fd = fopen(tmp_path, "wb");
+	int result = !!fd;
+
+	isr3_debugf("writing rotation run [%s] with %zu rotations\n", path, build->num_items);
+
+	for (size_t i = 0; i < build->num_items && result; ++i) {
+		uint32_t fields[2] = {build->items[i].id, build->items[i].len};
+
+		result = fwrite(fields, sizeof *fields, 2, fd) == 2 && fwrite(build->items[i].str, 1, fields[1], fd) == fields[1];
+	}
+
+	if ((fd && fclose(fd)) || !result || rename(tmp_path, path)) {
+		isr3_errf("Failed to write rotation run [%s].\n", path);
+		unlink(tmp_path);
+		result = 0;
+	}
+
+	build->num_items = 0;
+
+	free(path);
+	free(tmp_path);
+
+	isr3_perf_end(ISR3_PHASE_PERMUTERM, &counters);
+	isr3_stats_phase_end(ISR3_PHASE_PERMUTERM, start);
+	return result;
+}
+
+int isr3_disk_finish(struct isr3_disk_build* build) {
+	memcpy(build->hdr.magic, ISR3_DISK_MAGIC, sizeof build->hdr.magic);
+
+	int failed = !build->lex || fseek(build->lex, 0, SEEK_SET) || fwrite(&build->hdr, sizeof build->hdr, 1, build->lex) != 1;
+
+	failed = (build->lex && fclose(build->lex)) || failed;
+	failed = (build->post && fclose(build->post)) || failed;
+	failed = (build->rot && fclose(build->rot)) || failed;
+
+	if (failed) {
+		isr3_errf("Failed to write the index in [%s].\n", build->dir);
+	}
+
+	build->lex = build->post = build->rot = NULL;
+	return !failed;
+}
+
+void isr3_disk_cleanup(struct isr3_disk_build* build) {
+	/* After a failed build, nothing it wrote is of any use. Runs which were already merged are gone, that's fine. */
+	const char* names[] = {"index.lex", "index.post", "index.rot"};
+
+	for (unsigned int i = 0; i < build->num_post_runs + build->num_rot_runs; ++i) {
+		char* path = i < build->num_post_runs ? isr3_disk_path(build->dir, "post", i) : isr3_disk_path(build->dir, "rot", i - build->num_post_runs);
+
+		unlink(path);
+		free(path);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		char* path = isr3_disk_path(build->dir, names[i], ISR3_DISK_FINAL);
+
+		unlink(path);
+		free(path);
+	}
+}
+
+int isr3_disk_next_word(struct isr3_disk_run* run) {
+	if (!run->left) {
+		return 0;
+	}
+
+	run->left--;
+	return isr3_segment_file_next(run->fd, &run->rec) ? 1 : -1;
+}
+
+int isr3_disk_next_rotation(struct isr3_disk_run* run) {
+	/* Rotation runs: word_id key_len key[key_len], until the end of the file. */
+	uint32_t fields[2];
+	size_t read = fread(fields, sizeof *fields, 2, run->fd);
+
+	if (!read && feof(run->fd)) {
+		return 0;
+	}
+
+	if (read != 2) {
+		return -1;
+	}
+
+	if (fields[1] + 1 > run->rec.max_word) {
+		char* key = realloc(run->rec.word, fields[1] + 1);
+
+		if (!key) {
+			isr3_err("malloc failure\n");
+			exit(1);
+		}
+
+		run->rec.word = key;
+		run->rec.max_word = fields[1] + 1;
+	}
+
+	if (fread(run->rec.word, 1, fields[1], run->fd) != fields[1]) {
+		return -1;
+	}
+
+	run->word_id = fields[0];
+	run->rec.word_len = fields[1];
+
+	return 1;
+}
+
+void isr3_disk_close_runs(struct isr3_disk_run* runs, unsigned int count) {
+	for (unsigned int i = 0; i < count; ++i) {
+		if (runs[i].fd) {
+			fclose(runs[i].fd);
+		}
+
+		free(runs[i].rec.word);
+		free(runs[i].rec.refs);
+	}
+}
+
+void isr3_disk_heap_push(struct isr3_disk_run** heap, int* size, struct isr3_disk_run* run) {
+	int cur = (*size)++;
+
+	while (cur && isr3_disk_run_cmp(run, heap[(cur - 1) / 2]) < 0) {
+		heap[cur] = heap[(cur - 1) / 2];
+		cur = (cur - 1) / 2;
+	}
+
+	heap[cur] = run;
+}
+
+struct isr3_disk_run* isr3_disk_heap_pop(struct isr3_disk_run** heap, int* size) {
+	struct isr3_disk_run* output = heap[0], *last = heap[--*size];
+	int cur = 0;
+
+	while (2 * cur + 1 < *size) {
+		int child = 2 * cur + 1;
+
+		if (child + 1 < *size && isr3_disk_run_cmp(heap[child + 1], heap[child]) < 0) {
+			++child;
+		}
+
+		if (isr3_disk_run_cmp(last, heap[child]) <= 0) {
+			break;
+		}
+
+		heap[cur] = heap[child];
+		cur = child;
+	}
+
+	heap[cur] = last;
+	return output;
+}
+
+int isr3_disk_run_cmp(struct isr3_disk_run* a, struct isr3_disk_run* b) {
+	int cmp = word_cmp(a->rec.word, a->rec.word_len, b->rec.word, b->rec.word_len);
+
+	return cmp ? cmp : (a->index > b->index) - (a->index < b->index);
+}
+
+char* isr3_disk_path(const char* dir, const char* name, unsigned int run) {
+	char* output = malloc(strlen(dir) + strlen(name) + 32);
+
+	if (!output) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	if (run == ISR3_DISK_FINAL) {
+		sprintf(output, "%s/%s", dir, name);
+	} else {
+		sprintf(output, "%s/%s-%06u.run", dir, name, run);
+	}
+
+	return output;
+}
+
+struct isr3_disk_index* isr3_disk_index_open(const char* dir, struct isr3_vocab* vocab, unsigned int* num_docs, struct isr3_buffer_pool* pool) {
+	unsigned long start = isr3_stats_now();
+	char* lex_path = isr3_disk_path(dir, "index.lex", ISR3_DISK_FINAL), *post_path = isr3_disk_path(dir, "index.post", ISR3_DISK_FINAL);
+	char* rot_path = isr3_disk_path(dir, "index.rot", ISR3_DISK_FINAL);
+	struct isr3_disk_index* output = malloc(sizeof *output);
+	struct isr3_disk_header hdr;
+	struct stat post_info, rot_info;
+	FILE* fd = fopen(lex_path, "rb");
+	int result = 0;
+
+	if (!output || !(output->dir = malloc(strlen(dir) + 1))) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	strcpy(output->dir, dir);
+
+	output->vocab = vocab;
+	output->post_fd = open(post_path, O_RDONLY);
+	output->rot_fd = open(rot_path, O_RDONLY);
+
+	if (!fd || output->post_fd < 0 || output->rot_fd < 0 || fstat(output->post_fd, &post_info) || fstat(output->rot_fd, &rot_info)) {
+		isr3_errf("Failed to open the index in [%s].\n", dir);
+	} else if (fread(&hdr, sizeof hdr, 1, fd) != 1 || memcmp(hdr.magic, ISR3_DISK_MAGIC, sizeof hdr.magic)
+			|| (uint64_t) post_info.st_size != sizeof(uint32_t) * hdr.num_postings || (uint64_t) rot_info.st_size != 2 * sizeof(uint32_t) * hdr.num_rotations) {
+		isr3_errf("[%s] doesn't hold a complete index.\n", dir);
+	} else if (!isr3_vocab_load_words(vocab, hdr.num_words, hdr.num_chars, output->post_fd, pool)) {
+		isr3_err("malloc failure\n");
+	} else {
+		/* The same checks as isr3_segment_read(), with the postings left where they are. */
+		uint32_t cur_string = 0;
+		uint64_t cur_ref = 0;
+
+		result = 1;
+
+		for (uint32_t i = 0; i < hdr.num_words && result; ++i) {
+			uint32_t fields[2];
+
+			if (fread(fields, sizeof *fields, 2, fd) != 2 || !fields[1] || fields[0] > hdr.num_chars - (cur_string - i) || fields[1] > hdr.num_postings - cur_ref
+					|| fread(vocab->strings + cur_string, 1, fields[0], fd) != fields[0]) {
+				isr3_errf("The index in [%s] is truncated.\n", dir);
+				result = 0;
+				break;
+			}
+
+			vocab->offsets[i] = cur_string;
+			vocab->lengths[i] = fields[0];
+			vocab->postings_starts[i] = cur_ref;
+
+			vocab->strings[cur_string + fields[0]] = 0;
+			cur_string += fields[0] + 1;
+			cur_ref += fields[1];
+		}
+
+		vocab->postings_starts[hdr.num_words] = cur_ref;
+		output->num_rotations = hdr.num_rotations;
+		*num_docs = hdr.num_docs;
+	}
+
+	if (fd) {
+		fclose(fd);
+	}
+
+	free(lex_path);
+	free(post_path);
+	free(rot_path);
+
+	if (!result) {
+		/* Don't remove files we didn't write. */
+		if (vocab->loaded) {
+			isr3_vocab_destroy(vocab);
+		}
+
+		if (output->post_fd >= 0) {
+			close(output->post_fd);
+		}
+
+		if (output->rot_fd >= 0) {
+			close(output->rot_fd);
+		}
+
+		free(output->dir);
+		free(output);
+		return NULL;
+	}
+
+	isr3_stats_phase_end(ISR3_PHASE_FLUSH, start);
+	return output;
+}
+
+void isr3_disk_index_free(struct isr3_disk_index* index) {
+	/* The vocabulary belongs to the caller, only its postings file is ours. */
+	const char* names[] = {"index.lex", "index.post", "index.rot"};
+
+	if (index->vocab->pool) {
+		isr3_buffer_pool_forget(index->vocab->pool, index->post_fd);
+	}
+
+	close(index->post_fd);
+	close(index->rot_fd);
+
+	/* Like segment files, the index is private to this process. */
+	for (int i = 0; i < 3; ++i) {
+		char* path = isr3_disk_path(index->dir, names[i], ISR3_DISK_FINAL);
+
+		unlink(path);
+		free(path);
+	}
+
+	free(index->dir);
+	free(index);
+}
+
+void isr3_disk_index_search(struct isr3_disk_index* index, char* query, int query_len, int wildcard_count, int* search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	/* The same probes as search_permuterm(), each one a prefix scan over the rotation table. */
+	char* probes = malloc(2 * query_len + 2);
+	int probe_lens[ISR3_MAX_PROBES];
+
+	if (!probes) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	int verify = 0, count = permuterm_probes(query, query_len, wildcard_count, probes, probe_lens, &verify);
+
+	if (verify) {
+		permuterm_verify_begin(query, query_len, callback);
+		callback = callback_verify;
+	}
+
+	for (int i = 0, offset = 0; i < count; offset += probe_lens[i++]) {
+		isr3_disk_index_scan(index, probes + offset, probe_lens[i], ++*search_id, callback);
+	}
+
+	free(probes);
+}
+
+void isr3_disk_index_scan(struct isr3_disk_index* index, char* probe, int probe_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	uint32_t records[2 * ISR3_DISK_SCAN];
+	uint64_t low = 0, high = index->num_rotations;
+	unsigned long comparisons = 0, matches = 0;
+	int rot_len = 0;
+
+	isr3_stats_add(searches, 1);
+
+	/* Find the first rotation which doesn't sort before the probe, all of its matches follow it. */
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+
+		if (!isr3_disk_index_read(index, mid, 1, records)) {
+			return;
+		}
+
+		int cmp = isr3_disk_rotation_cmp(index, records, probe, probe_len, &rot_len);
+
+		if (cmp < 0 || (!cmp && rot_len < probe_len)) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+
+		++comparisons;
+	}
+
+	for (int done = 0; !done && low < index->num_rotations; ) {
+		uint64_t count = index->num_rotations - low < ISR3_DISK_SCAN ? index->num_rotations - low : ISR3_DISK_SCAN;
+
+		if (!isr3_disk_index_read(index, low, count, records)) {
+			break;
+		}
+
+		for (uint64_t i = 0; i < count; ++i) {
+			++comparisons;
+
+			if (isr3_disk_rotation_cmp(index, records + 2 * i, probe, probe_len, &rot_len) || rot_len < probe_len) {
+				done = 1;
+				break;
+			}
+
+			callback(index->vocab, records[2 * i], search_id);
+			++matches;
+		}
+
+		low += count;
+	}
+
+	isr3_stats_add(search_comparisons, comparisons);
+	isr3_stats_add(callbacks, matches);
+}
+
+int isr3_disk_index_read(struct isr3_disk_index* index, uint64_t first, uint64_t count, uint32_t* records) {
+	size_t size = 2 * sizeof *records * count;
+
+	if (pread(index->rot_fd, records, size, 2 * sizeof *records * first) != (ssize_t) size) {
+		isr3_err("Failed to read rotations from disk.\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+int isr3_disk_rotation_cmp(struct isr3_disk_index* index, const uint32_t* record, char* probe, int probe_len, int* rot_len) {
+	/* Compares the first characters of the rotation and the probe bytewise like word_cmp(), the caller compares the lengths. */
+	int word_len;
+	char* word = isr3_vocab_word(index->vocab, record[0], &word_len);
+	int len = word_len + 1 < probe_len ? word_len + 1 : probe_len;
+
+	*rot_len = word_len + 1;
+
+	for (int i = 0, k = record[1]; i < len; ++i, k = k == word_len ? 0 : k + 1) {
+		unsigned char c = k == word_len ? '$' : word[k], p = probe[i];
+
+		if (c != p) {
+			return c < p ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
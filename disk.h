@@ -0,0 +1,62 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vocab.h"
+
+#define ISR3_DISK_MAGIC "ISR3DSK1"
+#define ISR3_DISK_BUDGET_MIN (1 << 20) /* Smallest `--memory-budget` a build accepts. */
+#define ISR3_DISK_RUN_BUFFER (64 << 10) /* Read buffer per run while merging. */
+#define ISR3_DISK_SCAN 256 /* Rotations read at a time while a search walks its matches. */
+
+/*
+ * Out-of-core index builds (`--memory-budget`).
+ *
+ * The build never holds more than one slice of the collection. Files are parsed into an ordinary in-memory segment until
+ * its vocabulary and postings take half of the budget, which is then written out as a sorted run of (word, ref IDs) in
+ * the segment file format (see segment.h) and dropped. The budget is checked between files, so a single file larger than
+ * the budget still goes into one run. Files are taken in order, so the runs also cover ascending ranges of ref IDs.
+ *
+ * The runs are k-way merged with a heap, ISR3_DISK_RUN_BUFFER of read buffer per run. When there are more runs than a
+ * quarter of the budget has buffers for, consecutive runs are merged into longer ones first. The last pass writes the
+ * final vocabulary and postings, numbering the words in sorted order. Each word's postings are the concatenation of its
+ * postings in every run, which are already in ref ID order.
+ *
+ * While the last pass writes a word, the rotations of word$ (with its new ID) are collected like the bulk permuterm build
+ * does (see permuterm.c) in a buffer which takes the other half of the budget. A full buffer is sorted and spilled as a
+ * run of (word ID, rotation) records, and those runs are merged the same way into the final rotation table.
+ *
+ * Files in the index directory (native byte order, integers are uint32_t unless noted):
+ *
+ *  index.lex  : magic[8] num_words num_docs num_chars padding num_postings(uint64_t) num_rotations(uint64_t)
+ *               word_len doc_freq word[word_len]   (repeated num_words times, sorted by word_cmp)
+ *  index.post : ref_id   (every word's postings, back to back in word order)
+ *  index.rot  : word_id shift   (one per rotation, sorted, where shift is the number of characters of word$ rotated to the end)
+ *
+ * Queries keep the vocabulary columns in memory (see vocab.h) and read postings (through the buffer pool, if there is one)
+ * and rotations from their files: a search is a binary search over index.rot, rebuilding each rotation it compares against
+ * from its word, and then a scan forward while the rotations match.
+ */
+
+struct isr3_disk_header {
+	char magic[8];
+	uint32_t num_words, num_docs, num_chars, padding;
+	uint64_t num_postings, num_rotations;
+};
+
+struct isr3_disk_index {
+	struct isr3_vocab* vocab;
+	uint64_t num_rotations;
+	int rot_fd, post_fd;
+	char* dir;
+};
+
+int isr3_disk_build(const char* dir, char** files, int num_files, size_t budget); /* Builds the index of `files` in `dir`, 0 on failure. */
+
+struct isr3_disk_index* isr3_disk_index_open(const char* dir, struct isr3_vocab* vocab, unsigned int* num_docs, struct isr3_buffer_pool* pool); /* Loads the vocabulary into `vocab`, its postings are read through `pool` if there is one. */
+void isr3_disk_index_free(struct isr3_disk_index* index); /* Removes the index files as well, like a released segment. */
+void isr3_disk_index_search(struct isr3_disk_index* index, char* query, int query_len, int wildcard_count, int* search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+
+#endif
@@ -0,0 +1,303 @@
+#include "fm.h"
+#include "isr3.h"
+#include "mem.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static __thread const unsigned char* isr3_fm_sort_text = NULL; /* For isr3_fm_suffix_cmp(), qsort() has no context argument. */
+
+static int isr3_fm_suffix_cmp(const void* a, const void* b);
+static int isr3_fm_id_cmp(const void* a, const void* b);
+static uint32_t isr3_fm_rank(struct isr3_fm_index* ptr, unsigned char c, uint32_t i);
+static int isr3_fm_backward_search(struct isr3_fm_index* ptr, const char* piece, int piece_len, uint32_t* sp, uint32_t* ep);
+static uint32_t isr3_fm_locate(struct isr3_fm_index* ptr, uint32_t row, int starts_with_dollar);
+
+struct isr3_fm_index* isr3_fm_index_create(struct isr3_vocab* vocab) {
+	struct isr3_fm_index* output = malloc(sizeof *output);
+	uint32_t length = 2, num_words = vocab->num_words;
+
+	if (!output) {
+		return NULL;
+	}
+
+	memset(output, 0, sizeof *output);
+
+	for (uint32_t id = 0; id < num_words; ++id) {
+		int word_len;
+
+		isr3_vocab_word(vocab, id, &word_len);
+		length += word_len + 1;
+	}
+
+	/* The text and its suffix array are only needed while building. */
+	unsigned char* text = malloc(length);
+	uint32_t* sa = malloc(sizeof *sa * length), *starts = malloc(sizeof *starts * (num_words + 1));
+
+	output->length = length;
+	output->vocab = vocab;
+	output->num_words = num_words;
+	output->bwt = isr3_mem_alloc(ISR3_MEM_FM, length, 1);
+	output->word_of = isr3_mem_alloc(ISR3_MEM_FM, sizeof *output->word_of * (num_words + 1), 0);
+
+	if (!text || !sa || !starts || !output->bwt || !output->word_of) {
+		free(text);
+		free(sa);
+		free(starts);
+		isr3_fm_index_free(output);
+		return NULL;
+	}
+
+	uint32_t pos = 0, id = 0;
+	text[pos++] = '$';
+
+	for (; id < num_words; ++id) {
+		int word_len;
+		char* word = isr3_vocab_word(vocab, id, &word_len);
+
+		starts[id] = pos;
+
+		memcpy(text + pos, word, word_len);
+		pos += word_len;
+		text[pos++] = '$';
+	}
+
+	text[pos] = 0; /* The terminator sorts before everything, and no word contains it. */
+
+	for (uint32_t i = 0; i < length; ++i) {
+		sa[i] = i;
+	}
+
+	isr3_fm_sort_text = text;
+	qsort(sa, length, sizeof *sa, isr3_fm_suffix_cmp);
+
+	uint32_t histogram[256] = {0};
+
+	for (uint32_t i = 0; i < length; ++i) {
+		output->bwt[i] = text[sa[i] ? sa[i] - 1 : length - 1];
+		histogram[output->bwt[i]]++;
+	}
+
+	output->num_codes = 1;
+
+	for (int c = 0, total = 0; c < 256; ++c) {
+		output->counts[c] = total;
+		total += histogram[c];
+
+		if (c && histogram[c]) {
+			output->codes[c] = output->num_codes++;
+		}
+	}
+
+	uint32_t num_blocks = length / ISR3_FM_BLOCK + 1, running[256] = {0};
+	output->occ = isr3_mem_alloc(ISR3_MEM_FM, sizeof *output->occ * num_blocks * output->num_codes, 0);
+
+	if (!output->occ) {
+		free(text);
+		free(sa);
+		free(starts);
+		isr3_fm_index_free(output);
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < length; ++i) {
+		if (!(i % ISR3_FM_BLOCK)) {
+			for (int c = 0; c < 256; ++c) {
+				if (!c || output->codes[c]) {
+					output->occ[(i / ISR3_FM_BLOCK) * output->num_codes + output->codes[c]] = running[c];
+				}
+			}
+		}
+
+		running[output->bwt[i]]++;
+	}
+
+	if (!(length % ISR3_FM_BLOCK)) {
+		for (int c = 0; c < 256; ++c) {
+			if (!c || output->codes[c]) {
+				output->occ[(length / ISR3_FM_BLOCK) * output->num_codes + output->codes[c]] = running[c];
+			}
+		}
+	}
+
+	/* Rows preceded by '$' are the suffixes starting at a word (plus the terminator's, which comes first). */
+	for (uint32_t i = 0, k = 0; i < length; ++i) {
+		if (output->bwt[i] != '$') {
+			continue;
+		}
+
+		if (sa[i] == length - 1) {
+			output->word_of[k++] = UINT32_MAX;
+			continue;
+		}
+
+		uint32_t low = 0, high = num_words;
+
+		while (high - low > 1) {
+			uint32_t mid = low + (high - low) / 2;
+
+			if (starts[mid] <= sa[i]) {
+				low = mid;
+			} else {
+				high = mid;
+			}
+		}
+
+		output->word_of[k++] = low;
+	}
+
+	free(text);
+	free(sa);
+	free(starts);
+
+	return output;
+}
+
+void isr3_fm_index_free(struct isr3_fm_index* ptr) {
+	uint32_t num_blocks = ptr->length / ISR3_FM_BLOCK + 1;
+
+	isr3_mem_free(ISR3_MEM_FM, ptr->bwt, ptr->length, 1);
+	isr3_mem_free(ISR3_MEM_FM, ptr->occ, sizeof *ptr->occ * num_blocks * ptr->num_codes, 0);
+	isr3_mem_free(ISR3_MEM_FM, ptr->word_of, sizeof *ptr->word_of * (ptr->num_words + 1), 0);
+	free(ptr);
+}
+
+void isr3_fm_index_search(struct isr3_fm_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	char pattern[query_len + 2], padded[query_len + 4];
+	int pattern_len = permuterm_pattern(query, query_len, pattern);
+	uint32_t best_sp = 0, best_ep = UINT32_MAX, candidates = 0, matches = 0;
+	int best_dollar = 0;
+
+	isr3_stats_add(searches, 1);
+
+	padded[0] = '$';
+	memcpy(padded + 1, pattern, pattern_len);
+	padded[pattern_len + 1] = '$';
+
+	/* Count every literal piece (with the word boundaries) and locate only the rarest one. */
+	for (int i = 0; i < pattern_len + 2; ) {
+		int piece_len = 0;
+		uint32_t sp, ep;
+
+		while (i + piece_len < pattern_len + 2 && padded[i + piece_len] != '*' && padded[i + piece_len] != '?') ++piece_len;
+
+		if (piece_len) {
+			if (!isr3_fm_backward_search(ptr, padded + i, piece_len, &sp, &ep)) {
+				return;
+			}
+
+			if (ep - sp < best_ep - best_sp) {
+				best_sp = sp;
+				best_ep = ep;
+				best_dollar = padded[i] == '$';
+			}
+		}
+
+		i += piece_len ? piece_len : 1;
+	}
+
+	if (best_ep - best_sp >= ptr->num_words) {
+		/* Locating would visit about every word anyway. */
+		for (uint32_t id = 0; id < ptr->num_words; ++id) {
+			int word_len;
+			char* word = isr3_vocab_word(ptr->vocab, id, &word_len);
+
+			if (pattern_match(pattern, pattern_len, word, word_len)) {
+				callback(ptr->vocab, id, search_id);
+				++matches;
+			}
+		}
+
+		isr3_stats_add(search_comparisons, ptr->num_words);
+		isr3_stats_add(callbacks, matches);
+		return;
+	}
+
+	uint32_t* ids = malloc(sizeof *ids * (best_ep - best_sp) + 1);
+
+	if (!ids) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	for (uint32_t row = best_sp; row < best_ep; ++row) {
+		ids[row - best_sp] = isr3_fm_locate(ptr, row, best_dollar);
+	}
+
+	/* A word containing the piece twice is located twice. */
+	qsort(ids, best_ep - best_sp, sizeof *ids, isr3_fm_id_cmp);
+
+	for (uint32_t i = 0; i < best_ep - best_sp; ++i) {
+		if (i && ids[i] == ids[i - 1]) {
+			continue;
+		}
+
+		int word_len;
+		char* word = isr3_vocab_word(ptr->vocab, ids[i], &word_len);
+
+		++candidates;
+
+		if (pattern_match(pattern, pattern_len, word, word_len)) {
+			callback(ptr->vocab, ids[i], search_id);
+			++matches;
+		}
+	}
+
+	free(ids);
+
+	isr3_stats_add(search_comparisons, candidates);
+	isr3_stats_add(callbacks, matches);
+}
+
+int isr3_fm_backward_search(struct isr3_fm_index* ptr, const char* piece, int piece_len, uint32_t* sp, uint32_t* ep) {
+	*sp = 0;
+	*ep = ptr->length;
+
+	for (int i = piece_len - 1; i >= 0 && *sp < *ep; --i) {
+		unsigned char c = piece[i];
+
+		if (!c || !ptr->codes[c]) {
+			return 0;
+		}
+
+		*sp = ptr->counts[c] + isr3_fm_rank(ptr, c, *sp);
+		*ep = ptr->counts[c] + isr3_fm_rank(ptr, c, *ep);
+	}
+
+	return *sp < *ep;
+}
+
+uint32_t isr3_fm_locate(struct isr3_fm_index* ptr, uint32_t row, int starts_with_dollar) {
+	if (starts_with_dollar) {
+		/* The suffixes starting with '$' are in the same order as the words following them. */
+		return ptr->word_of[row - ptr->counts['$']];
+	}
+
+	while (ptr->bwt[row] != '$') {
+		unsigned char c = ptr->bwt[row];
+		row = ptr->counts[c] + isr3_fm_rank(ptr, c, row);
+	}
+
+	return ptr->word_of[isr3_fm_rank(ptr, '$', row)];
+}
+
+uint32_t isr3_fm_rank(struct isr3_fm_index* ptr, unsigned char c, uint32_t i) {
+	/* Occurrences of c in bwt[0, i): the checkpoint before i, plus a scan of the rest of its block. */
+	uint32_t block = i / ISR3_FM_BLOCK, output = ptr->occ[block * ptr->num_codes + ptr->codes[c]];
+
+	for (uint32_t j = block * ISR3_FM_BLOCK; j < i; ++j) {
+		output += ptr->bwt[j] == c;
+	}
+
+	return output;
+}
+
+int isr3_fm_suffix_cmp(const void* a, const void* b) {
+	return strcmp((const char*) isr3_fm_sort_text + *(const uint32_t*) a, (const char*) isr3_fm_sort_text + *(const uint32_t*) b);
+}
+
+int isr3_fm_id_cmp(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
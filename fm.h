@@ -0,0 +1,46 @@
+#ifndef FM_H
+#define FM_H
+
+#include <stdint.h>
+
+#include "vocab.h"
+
+#define ISR3_FM_BLOCK 256 /* BWT characters per rank checkpoint. */
+
+/*
+ * FM-index over the vocabulary of an immutable segment, for `--engine fm`.
+ *
+ * The words are concatenated in ID order into one text `$w0$w1$..$wn$` and only its Burrows-Wheeler transform is kept, with a rank
+ * checkpoint every ISR3_FM_BLOCK characters for each distinct character. A literal piece of a pattern is found by backward
+ * search in time proportional to its length, independent of the vocabulary size.
+ *
+ * No suffix array is kept: a match is mapped to its word by stepping backwards through the text (LF mapping) until the
+ * preceding character is the `$` in front of the word. The rank of that `$` among all of them identifies the word, so
+ * the only per-word cost is one ID in `word_of`.
+ *
+ * The index is built once and never changes, so it needs no locking. Segments which are still growing use the k-gram
+ * index instead (see segment.h).
+ */
+
+struct isr3_fm_index {
+	unsigned char* bwt;
+	uint32_t length;
+
+	unsigned char codes[256]; // Dense code of each character in the text, 0 if absent (code 0 is the terminator).
+	int num_codes;
+	uint32_t counts[256]; // C array: characters in the text smaller than each character.
+	uint32_t* occ; // occ[block * num_codes + code]: occurrences of the code before the block.
+
+	struct isr3_vocab* vocab;
+	uint32_t* word_of; // word_of[k]: the ID of the word after the k-th `$` in BWT order (k = 0 is the terminator).
+	uint32_t num_words;
+};
+
+/* Builds the index over every word in the vocabulary. NULL on failure. */
+struct isr3_fm_index* isr3_fm_index_create(struct isr3_vocab* vocab);
+void isr3_fm_index_free(struct isr3_fm_index* ptr);
+
+/* Same contract as isr3_kgram_index_search(): every word matching the `*` and `?` pattern, S$P queries read as P*S. */
+void isr3_fm_index_search(struct isr3_fm_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+
+#endif
@@ -21,6 +21,14 @@
  * * I got around this problem by making each word entry exist in two different linked lists simultaneously. Each word entry has two `next` pointers.
  * * This allows me to efficiently keep a contiguous linked list of all the independent word entries with little overhead and no memory penalties.
  * * Now that I had a contiguous list of words, I used my word comparison function to implement a mergesort on the linked list.
+ * * (The recursive mergesort has since been replaced by a multikey quicksort over an array of the list entries, see sort.c.)
+ * * (The word entries have since become parallel arrays indexed by word ID, so the global list is just the IDs, see vocab.h.)
+ *
+ * Files are indexed into segments (see segment.h), each with its own word tree and permuterm index, so ingest never has to rebuild one big index.
+ * Very large files are cut into chunks which are tokenized and stemmed on every core, see parse.h.
+ * With a memory budget, the index is built out of core from sorted runs and searched where it lies on disk, see disk.h.
+ * With a buffer pool, postings on disk are paged in on demand and hot ones stay cached, see bufpool.h.
+ * The files can also be split across shard processes, which a coordinator searches in parallel, see shard.h.
  *
  */
 
@@ -28,7 +36,6 @@
  * Constant definitions.
  */
 
-#define ISR3_HASH_LENGTH 4
 #define ISR3_QUERY_LENGTH 512 /* Big queries? */
 
 /*
@@ -41,9 +48,24 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
-
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bufpool.h"
+#include "cache.h"
 #include "debug.h"
-#include "permuterm.h"
+#include "disk.h"
+#include "isr3.h" /* The word tree and the program function declarations live here so the segment code can share them. */
+#include "segment.h"
+#include "mem.h"
+#include "parse.h"
+#include "perf.h"
+#include "shard.h"
+#include "stats.h"
 
 /*
  * Since we are hashing the word values to store them in the tree, we will need to utilize open hashing to keep track of words with the same hash.
@@ -52,119 +74,329 @@
 
 #include "entry_types.h"
 
+/* An array in static space, tracking search IDs for document references -- this is important for tracking which document IDs are included in the (conjunctive) search output. */
+static int* isr3_ref_entry_sids = NULL;
+
+/* The pattern callback_verify() checks candidate words against, and the callback it passes matches on to. Set by permuterm_verify_begin(). */
+static __thread char* isr3_verify_pattern = NULL;
+static __thread int isr3_verify_pattern_len = 0;
+static __thread void (*isr3_verify_callback)(struct isr3_vocab* vocab, uint32_t word, int search_id) = NULL;
+
 /*
- * The tree structure is pretty straightforward.
- * Each node has a hash value and a list of words which hashed to that value.
- * Each word has a list of file references.
+ * The bench/ tools link against this file with -DISR3_NO_MAIN to reuse the pipeline functions without the program itself.
  */
 
-typedef struct isr3_tree_node isr3_tree_node;
+#ifndef ISR3_NO_MAIN
 
-struct isr3_tree_node {
-	isr3_tree_node* left, *right;
-	isr3_word_entry* word_list; // List of words corresponding to node_hash[].
-	char node_hash[ISR3_HASH_LENGTH];
+static int isr3_ref_entry_count = 0;
+
+/* Ingest work handed to the background thread in `--live` mode (or run inline otherwise). */
+struct isr3_ingest {
+	struct isr3_segment_set* set;
+	char** files;
+	int num_files, result, stop, memory;
 };
 
-/* Program function declarations. */
+static void* ingest_files(void* arg);
+static int coordinate(struct isr3_shard_set* shards, char** files, int num_files); /* The search prompt of a coordinator, returns the exit code. */
+static void usage(const char* name);
 
-int parse_file(const char* filename, unsigned int ref_id, isr3_tree_node** root, isr3_word_entry** global_list, int* largest_word_length); /* Parse a file into the tree. */
-int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_node** root, isr3_word_entry** global_list); /* Insert a word into the tree. */
-isr3_word_entry* sort_list(isr3_word_entry* word_list);
-void free_tree(isr3_tree_node* root);
+/* Function definitions. */
 
-void gen_permuterm(isr3_word_entry* entry, struct isr3_permuterm_index* index); /* For each permutation of the word, insert a permuterm key pointing to "entry" into a btree. */
-void search_permuterm(char* query, int query_len, struct isr3_permuterm_index* tree, int wildcard_count, int* search_id, void (*callback)(isr3_word_entry* list, int search_id));
-void callback_permuterm(struct isr3_word_entry* entry, int search_id);
+int main(int argc, char** argv) {
+	isr3_debug("Starting ISR3.\n");
 
-/* Utility functions : hashing and comparing words. */
+	static struct option long_options[] = {
+		{"segment-docs", required_argument, NULL, 's'},
+		{"segment-dir", required_argument, NULL, 'd'},
+		{"live", no_argument, NULL, 'l'},
+		{"stats", no_argument, NULL, 'S'},
+		{"memory", no_argument, NULL, 'M'},
+		{"perf", no_argument, NULL, 'P'},
+		{"query-cache", required_argument, NULL, 'C'},
+		{"term-cache", required_argument, NULL, 'T'},
+		{"engine", required_argument, NULL, 'E'},
+		{"memory-budget", required_argument, NULL, 'B'},
+		{"buffer-pool", required_argument, NULL, 'b'},
+		{"shards", required_argument, NULL, 'N'},
+		{"serve", required_argument, NULL, 'V'},
+		{"connect", required_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}
+	};
+
+	unsigned int segment_docs = ISR3_SEGMENT_DOCS, cache_entries = ISR3_QUERY_CACHE_ENTRIES;
+	size_t term_cache_bytes = ISR3_TERM_CACHE_BYTES, memory_budget = 0, buffer_pool_bytes = 0;
+	enum isr3_engine engine = ISR3_ENGINE_PERMUTERM;
+	char* segment_dir = NULL, tmp_dir[] = "/tmp/isr3-XXXXXX", shard_dir[PATH_MAX], *serve_path = NULL, **connect_paths = NULL;
+	int live = 0, memory = 0, num_shards = 0, num_connect = 0, serving = 0, opt; // `serving` is set in a shard.
+
+	while ((opt = getopt_long(argc, argv, "s:d:l", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			segment_docs = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			segment_dir = optarg;
+			break;
+		case 'l':
+			live = 1;
+			break;
+		case 'S':
+			isr3_stats_enabled = 1;
+			break;
+		case 'M':
+			memory = 1;
+			break;
+		case 'P':
+			isr3_perf_enabled = isr3_stats_enabled = 1;
+			break;
+		case 'C':
+			cache_entries = strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			term_cache_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			memory_budget = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			buffer_pool_bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'N':
+			num_shards = atoi(optarg);
+			break;
+		case 'V':
+			serve_path = optarg;
+			break;
+		case 'c':
+			if (!(connect_paths = realloc(connect_paths, sizeof *connect_paths * (num_connect + 1)))) {
+				isr3_err("malloc failure\n");
+				exit(1);
+			}
 
-int hash_word(char* word_buf, int word_len, char* out_buf, int out_len); /* Hash a word into a buffer. */
-int word_cmp(char* word_buf1, int word_len1, char* word_buf2, int word_len2); /* Returns 1 if word1 > word2, -1 if word1 < word2, and 0 if word1 = word2. */
+			connect_paths[num_connect++] = optarg;
+			break;
+		case 'E':
+			if (!strcmp(optarg, "permuterm")) {
+				engine = ISR3_ENGINE_PERMUTERM;
+			} else if (!strcmp(optarg, "kgram")) {
+				engine = ISR3_ENGINE_KGRAM;
+			} else if (!strcmp(optarg, "fm")) {
+				engine = ISR3_ENGINE_FM;
+			} else {
+				isr3_errf("Unknown engine [%s].\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
 
-/* Internal sorting functions. */
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
-isr3_word_entry* merge_nodes(isr3_word_entry* first, isr3_word_entry* second);
-int divide_list(isr3_word_entry* head, isr3_word_entry** first, isr3_word_entry** second);
-int list_length(isr3_word_entry* head);
+	if (optind >= argc) {
+		isr3_err("No files passed to program.\n");
+		usage(argv[0]);
+		return 1;
+	}
 
-/* Stemmer function declarations. */
+	if (memory_budget && live) {
+		isr3_err("--live can't be combined with --memory-budget, the index is only searchable once it is built.\n");
+		usage(argv[0]);
+		return 1;
+	}
 
-extern int stem(char* c, int i, int j);
+	if ((num_shards > 0) + (num_connect > 0) + !!serve_path > 1) {
+		isr3_err("Only one of --shards, --connect and --serve can be used at a time.\n");
+		usage(argv[0]);
+		return 1;
+	}
 
-/* An array in static space, tracking search IDs for document references -- this is important for tracking which document IDs are included in the (conjunctive) search output. */
-static int* isr3_ref_entry_sids = NULL;
-static int isr3_ref_entry_count = 0;
+	char** files = argv + optind;
+	int num_files = argc - optind;
 
-/* Function definitions. */
+	if (num_shards > 0 || num_connect) {
+		/* A coordinator only searches its shards. Forked shards go on below with their range of the files instead. */
+		struct isr3_shard_set shards = {0};
+		int result = 1, shard = 0;
 
-int main(int argc, char** argv) {
-	isr3_debug("Starting ISR3.\n");
-	isr3_tree_node* root = NULL;
-	isr3_word_entry* word_list_g = NULL;
+		if (num_shards > 0) {
+			num_shards = num_shards < num_files ? num_shards : num_files;
+			result = isr3_shard_fork(&shards, num_shards, &shard);
+		}
 
-	struct isr3_permuterm_index* perm_index = isr3_permuterm_index_create();
+		for (int i = 0; i < num_connect && result > 0; ++i) {
+			result = isr3_shard_connect(&shards, connect_paths[i]) ? 1 : -1;
+		}
 
-	int largest_word = 0;
+		free(connect_paths);
 
-	if (argc > 1) {
-		for (int i = 1; i < argc; ++i) {
-			isr3_debugf("Parsing input file %s..\n", argv[i]);
+		if (result) {
+			result = result > 0 ? coordinate(&shards, files, num_files) : 1;
+			isr3_shard_set_free(&shards);
+			return result;
+		}
 
-			if (!parse_file(argv[i], i - 1, &root, &word_list_g, &largest_word)) { /* We just pass `i - 1` as the reference ID. Makes it very easy to ID files in order. */
-				isr3_errf("Parsing failed for file [%s].\n", argv[i]);
+		int first, count;
+
+		isr3_shard_range(num_shards, num_files, shard, &first, &count);
+		files += first;
+		num_files = count;
+		serving = 1;
+
+		/* Every shard needs its own segment files. */
+		if (segment_dir) {
+			snprintf(shard_dir, sizeof shard_dir, "%s/shard-%d", segment_dir, shard);
+
+			if (mkdir(shard_dir, 0700) && errno != EEXIST) {
+				isr3_errf("Failed to create a segment directory [%s].\n", shard_dir);
 				return 1;
 			}
+
+			segment_dir = shard_dir;
 		}
-	} else {
-		isr3_err("No files passed to program.\n");
-		isr3_errf("Usage: %s <file1> <file2> <fileN>\n", argv[0]);
+	} else if (serve_path) {
+		if (!isr3_shard_serve(serve_path)) {
+			return 1;
+		}
+
+		serving = 1;
+	}
+
+	/* With a pool, postings of flushed segments and of the out-of-core index are read from disk through it, see bufpool.h. */
+	struct isr3_buffer_pool* pool = NULL;
+
+	if (buffer_pool_bytes && !(pool = isr3_buffer_pool_create(buffer_pool_bytes))) {
+		isr3_errf("Failed to create a buffer pool of %zu bytes (it needs room for at least one %d byte page).\n", buffer_pool_bytes, ISR3_BUFFER_PAGE);
 		return 1;
 	}
 
-	/* At this point, we have a BST of all words and their respective references. However, they are not sorted. */
+	/* Flushed segments go to a private temporary directory unless we're told where to put them. */
+	if (!segment_dir) {
+		if (!mkdtemp(tmp_dir)) {
+			isr3_errf("Failed to create a segment directory [%s].\n", tmp_dir);
+			return 1;
+		}
+	}
+
+	struct isr3_segment_set* set = isr3_segment_set_create(segment_dir ? segment_dir : tmp_dir, segment_docs, engine, pool);
+
+	if (!set) {
+		isr3_err("Failed to create the segment set.\n");
+		return 1;
+	}
 
 	/*
-	 * While the tree structure is great for accelerating lookup and store speeds, it is really awful for sorting (especially considering it is indexed via hashing)
-	 * To approach this problem, the program keeps two lists active during loading.
-	 * Each word structure has a second "next" members because they exist in two seperate lists simultaneously -- which reference the same objects.
-	 * A global, continguous linked list of words is much easier to sort; we will perform a mergesort to keep it fast.
+	 * Every file is parsed into the active in-memory segment. Full segments are sealed, sorted and flushed to disk by the
+	 * segment merger thread, which also merges on-disk segments in the background. See segment.h for the details.
 	 */
 
-	word_list_g = sort_list(word_list_g); /* Sort the wordlist as we prepare to output. */
+	struct isr3_ingest ingest = {set, files, num_files, 1, 0, memory};
+	pthread_t ingest_thread;
 
-	/* We insert the sorted wordlist into the on-disk B-tree -- I'm not yet sure if sorting the list is even necessary now. */
+	/* Before searching, we prepare the refID search tracker. */
+	isr3_ref_entry_count = ingest.num_files;
+	isr3_ref_entry_sids = malloc(sizeof *isr3_ref_entry_sids * isr3_ref_entry_count);
+
+	if (memory_budget) {
+		/* Built from sorted runs on disk, in the segment directory, and searched there as one more segment. */
+		ingest.result = isr3_disk_build(segment_dir ? segment_dir : tmp_dir, ingest.files, ingest.num_files, memory_budget)
+			&& isr3_segment_set_add_index(set, segment_dir ? segment_dir : tmp_dir);
 
-	struct isr3_word_entry* tmp_gwordlist = word_list_g;
-	while (word_list_g) {
-		gen_permuterm(word_list_g, perm_index);
-		word_list_g = word_list_g->global_next;
+		if (memory) {
+			isr3_mem_report(stderr);
+		}
+	} else if (live) {
+		/* Queries are answered right away against whatever has been ingested so far. */
+		if (pthread_create(&ingest_thread, NULL, ingest_files, &ingest)) {
+			isr3_err("Failed to start the ingest thread.\n");
+			live = 0;
+			ingest_files(&ingest);
+		}
+	} else {
+		ingest_files(&ingest);
 	}
 
-	word_list_g = tmp_gwordlist;
+	if (!ingest.result && !live) {
+		isr3_segment_set_free(set);
+		free(isr3_ref_entry_sids);
 
-	/* Before searching, we prepare the refID search tracker. */
-	isr3_ref_entry_count = argc - 1;
-	isr3_ref_entry_sids = malloc(sizeof *isr3_ref_entry_sids * isr3_ref_entry_count);
+		if (pool) {
+			isr3_buffer_pool_free(pool);
+		}
+
+		if (!segment_dir) {
+			rmdir(tmp_dir);
+		}
+
+		return 1;
+	}
+
+	/* Repeated queries are answered from the result cache, and repeated wildcard terms from the term cache, see cache.h. */
+	struct isr3_query_cache* cache = cache_entries ? isr3_query_cache_create(cache_entries) : NULL;
+	struct isr3_term_cache* term_cache = term_cache_bytes ? isr3_term_cache_create(term_cache_bytes, isr3_ref_entry_count) : NULL;
+	unsigned int* result_buf = malloc(sizeof *result_buf * isr3_ref_entry_count + 1), *term_buf = malloc(sizeof *term_buf * isr3_ref_entry_count + 1);
+
+	if (!result_buf || !term_buf || (cache_entries && !cache) || (term_cache_bytes && !term_cache)) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	/* A shard tells its coordinator how many documents it holds, and answers with ref IDs instead of file names. */
+	if (serving) {
+		printf("%d\n", num_files);
+		fflush(stdout);
+	}
 
 	/* Prepare the search prompt and ask for a string. */
 
-	while (1) {
+	for (unsigned long query_id = 1; ; ++query_id) {
 		int search_id = 0;
 
 		for (int i = 0; i < isr3_ref_entry_count; ++i) {
 			isr3_ref_entry_sids[i] = 0;
 		}
 
-		fprintf(stdout, "Search string: ");
+		if (!serving) {
+			fprintf(stdout, "Search string: ");
+		}
 
 		char query_buf[ISR3_QUERY_LENGTH + 1] = {0}, *query_buf_read = query_buf, *query_buf_read_tmp = query_buf;
-		fgets(query_buf, sizeof query_buf / sizeof *query_buf, stdin);
 
-		if (query_buf[0] == '\n') {
+		if (!fgets(query_buf, sizeof query_buf / sizeof *query_buf, stdin) || query_buf[0] == '\n') {
 			break;
 		}
 
+		if (!strcmp(query_buf, ":memory\n")) {
+			/* Not a query -- ':' never survives tokenizing, so no document can contain this term. */
+			isr3_mem_report(stderr);
+
+			if (serving) {
+				printf("\n"); /* The coordinator waits for an answer. */
+				fflush(stdout);
+			}
+
+			continue;
+		}
+
+		/* Only documents which were completely ingested before the search began are reported. */
+		unsigned int published = 0, *result = result_buf, num_results = 0;
+		unsigned long version = isr3_segment_set_version(set, &published);
+		struct isr3_query_term terms[ISR3_QUERY_LENGTH + 1];
+		char cache_key[2 * ISR3_QUERY_LENGTH + 2];
+		int num_terms = 0;
+		struct isr3_stats before;
+		struct isr3_perf_sample counters;
+		unsigned long start = isr3_stats_now();
+
+		if (isr3_stats_enabled) {
+			isr3_stats_snapshot(&before);
+		}
+
+		isr3_perf_begin(&counters);
+
 		while (*query_buf_read && isspace(*(query_buf_read))) query_buf_read++; /* Cut off leading whitespace. */
 
 		while (*query_buf_read) {
@@ -174,7 +406,7 @@ int main(int argc, char** argv) {
 			while (*query_buf_read_tmp && !isspace(*(query_buf_read_tmp++))) {
 				++length;
 
-				if (*(query_buf_read_tmp - 1) == '*') {
+				if (*(query_buf_read_tmp - 1) == '*' || *(query_buf_read_tmp - 1) == '?') {
 					has_wildcards++;
 				}
 			}
@@ -186,85 +418,254 @@ int main(int argc, char** argv) {
 				stem_length = stem(query_buf_read, 0, length - 1) + 1;
 			}
 
-			isr3_debugf("searching for [%.*s]\n", stem_length, query_buf_read);
-			search_permuterm(query_buf_read, stem_length, perm_index, has_wildcards, &search_id, callback_permuterm);
+			terms[num_terms].str = query_buf_read;
+			terms[num_terms].len = stem_length;
+			terms[num_terms++].wildcards = has_wildcards;
+
 			query_buf_read = query_buf_read_tmp;
 		}
 
-		/* Search is complete. We can examine which refIDs passed the search by comparing the static tracker with the last search id. */
-		for (int i = 0; i < isr3_ref_entry_count; ++i) {
-			if (isr3_ref_entry_sids[i] == search_id) {
-				printf("%s\n", argv[i + 1]);
+		int key_len = cache ? isr3_query_cache_key(terms, num_terms, cache_key) : 0;
+
+		if (!cache || !isr3_query_cache_lookup(cache, cache_key, key_len, version, &result, &num_results)) {
+			for (int i = 0; i < num_terms; ++i) {
+				isr3_debugf("searching for [%.*s]\n", terms[i].len, terms[i].str);
+
+				if (!term_cache || exact_term(terms[i].str, terms[i].len, terms[i].wildcards)) {
+					/* Exact terms are a single vocabulary lookup per segment, there is nothing to gain from caching them. */
+					isr3_segment_set_search(set, terms[i].str, terms[i].len, terms[i].wildcards, &search_id, callback_permuterm);
+					continue;
+				}
+
+				/* Wildcard terms are cached under the whole pattern, whichever engine answers them. */
+				struct isr3_doc_set* docs = isr3_term_cache_lookup(term_cache, terms[i].str, terms[i].len, version);
+
+				if (!docs) {
+					int collect_id = 0;
+
+					isr3_term_cache_collect_begin(term_cache);
+					isr3_segment_set_search(set, terms[i].str, terms[i].len, terms[i].wildcards, &collect_id, isr3_term_cache_collect);
+					docs = isr3_term_cache_collect_end(term_cache, terms[i].str, terms[i].len, version);
+				}
+
+				/* The same conjunctive counting as callback_permuterm(), over the cached IDs. */
+				unsigned int num_docs = isr3_doc_set_decode(docs, term_buf);
+
+				++search_id;
+
+				for (unsigned int k = 0; k < num_docs; ++k) {
+					if (isr3_ref_entry_sids[term_buf[k]] == search_id - 1) {
+						isr3_ref_entry_sids[term_buf[k]] = search_id;
+					}
+				}
+			}
+
+			/* Search is complete. We can examine which refIDs passed the search by comparing the static tracker with the last search id. */
+			for (unsigned int i = 0; i < published; ++i) {
+				if (isr3_ref_entry_sids[i] == search_id) {
+					result[num_results++] = i;
+				}
+			}
+
+			if (cache) {
+				isr3_query_cache_insert(cache, cache_key, key_len, version, result, num_results);
 			}
 		}
+
+		for (unsigned int i = 0; i < num_results; ++i) {
+			if (serving) {
+				printf("%u\n", result[i]);
+			} else {
+				printf("%s\n", ingest.files[result[i]]);
+			}
+		}
+
+		if (serving) {
+			printf("\n");
+			fflush(stdout);
+		}
+
+		if (isr3_stats_enabled) {
+			isr3_perf_end(ISR3_PHASE_QUERY, &counters);
+			isr3_stats_phase_end(ISR3_PHASE_QUERY, start);
+			isr3_stats_add(queries, 1);
+			isr3_stats_dump_query(stderr, query_id, &before, num_results);
+			isr3_perf_dump_query(stderr, query_id, &counters);
+		}
+	}
+
+	if (live) {
+		__atomic_store_n(&ingest.stop, 1, __ATOMIC_RELAXED);
+		pthread_join(ingest_thread, NULL);
+	}
+
+	if (isr3_stats_enabled) {
+		unsigned long nodes = 0, keys = 0;
+		int height = 0;
+
+		isr3_segment_set_shape(set, &nodes, &keys, &height);
+		isr3_stats_dump(stderr, nodes, keys, height);
+		isr3_perf_dump(stderr);
+
+		if (cache) {
+			isr3_query_cache_dump(cache, stderr);
+		}
+
+		if (term_cache) {
+			isr3_term_cache_dump(term_cache, stderr);
+		}
 	}
 
-	free_tree(root); /* We cleanly exit, returning all memory to the OS. */
+	isr3_segment_set_free(set); /* We cleanly exit, returning all memory to the OS. */
 	free(isr3_ref_entry_sids);
-	isr3_permuterm_index_free(perm_index);
+	free(result_buf);
+	free(term_buf);
+
+	if (pool) {
+		isr3_buffer_pool_free(pool);
+	}
+
+	if (cache) {
+		isr3_query_cache_free(cache);
+	}
+
+	if (term_cache) {
+		isr3_term_cache_free(term_cache);
+	}
+
+	if (!segment_dir) {
+		rmdir(tmp_dir);
+	}
 
 	return 0;
 }
 
-int parse_file(const char* filename, unsigned int ref_id, isr3_tree_node** root, isr3_word_entry** global_list, int* largest_word_length) {
-	FILE* fd = fopen(filename, "r");
+void* ingest_files(void* arg) {
+	struct isr3_ingest* ingest = arg;
 
-	if (!fd) {
-		isr3_errf("Failed to open [%s] for reading.\n", filename);
-		return 0;
+	for (int i = 0; i < ingest->num_files && !__atomic_load_n(&ingest->stop, __ATOMIC_RELAXED); ++i) {
+		isr3_debugf("Parsing input file %s..\n", ingest->files[i]);
+
+		if (!isr3_segment_set_add_file(ingest->set, ingest->files[i], i)) { /* We just pass the file index as the reference ID. Makes it very easy to ID files in order. */
+			isr3_errf("Parsing failed for file [%s].\n", ingest->files[i]);
+			ingest->result = 0;
+			break;
+		}
 	}
 
-	char* cur_word = NULL;
-	int cur_word_len = 0; /* Instead of using strlen, we just keep a counter. Much faster. */
+	if (ingest->memory) {
+		isr3_mem_report(stderr);
+	}
 
-	char cur_char = 0; /* This stores the most recent character read to make things more readable. */
+	return NULL;
+}
 
-	/*
-	 * This may get a bit complicated - reading strings from a file into a dynamically allocated string (and then stemming it) requires much more code.
-	 * Also, we'll have to free all of the word data when we're done.
-	 */
+int coordinate(struct isr3_shard_set* shards, char** files, int num_files) {
+	unsigned int* result = malloc(sizeof *result * num_files + 1), num_results = 0;
 
-	while (!feof(fd)) {
-		/* First: get rid of any preceding whitespace (but store the last character in the first index of cur_word) */
-		while (isspace(cur_char = fgetc(fd)) || cur_char == '\'' || cur_char == '-' || cur_char == '$');
+	if (!result) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
 
-		if (cur_char == EOF) {
-			break; /* Depending on the file, an EOF may occur here if there is no whitespace between the last word and the EOF. */
+	if (!isr3_shard_set_start(shards)) {
+		free(result);
+		return 1;
+	}
+
+	/* The shards' ranges have to cover the files, or the names we print would be off. */
+	if (shards->num_docs != (unsigned int) num_files) {
+		isr3_errf("The shards hold %u documents, but %d files were passed.\n", shards->num_docs, num_files);
+		free(result);
+		return 1;
+	}
+
+	for (;;) {
+		char query_buf[ISR3_QUERY_LENGTH + 1] = {0};
+
+		fprintf(stdout, "Search string: ");
+
+		if (!fgets(query_buf, sizeof query_buf / sizeof *query_buf, stdin) || query_buf[0] == '\n') {
+			break;
 		}
 
-		cur_word = malloc(sizeof *cur_word * 2);
+		/* The shards read the query with the same buffer, so a line cut off here goes on in the next query for them too. */
+		size_t len = strlen(query_buf);
 
-		if (!cur_word) {
-			isr3_err("Failed to allocate memory. Is there any RAM left?\n");
-			return 0;
+		if (query_buf[len - 1] != '\n' && len < ISR3_QUERY_LENGTH) {
+			query_buf[len] = '\n';
 		}
 
-		cur_word[0] = cur_char;
-		cur_word[1] = 0;
-		cur_word_len = 1; /* The character which terminated the last loop is the first character of the target word. */
+		if (!isr3_shard_set_query(shards, query_buf, result, &num_results)) {
+			free(result);
+			return 1;
+		}
 
-		/* Next: read until the next whitespace character. */
-		while (!isspace(cur_char = fgetc(fd)) && !feof(fd)) {
-			if (cur_char == '\'' || cur_char == '-' || cur_char == '$') {
-				continue; /* This seems to be the most effective method of handling punctuation (simply removing it from the word prior to stemming) [subject to change] */
-			}
+		for (unsigned int i = 0; i < num_results; ++i) {
+			printf("%s\n", files[result[i]]);
+		}
+	}
 
-			if (!isalnum(cur_char)) {
-				break; /* Break on non-alphanumeric characters. */
-			}
+	free(result);
+	return 0;
+}
 
-			cur_word = realloc(cur_word, cur_word_len + 2);
+void usage(const char* name) {
+	isr3_errf("Usage: %s [options] <file1> <file2> <fileN>\n", name);
+	isr3_err("  -s, --segment-docs N   seal the in-memory segment after N documents (0 keeps a single segment)\n");
+	isr3_err("  -d, --segment-dir DIR  directory for flushed segment files (default: a fresh directory in /tmp)\n");
+	isr3_err("  -l, --live             answer queries while the files are still being ingested\n");
+	isr3_err("      --stats            report phase timers and counters on stderr (per query and at exit)\n");
+	isr3_err("      --perf             like --stats, plus hardware counters per phase and query where perf_event_open is allowed\n");
+	isr3_err("      --query-cache N    remember the results of the last N distinct queries (default 1024, 0 disables the cache)\n");
+	isr3_err("      --engine NAME      wildcard index: permuterm (default, fastest), kgram (trigrams, a fraction of the memory)\n");
+	isr3_err("                         or fm (FM-index over flushed segments, the least memory, use with -s)\n");
+	isr3_err("      --term-cache BYTES memory budget for cached wildcard expansions (default 8 MiB, 0 disables the cache)\n");
+	isr3_err("      --memory           report memory use per data structure on stderr once all files are ingested\n");
+	isr3_err("      --memory-budget BYTES  build the index out of core in the segment directory, holding about BYTES in memory\n");
+	isr3_err("                         at a time (at least 1 MiB), and search it there; not with --live\n");
+	isr3_err("      --buffer-pool BYTES  keep the postings of flushed segments (and of --memory-budget) on disk and cache\n");
+	isr3_err("                         their pages in a pool of about BYTES (default 0, postings stay in memory)\n");
+	isr3_err("      --shards N         split the files across N forked shard processes and search them in parallel\n");
+	isr3_err("      --serve PATH       index the files as one shard, answering a coordinator on the Unix socket PATH\n");
+	isr3_err("      --connect PATH     search the shard served on PATH (repeat for every shard, in file order)\n");
+}
 
-			if (!cur_word) {
-				isr3_err("Failed to allocate memory. Is there any RAM left?\n");
-				return 0;
-			}
+#endif /* ISR3_NO_MAIN */
+
+int parse_file(const char* filename, unsigned int ref_id, isr3_tree_node** root, struct isr3_vocab* vocab, int* largest_word_length) {
+	FILE* fd = fopen(filename, "r");
+
+	if (!fd) {
+		isr3_errf("Failed to open [%s] for reading.\n", filename);
+		return 0;
+	}
 
-			cur_word[cur_word_len++] = cur_char; /* If this were in the while condition, it would increment even when fgetc() returned whitespace. */
-			cur_word[cur_word_len] = 0;
+	/* Large files are tokenized on every core, see parse.h. This falls back to the loop below if that can't start. */
+	struct stat info;
+
+	if (!fstat(fileno(fd), &info) && info.st_size >= ISR3_PARSE_PARALLEL_MIN && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		int parsed = isr3_parse_parallel(fd, info.st_size, ref_id, root, vocab, largest_word_length);
+
+		if (parsed >= 0) {
+			fclose(fd);
+			return parsed;
 		}
+	}
 
+	char* cur_word = NULL;
+	int cur_word_len = 0, result = 0; /* Instead of using strlen, we just keep a counter. Much faster. */
+	unsigned long start = isr3_stats_now(), stemmed = 0, inserted = 0; /* Stemming and inserting are timed separately from tokenizing. */
+	struct isr3_perf_sample counters;
+
+	isr3_perf_begin(&counters);
+
+	isr3_stats_add(files, 1);
+
+	while ((result = read_word(fd, &cur_word, &cur_word_len)) > 0) {
+		unsigned long stem_start = isr3_stats_now();
 		int stem_length = stem(cur_word, 0, cur_word_len - 1) + 1;
+		unsigned long insert_start = isr3_stats_now();
 
 		cur_word[stem_length] = 0; /* Null-terminate the stemmed word. */
 		isr3_debugf("Read word with length %d [stem %d], data [%.*s]\n", cur_word_len, stem_length, cur_word_len, cur_word);
@@ -275,26 +676,99 @@ int parse_file(const char* filename, unsigned int ref_id, isr3_tree_node** root,
 			 *largest_word_length = cur_word_len;
 		}
 
-		if (!insert_word(cur_word, cur_word_len, ref_id, root, global_list)) {
+		if (!insert_word(cur_word, cur_word_len, ref_id, root, vocab)) {
 			isr3_err("Failed to insert word into tree.\n");
+			fclose(fd);
 			return 0;
 		}
 
+		stemmed += insert_start - stem_start;
+		inserted += isr3_stats_now() - insert_start;
+
 		cur_word = NULL;
 		cur_word_len = 0;
 	}
 
 	fclose(fd);
+
+	if (isr3_stats_enabled) {
+		isr3_perf_end(ISR3_PHASE_PARSE, &counters);
+		isr3_stats_add(phase_ns[ISR3_PHASE_PARSE], isr3_stats_now() - start - stemmed - inserted);
+		isr3_stats_add(phase_ns[ISR3_PHASE_STEM], stemmed);
+		isr3_stats_add(phase_ns[ISR3_PHASE_INSERT], inserted);
+	}
+
+	return !result;
+}
+
+int read_word(FILE* fd, char** word, int* word_len) {
+	/*
+	 * This may get a bit complicated - reading strings from a file into a dynamically allocated string (and then stemming it) requires much more code.
+	 * Also, the caller will have to free all of the word data when it's done.
+	 */
+
+	char* cur_word = NULL;
+	int cur_word_len = 0; /* Instead of using strlen, we just keep a counter. Much faster. */
+
+	char cur_char = 0; /* This stores the most recent character read to make things more readable. */
+
+	if (feof(fd)) {
+		return 0;
+	}
+
+	/* First: get rid of any preceding whitespace (but store the last character in the first index of cur_word) */
+	while (isspace(cur_char = fgetc(fd)) || cur_char == '\'' || cur_char == '-' || cur_char == '$');
+
+	if (cur_char == EOF) {
+		return 0; /* Depending on the file, an EOF may occur here if there is no whitespace between the last word and the EOF. */
+	}
+
+	cur_word = malloc(sizeof *cur_word * 2);
+
+	if (!cur_word) {
+		isr3_err("Failed to allocate memory. Is there any RAM left?\n");
+		return -1;
+	}
+
+	cur_word[0] = cur_char;
+	cur_word[1] = 0;
+	cur_word_len = 1; /* The character which terminated the last loop is the first character of the target word. */
+
+	/* Next: read until the next whitespace character. */
+	while (!isspace(cur_char = fgetc(fd)) && !feof(fd)) {
+		if (cur_char == '\'' || cur_char == '-' || cur_char == '$') {
+			continue; /* This seems to be the most effective method of handling punctuation (simply removing it from the word prior to stemming) [subject to change] */
+		}
+
+		if (!isalnum(cur_char)) {
+			break; /* Break on non-alphanumeric characters. */
+		}
+
+		cur_word = realloc(cur_word, cur_word_len + 2);
+
+		if (!cur_word) {
+			isr3_err("Failed to allocate memory. Is there any RAM left?\n");
+			return -1;
+		}
+
+		cur_word[cur_word_len++] = cur_char; /* If this were in the while condition, it would increment even when fgetc() returned whitespace. */
+		cur_word[cur_word_len] = 0;
+	}
+
+	*word = cur_word;
+	*word_len = cur_word_len;
+
+	isr3_stats_add(tokens, 1);
 	return 1;
 }
 
-int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_node** root, isr3_word_entry** global_list) {
+int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_node** root, struct isr3_vocab* vocab) {
 	if (!word_buf || !root) {
 		isr3_err("Invalid input!\n");
 		return 0;
 	}
 
-	isr3_ref_entry* new_ref_entry = malloc(sizeof *new_ref_entry);
+	isr3_ref_entry* new_ref_entry = isr3_mem_alloc(ISR3_MEM_REF_ENTRY, sizeof *new_ref_entry, 1);
 
 	if (!new_ref_entry) {
 		isr3_err("malloc() failed. System may be out of RAM!\n");
@@ -322,67 +796,52 @@ int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_nod
 		} else {
 			/* The hashes are equal -> We want to locate the target word in this node. */
 			/* This will be a generally quick procedure. We scan through the wordlist and insert our ref_id. */
-			isr3_word_entry* cur_word_entry = (*cur_node)->word_list;
+			uint32_t cur_word = (*cur_node)->word_list;
 			int located = 0; /* We keep a small flag to indicate whether we need to insert a new word entry. */
 
-			while (cur_word_entry) {
-				if (!word_cmp(cur_word_entry->word, cur_word_entry->word_len, word_buf, word_len)) {
+			while (cur_word != ISR3_VOCAB_NONE) {
+				int cur_word_len;
+				char* cur_word_buf = isr3_vocab_word(vocab, cur_word, &cur_word_len);
+
+				if (!word_cmp(cur_word_buf, cur_word_len, word_buf, word_len)) {
 					/* We found our word. Add our refID and set the located flag. */
-					isr3_ref_entry* cur_ref = cur_word_entry->ref_list_head;
+					struct isr3_postings postings;
+					unsigned int cur_ref = 0;
 					int located_ref = 0;
 
-					while (cur_ref) {
-						if (cur_ref->ref_id == ref_id) {
+					isr3_vocab_postings(vocab, cur_word, &postings);
+
+					while (isr3_postings_next(&postings, &cur_ref)) {
+						if (cur_ref == ref_id) {
 							located_ref = 1;
 							break;
 						}
-
-						cur_ref = cur_ref->next;
 					}
 
 					if (!located_ref) {
 						/* Instead of doing a quick two-line linked list insertion, we push it to the end to reverse the output order. */
-
-						new_ref_entry->next = NULL;
-
-						if (cur_word_entry->ref_list_tail) {
-							cur_word_entry->ref_list_tail->next = new_ref_entry;
-						}
-
-						if (!cur_word_entry->ref_list_head) {
-							cur_word_entry->ref_list_head = new_ref_entry;
-						}
-
-						cur_word_entry->ref_list_tail = new_ref_entry;
+						isr3_vocab_append(vocab, cur_word, new_ref_entry);
+					} else {
+						isr3_mem_free(ISR3_MEM_REF_ENTRY, new_ref_entry, sizeof *new_ref_entry, 1); /* This file already references the word. */
 					}
 
 					located = 1;
 
 					free(word_buf); /* Our word already exists. We free the memory which was automatically allocated by the file parser. */
+					break; /* `word_buf` is gone, so we can't keep comparing against it. */
 				}
 
-				cur_word_entry = cur_word_entry->next;
+				cur_word = *isr3_vocab_chain(vocab, cur_word);
 			}
 
 			if (!located) {
 				/* We didn't find our word in the entry list. Add a new one! */
-				isr3_word_entry* new_entry = malloc(sizeof *new_entry);
+				uint32_t new_word = isr3_vocab_add(vocab, word_buf, word_len, new_ref_entry);
 
-				if (!new_entry) {
-					isr3_err("malloc() failed. System may be out of RAM!\n");
-					exit(1);
-				}
+				*isr3_vocab_chain(vocab, new_word) = (*cur_node)->word_list;
+				__atomic_store_n(&(*cur_node)->word_list, new_word, __ATOMIC_RELEASE); /* find_word() may be reading this list. */
 
-				new_entry->word = word_buf;
-				new_entry->word_len = word_len;
-
-				new_entry->ref_list_head = new_entry->ref_list_tail = new_ref_entry;
-				new_entry->next = (*cur_node)->word_list;
-
-				(*cur_node)->word_list = new_entry;
-
-				new_entry->global_next = *global_list;
-				*global_list = new_entry;
+				isr3_stats_add(unique_words, 1);
 			}
 
 			return 1; /* Once this is hit, we guarantee the word will be inserted. */
@@ -396,7 +855,7 @@ int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_nod
 
 	isr3_debug("No node found. Inserting new node..\n");
 
-	isr3_tree_node* new_node = malloc(sizeof *new_node);
+	isr3_tree_node* new_node = isr3_mem_alloc(ISR3_MEM_TREE_NODE, sizeof *new_node, 1);
 
 	if (!new_node) {
 		isr3_err("malloc() failed. System may be out of RAM!\n");
@@ -406,27 +865,54 @@ int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_nod
 	memcpy(new_node->node_hash, word_hash, ISR3_HASH_LENGTH);
 	new_node->left = new_node->right = NULL;
 
-	isr3_word_entry* new_entry = malloc(sizeof *new_entry);
+	/* The fresh word's hash chain is empty -- it is the node's first word. */
+	new_node->word_list = isr3_vocab_add(vocab, word_buf, word_len, new_ref_entry);
 
-	if (!new_entry) {
-		isr3_err("malloc() failed. System may be out of RAM!\n");
-		exit(1);
+	isr3_debugf("Inserted new node [%.*s]\n", word_len, word_buf);
+
+	__atomic_store_n(cur_node, new_node, __ATOMIC_RELEASE); /* The node is complete before find_word() can reach it. */
+
+	isr3_stats_add(unique_words, 1);
+	return 1;
+}
+
+int exact_term(char* query, int len, int wildcard_count) {
+	/* Words never contain '$', so terms with one are hand-written permuterm queries and still go to the prefix search. Empty terms keep matching everything. */
+	return !wildcard_count && len && !memchr(query, '$', len);
+}
+
+uint32_t find_word(char* word_buf, int word_len, isr3_tree_node* root, struct isr3_vocab* vocab) {
+	/* The same walk as insert_word(), without inserting. Safe against a concurrent insert_word() on the same tree. */
+	char word_hash[ISR3_HASH_LENGTH] = {0};
+
+	if (!word_len || !hash_word(word_buf, word_len, word_hash, sizeof word_hash / sizeof *word_hash)) {
+		return ISR3_VOCAB_NONE;
 	}
 
-	new_entry->word = word_buf;
-	new_entry->word_len = word_len;
+	isr3_tree_node* cur_node = root;
 
-	isr3_debugf("Inserted new node [%.*s]\n", new_entry->word_len, new_entry->word);
+	while (cur_node) {
+		int result = memcmp(word_hash, cur_node->node_hash, ISR3_HASH_LENGTH);
 
-	new_entry->ref_list_head = new_entry->ref_list_tail = new_ref_entry;
-	new_entry->next = new_node->word_list;
+		if (result > 0) {
+			cur_node = __atomic_load_n(&cur_node->right, __ATOMIC_ACQUIRE);
+		} else if (result < 0) {
+			cur_node = __atomic_load_n(&cur_node->left, __ATOMIC_ACQUIRE);
+		} else {
+			for (uint32_t cur = __atomic_load_n(&cur_node->word_list, __ATOMIC_ACQUIRE); cur != ISR3_VOCAB_NONE; cur = *isr3_vocab_chain(vocab, cur)) {
+				int cur_len;
+				char* cur_buf = isr3_vocab_word(vocab, cur, &cur_len);
 
-	new_node->word_list = new_entry;
-	new_entry->global_next = *global_list;
+				if (!word_cmp(cur_buf, cur_len, word_buf, word_len)) {
+					return cur;
+				}
+			}
 
-	*global_list = new_entry;
-	*cur_node = new_node;
-	return 1;
+			return ISR3_VOCAB_NONE;
+		}
+	}
+
+	return ISR3_VOCAB_NONE;
 }
 
 int hash_word(char* word_buf, int word_len, char* hash_buf, int hash_len) {
@@ -475,7 +961,7 @@ int word_cmp(char* word_buf1, int word_len1, char* word_buf2, int word_len2) {
 }
 
 void free_tree(isr3_tree_node* root) {
-	/* Quick recursive cleanup of the tree and everything allocated inside. */
+	/* Quick recursive cleanup of the tree. The words belong to the vocabulary, see isr3_vocab_destroy(). */
 
 	if (!root) {
 		return;
@@ -484,101 +970,17 @@ void free_tree(isr3_tree_node* root) {
 	free_tree(root->left);
 	free_tree(root->right);
 
-	isr3_word_entry* cur_word = root->word_list, *tmp_word = NULL;
-
-	while (cur_word) {
-		isr3_ref_entry* cur_ref = cur_word->ref_list_head, *tmp_ref = NULL;
-
-		while (cur_ref) {
-			tmp_ref = cur_ref->next;
-			free(cur_ref);
-			cur_ref = tmp_ref;
-		}
-
-		tmp_word = cur_word->next;
-		free(cur_word->word);
-		free(cur_word);
-		cur_word = tmp_word;
-	}
-
-	free(root);
+	isr3_mem_free(ISR3_MEM_TREE_NODE, root, sizeof *root, 1);
 }
 
-isr3_word_entry* sort_list(isr3_word_entry* head) {
-	isr3_word_entry* first = NULL, *second = NULL;
-
-	if (!head || !head->global_next) {
-		return head;
-	}
-
-	divide_list(head, &first, &second);
-
-	first = sort_list(first);
-	second = sort_list(second);
-
-	/* Merge operation.. with linked lists! */
-	return merge_nodes(first, second);
-}
-
-isr3_word_entry* merge_nodes(isr3_word_entry* first, isr3_word_entry* second) {
-	if (!first && second) {
-		second->global_next = merge_nodes(first, second->global_next);
-		return second;
-	} else if (first && !second) {
-		first->global_next = merge_nodes(first->global_next, second);
-		return first;
-	} else if (!first && !second) {
-		return NULL;
-	}
-
-	int result = word_cmp(first->word, first->word_len, second->word, second->word_len);
-
-	if (result <= 0) { // This is '<=' because we don't need to worry about which item to select if they are the same word.. In fact, we should NEVER encounter the same word anyway.
-		first->global_next = merge_nodes(first->global_next, second);
-		return first;
-	} else {
-		second->global_next = merge_nodes(first, second->global_next);
-		return second;
-	}
-}
-
-int divide_list(isr3_word_entry* head, isr3_word_entry** first, isr3_word_entry** second) {
-	if (!head || !head->global_next) {
-		*first = head;
-		(*first)->global_next = NULL;
-		*second = NULL;
-
-		isr3_debug("List length is <2, returning single element\n");
-
-		return 1;
-	}
-
-	isr3_word_entry* slow = head, *fast = head->global_next;
-
-	while (fast) {
-		fast = fast->global_next;
-
-		if (fast) {
-			slow = slow->global_next;
-			fast = fast->global_next;
-		}
-	}
-
-	/* We pushed `fast` ahead at 2x the speed of slow, and this places slow one step before the midpoint. */
-
-	*first = head;
-	*second = slow->global_next;
-
-	slow->global_next = NULL;
-
-	return 1;
-}
-
-void gen_permuterm(isr3_word_entry* entry, struct isr3_permuterm_index* index) {
+void gen_permuterm(uint32_t word, struct isr3_permuterm_index* index) {
 	/* To permute the word, we have to use the string kind of like a circular buffer with only two memcpy calls. */
 	/* This is a pretty quick and easy way to do it. */
 
-	int inp_wordlen = entry->word_len + 2; /* Make room for the '$' and a null terminator (req. for the btree key) */
+	unsigned long start = isr3_stats_now(), inserted = 0; /* The B-tree inserts are timed as their own phase. */
+	int word_len;
+	char* word_buf = isr3_vocab_word(index->vocab, word, &word_len);
+	int inp_wordlen = word_len + 2; /* Make room for the '$' and a null terminator (req. for the btree key) */
 	char* permbuf = malloc(inp_wordlen), *inp_word = malloc(inp_wordlen);
 
 	if (!permbuf || !inp_word) {
@@ -587,7 +989,7 @@ void gen_permuterm(isr3_word_entry* entry, struct isr3_permuterm_index* index) {
 	}
 
 	memset(permbuf, 0, inp_wordlen);
-	memcpy(inp_word, entry->word, entry->word_len);
+	memcpy(inp_word, word_buf, word_len);
 
 	inp_word[inp_wordlen - 2] = '$';
 	inp_word[inp_wordlen - 1] = permbuf[inp_wordlen - 1] = 0;
@@ -598,16 +1000,52 @@ void gen_permuterm(isr3_word_entry* entry, struct isr3_permuterm_index* index) {
 
 		isr3_debugf("Permuterm %d of [%s] : [%s]\n", i, inp_word, permbuf);
 
-		isr3_permuterm_index_insert(index, permbuf, inp_wordlen - 1, entry);
+		unsigned long insert_start = isr3_stats_now();
+		isr3_permuterm_index_insert(index, permbuf, inp_wordlen - 1, word);
+		inserted += isr3_stats_now() - insert_start;
 	}
 
 	free(permbuf);
 	free(inp_word);
+
+	if (isr3_stats_enabled) {
+		isr3_stats_add(phase_ns[ISR3_PHASE_PERMUTERM], isr3_stats_now() - start - inserted);
+		isr3_stats_add(phase_ns[ISR3_PHASE_BTREE], inserted);
+	}
 }
 
-void search_permuterm(char* query, int len, struct isr3_permuterm_index* index, int wildcard_count, int* search_id, void (*callback)(struct isr3_word_entry* entry, int search_id)) {
+int permuterm_probes(char* query, int len, int wildcard_count, char* probes, int* probe_lens, int* verify) {
+	/*
+	 * A term is answered by prefix searches over the rotations, which are ANDed together. Every term currently needs one,
+	 * but callers loop over however many are returned. The probes are written back to back into `probes`, which needs
+	 * room for 2 * len + 2 bytes.
+	 *
+	 * `*` and `?` together are counted in `wildcard_count`. Plain terms and a single `*` are exact permuterm rotations,
+	 * anything else is a single probe whose matches must be checked against the whole pattern (`verify` is set).
+	 * That includes A*B*C: searching C$A and B separately and ANDing them at the document level would walk the postings
+	 * of every word containing B, and match documents where A..C and B are in different words.
+	 */
+
+	int stars = 0, singles = 0;
+
+	*verify = 0;
+
+	for (int i = 0; i < len; ++i) {
+		stars += query[i] == '*';
+		singles += query[i] == '?';
+	}
+
+	if (singles || stars > 1) {
+		*verify = 1;
+		probe_lens[0] = permuterm_best_probe(query, len, probes);
+		isr3_debugf("best probe: [%.*s]\n", probe_lens[0], probes);
+		return 1;
+	}
+
 	if (!wildcard_count) {
-		isr3_permuterm_index_search(index, query, len, ++*search_id, callback); /* No wildcards involved, we have a pretty easy search. */
+		memcpy(probes, query, len); /* No wildcards involved, we have a pretty easy search. */
+		probe_lens[0] = len;
+		return 1;
 	} else if (wildcard_count == 1) {
 		/* [everything after *]$[everything before *] */
 
@@ -620,68 +1058,156 @@ void search_permuterm(char* query, int len, struct isr3_permuterm_index* index,
 			}
 		}
 
-		char* query_tmp = malloc(len);
+		memcpy(probes, query + wildcard_pos + 1, len - (wildcard_pos + 1));
+		probes[len - (wildcard_pos + 1)] = '$';
+		memcpy(probes + len - (wildcard_pos + 1) + 1, query, wildcard_pos);
+
+		isr3_debugf("tmp query: [%.*s]\n", len, probes);
+		probe_lens[0] = len;
+		return 1;
+	}
+
+	return 0;
+}
+
+int permuterm_best_probe(char* query, int len, char* probe) {
+	/*
+	 * Every matching word starts with the literal characters before the first wildcard and ends with the ones after the
+	 * last, so the rotation [trailing literals]$[leading literals] finds all of them. So does any literal run inside the
+	 * pattern, as a substring. We take whichever is longest, counting the '$' of the outer rotation as one character,
+	 * since it anchors both ends. Patterns without any literals fall back to "$", which visits every word once.
+	 */
 
-		memcpy(query_tmp, query + wildcard_pos + 1, len - (wildcard_pos + 1));
-		query_tmp[len - (wildcard_pos + 1)] = '$';
-		memcpy(query_tmp + len - (wildcard_pos + 1) + 1, query, wildcard_pos);
+	int lead = 0, trail = 0, best_start = 0, best_len = -1;
 
-		isr3_debugf("tmp query: [%.*s]\n", len, query_tmp);
-		isr3_permuterm_index_search(index, query_tmp, len, ++*search_id, callback);
+	while (lead < len && query[lead] != '*' && query[lead] != '?') ++lead;
+	while (trail < len && query[len - 1 - trail] != '*' && query[len - 1 - trail] != '?') ++trail;
 
-		free(query_tmp);
-	} else if (wildcard_count == 2) {
-		int first_wildcard_pos = -1, second_wildcard_pos = -1;
+	for (int i = lead; i < len - trail; ) {
+		int run = 0;
 
-		for (int i = 0; i < len; ++i) {
-			if (query[i] == '*') {
-				if (first_wildcard_pos < 0) {
-					first_wildcard_pos = i;
-				} else {
-					second_wildcard_pos = i;
-					break;
-				}
-			}
+		while (i + run < len - trail && query[i + run] != '*' && query[i + run] != '?') ++run;
+
+		if (run > best_len) {
+			best_start = i;
+			best_len = run;
 		}
 
-		int s1_length = first_wildcard_pos, s2_length = (second_wildcard_pos - 1) - (first_wildcard_pos), s3_length = len - (second_wildcard_pos + 1);
+		i += run ? run : 1;
+	}
+
+	if (best_len > lead + trail + 1) {
+		memcpy(probe, query + best_start, best_len);
+		return best_len;
+	}
 
-		if (s1_length + s3_length) {
-			char* query_first = malloc(s1_length + s3_length + 1);
-			memcpy(query_first, query + second_wildcard_pos + 1, len - (second_wildcard_pos + 1));
-			query_first[len - (second_wildcard_pos + 1)] = '$';
-			memcpy(query_first + len - (second_wildcard_pos + 1) + 1, query, first_wildcard_pos);
+	memcpy(probe, query + len - trail, trail);
+	probe[trail] = '$';
+	memcpy(probe + trail + 1, query, lead);
 
-			isr3_debugf("second query: [%.*s]\n", s1_length + s3_length + 1, query_first);
-			isr3_permuterm_index_search(index, query_first, s1_length + s3_length + 1, ++*search_id, callback);
-			free(query_first);
-		}
+	return lead + trail + 1;
+}
+
+int permuterm_pattern(char* query, int query_len, char* pattern) {
+	/* For engines which match patterns rather than rotations: S$P is a prefix of a rotation of exactly the words which start with P and end with S. */
+	char* dollar = memchr(query, '$', query_len);
+
+	if (!query_len) {
+		pattern[0] = '*'; /* Like the empty prefix, matches every word. */
+		return 1;
+	}
+
+	if (!dollar || memchr(query, '*', query_len) || memchr(query, '?', query_len)) {
+		memcpy(pattern, query, query_len);
+		return query_len;
+	}
+
+	int suffix_len = dollar - query, prefix_len = query_len - suffix_len - 1;
+
+	memcpy(pattern, dollar + 1, prefix_len);
+	pattern[prefix_len] = '*';
+	memcpy(pattern + prefix_len + 1, query, suffix_len);
+
+	return query_len;
+}
 
-		if (!s2_length) {
-			isr3_err("Odd query detected -- two consecutive wildcards? Ignoring.\n");
-			return;
+int pattern_match(char* pattern, int pattern_len, char* word, int word_len) {
+	/* Greedy glob matching: on a mismatch, let the last `*` swallow one more character and retry from there. */
+	int p = 0, w = 0, star = -1, resume = 0;
+
+	while (w < word_len) {
+		if (p < pattern_len && pattern[p] == '*') {
+			star = p++;
+			resume = w;
+		} else if (p < pattern_len && (pattern[p] == '?' || pattern[p] == word[w])) {
+			++p;
+			++w;
+		} else if (star >= 0) {
+			p = star + 1;
+			w = ++resume;
+		} else {
+			return 0;
 		}
+	}
 
-		char* query_second = malloc(s2_length);
-		memcpy(query_second, query + first_wildcard_pos + 1, s2_length);
+	while (p < pattern_len && pattern[p] == '*') ++p;
 
-		isr3_debugf("second query: [%.*s]\n", s2_length, query_second);
-		isr3_permuterm_index_search(index, query_second, s2_length, ++*search_id, callback);
-		free(query_second);
-	} else {
-		isr3_err("A maximum of two wildcards are supported!\n");
+	return p == pattern_len;
+}
+
+void permuterm_verify_begin(char* pattern, int pattern_len, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	isr3_verify_pattern = pattern;
+	isr3_verify_pattern_len = pattern_len;
+	isr3_verify_callback = callback;
+}
+
+void callback_verify(struct isr3_vocab* vocab, uint32_t word, int search_id) {
+	/* The probe only narrows down the candidates, their postings are untouched unless the word matches the whole pattern. */
+	int word_len;
+	char* word_buf = isr3_vocab_word(vocab, word, &word_len);
+
+	if (pattern_match(isr3_verify_pattern, isr3_verify_pattern_len, word_buf, word_len)) {
+		isr3_verify_callback(vocab, word, search_id);
+	}
+}
+
+void search_permuterm(char* query, int len, struct isr3_permuterm_index* index, int wildcard_count, int* search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	char* probes = malloc(2 * len + 2);
+	int probe_lens[ISR3_MAX_PROBES];
+
+	if (!probes) {
+		isr3_err("malloc failure\n");
 		exit(1);
 	}
+
+	int verify = 0, count = permuterm_probes(query, len, wildcard_count, probes, probe_lens, &verify);
+
+	if (verify) {
+		permuterm_verify_begin(query, len, callback);
+		callback = callback_verify;
+	}
+
+	for (int i = 0, offset = 0; i < count; offset += probe_lens[i++]) {
+		isr3_permuterm_index_search(index, probes + offset, probe_lens[i], ++*search_id, callback);
+	}
+
+	free(probes);
 }
 
-void callback_permuterm(struct isr3_word_entry* entry, int search_id) {
-	struct isr3_ref_entry* cur_ref = entry->ref_list_head;
+void callback_permuterm(struct isr3_vocab* vocab, uint32_t word, int search_id) {
+	struct isr3_postings postings;
+	unsigned int cur_ref = 0;
+	unsigned long walked = 0;
 
-	while (cur_ref) {
-		if (isr3_ref_entry_sids[cur_ref->ref_id] == search_id - 1) {
-			isr3_ref_entry_sids[cur_ref->ref_id] = search_id;
+	isr3_vocab_postings(vocab, word, &postings);
+
+	while (isr3_postings_next(&postings, &cur_ref)) {
+		if (isr3_ref_entry_sids[cur_ref] == search_id - 1) {
+			isr3_ref_entry_sids[cur_ref] = search_id;
 		}
 
-		cur_ref = cur_ref->next;
+		++walked;
 	}
+
+	isr3_stats_add(postings, walked);
 }
@@ -0,0 +1,59 @@
+#ifndef ISR3_H
+#define ISR3_H
+
+/*
+ * Shared program declarations.
+ * The vocabulary, permuterm generation and search helpers live in isr-prog3.c, but the segment code needs them too.
+ */
+
+#define ISR3_HASH_LENGTH 4
+#define ISR3_MAX_PROBES 1 /* Most prefix searches a single query term turns into. */
+
+#include <stdio.h>
+
+#include "permuterm.h"
+#include "vocab.h"
+
+/*
+ * The tree structure is pretty straightforward.
+ * Each node has a hash value and a list of words which hashed to that value.
+ * The words themselves (and their lists of file references) live in the segment's vocabulary, see vocab.h.
+ */
+
+typedef struct isr3_tree_node isr3_tree_node;
+
+struct isr3_tree_node {
+	isr3_tree_node* left, *right;
+	uint32_t word_list; // First word ID corresponding to node_hash[], the rest are chained through the vocabulary.
+	char node_hash[ISR3_HASH_LENGTH];
+};
+
+/* Program function declarations. */
+
+int parse_file(const char* filename, unsigned int ref_id, isr3_tree_node** root, struct isr3_vocab* vocab, int* largest_word_length); /* Parse a file into the tree. */
+int read_word(FILE* fd, char** word, int* word_len); /* Read the next (unstemmed) word into a new buffer. Returns 1 for a word, 0 at EOF and -1 on failure. */
+int insert_word(char* word_buf, int word_len, unsigned int ref_id, isr3_tree_node** root, struct isr3_vocab* vocab); /* Insert a word into the tree. */
+int exact_term(char* query, int query_len, int wildcard_count); /* 1 if the term is answered by a vocabulary lookup rather than the permuterm index. */
+uint32_t find_word(char* word_buf, int word_len, isr3_tree_node* root, struct isr3_vocab* vocab); /* Look up a (stemmed) word in the tree, ISR3_VOCAB_NONE if it isn't there. */
+void free_tree(isr3_tree_node* root);
+
+void gen_permuterm(uint32_t word, struct isr3_permuterm_index* index); /* For each permutation of the word, insert a permuterm key pointing to it into the index's btree. */
+int permuterm_probes(char* query, int query_len, int wildcard_count, char* probes, int* probe_lens, int* verify); /* Rotate a term into the prefixes to search for, returns how many. */
+int permuterm_best_probe(char* query, int query_len, char* probe); /* The most selective single probe for any `*` and `?` pattern. */
+int pattern_match(char* pattern, int pattern_len, char* word, int word_len); /* 1 if the word matches the `*` and `?` pattern. */
+int permuterm_pattern(char* query, int query_len, char* pattern); /* The `*` and `?` pattern equivalent to a search term, `pattern` needs query_len + 1 bytes. */
+void permuterm_verify_begin(char* pattern, int pattern_len, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)); /* Per thread: callback_verify() passes matches of `pattern` on to `callback`. */
+void callback_verify(struct isr3_vocab* vocab, uint32_t word, int search_id);
+void search_permuterm(char* query, int query_len, struct isr3_permuterm_index* tree, int wildcard_count, int* search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+void callback_permuterm(struct isr3_vocab* vocab, uint32_t word, int search_id);
+
+/* Utility functions : hashing and comparing words. */
+
+int hash_word(char* word_buf, int word_len, char* out_buf, int out_len); /* Hash a word into a buffer. */
+int word_cmp(char* word_buf1, int word_len1, char* word_buf2, int word_len2); /* Returns 1 if word1 > word2, -1 if word1 < word2, and 0 if word1 = word2. */
+
+/* Stemmer function declarations. */
+
+extern int stem(char* c, int i, int j);
+
+#endif
@@ -0,0 +1,337 @@
+#include "kgram.h"
+#include "isr3.h"
+#include "mem.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct isr3_kgram_list* isr3_kgram_index_find(struct isr3_kgram_index* ptr, const char* gram);
+static struct isr3_kgram_list* isr3_kgram_index_slot(struct isr3_kgram_index* ptr, const char* gram);
+static void isr3_kgram_index_rehash(struct isr3_kgram_index* ptr);
+static void* isr3_kgram_realloc(enum isr3_mem_tag tag, void* ptr, size_t old_size, size_t new_size, size_t old_count, size_t new_count);
+static unsigned int isr3_kgram_hash(const char* gram);
+static int isr3_kgram_list_cmp(const void* a, const void* b);
+static int isr3_kgram_list_contains(struct isr3_kgram_list* list, unsigned int* pos, uint32_t id);
+static void isr3_kgram_search_locked(struct isr3_kgram_index* ptr, char* pattern, int pattern_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+
+struct isr3_kgram_index* isr3_kgram_index_create(struct isr3_vocab* vocab, int concurrent) {
+	struct isr3_kgram_index* output = malloc(sizeof *output);
+
+	if (!output) {
+		return NULL;
+	}
+
+	memset(output, 0, sizeof *output);
+	output->vocab = vocab;
+	output->concurrent = concurrent;
+	output->num_slots = 256;
+
+	if (!(output->lists = isr3_mem_alloc(ISR3_MEM_KGRAM_TABLE, sizeof *output->lists * output->num_slots, output->num_slots))) {
+		free(output);
+		return NULL;
+	}
+
+	memset(output->lists, 0, sizeof *output->lists * output->num_slots);
+
+	if (concurrent && pthread_rwlock_init(&output->lock, NULL)) {
+		isr3_mem_free(ISR3_MEM_KGRAM_TABLE, output->lists, sizeof *output->lists * output->num_slots, output->num_slots);
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+void isr3_kgram_index_free(struct isr3_kgram_index* ptr) {
+	for (unsigned int i = 0; i < ptr->num_slots; ++i) {
+		if (ptr->lists[i].ids) {
+			isr3_mem_free(ISR3_MEM_KGRAM_LIST, ptr->lists[i].ids, sizeof *ptr->lists[i].ids * ptr->lists[i].max_ids, ptr->lists[i].max_ids);
+		}
+	}
+
+	isr3_mem_free(ISR3_MEM_KGRAM_TABLE, ptr->lists, sizeof *ptr->lists * ptr->num_slots, ptr->num_slots);
+
+	if (ptr->concurrent) {
+		pthread_rwlock_destroy(&ptr->lock);
+	}
+
+	free(ptr);
+}
+
+void isr3_kgram_index_insert(struct isr3_kgram_index* ptr, uint32_t id) {
+	int word_len;
+	char* word = isr3_vocab_word(ptr->vocab, id, &word_len), padded[word_len + 2];
+
+	padded[0] = '$';
+	memcpy(padded + 1, word, word_len);
+	padded[word_len + 1] = '$';
+
+	if (ptr->concurrent) {
+		pthread_rwlock_wrlock(&ptr->lock);
+	}
+
+	ptr->num_words = id + 1;
+
+	for (int i = 0; i + ISR3_KGRAM_K <= word_len + 2; ++i) {
+		struct isr3_kgram_list* list = isr3_kgram_index_slot(ptr, padded + i);
+
+		if (list->num_ids && list->ids[list->num_ids - 1] == id) {
+			continue; /* The same k-gram twice in one word. */
+		}
+
+		if (list->num_ids == list->max_ids) {
+			unsigned int max_ids = list->max_ids ? list->max_ids * 2 : 4;
+
+			list->ids = isr3_kgram_realloc(ISR3_MEM_KGRAM_LIST, list->ids, sizeof *list->ids * list->max_ids, sizeof *list->ids * max_ids, list->max_ids, max_ids);
+			list->max_ids = max_ids;
+		}
+
+		list->ids[list->num_ids++] = id;
+		ptr->num_postings++;
+	}
+
+	if (ptr->concurrent) {
+		pthread_rwlock_unlock(&ptr->lock);
+	}
+}
+
+void isr3_kgram_index_search(struct isr3_kgram_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	char pattern[query_len + 2];
+	int pattern_len = permuterm_pattern(query, query_len, pattern);
+
+	isr3_stats_add(searches, 1);
+
+	if (ptr->concurrent) {
+		pthread_rwlock_rdlock(&ptr->lock);
+	}
+
+	isr3_kgram_search_locked(ptr, pattern, pattern_len, search_id, callback);
+
+	if (ptr->concurrent) {
+		pthread_rwlock_unlock(&ptr->lock);
+	}
+}
+
+void isr3_kgram_index_shape(struct isr3_kgram_index* ptr, unsigned long* lists, unsigned long* postings) {
+	*lists = ptr->num_lists;
+	*postings = ptr->num_postings;
+}
+
+void isr3_kgram_search_locked(struct isr3_kgram_index* ptr, char* pattern, int pattern_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	struct isr3_kgram_list* lists[pattern_len + 2];
+	unsigned int positions[pattern_len + 2];
+	int num_lists = 0;
+	char padded[pattern_len + 2];
+	unsigned long candidates = 0, matches = 0;
+
+	padded[0] = '$';
+	memcpy(padded + 1, pattern, pattern_len);
+	padded[pattern_len + 1] = '$';
+
+	for (int i = 0; i + ISR3_KGRAM_K <= pattern_len + 2; ++i) {
+		int complete = 1;
+
+		for (int j = 0; j < ISR3_KGRAM_K; ++j) {
+			if (padded[i + j] == '*' || padded[i + j] == '?') {
+				complete = 0;
+				break;
+			}
+		}
+
+		if (!complete) {
+			continue;
+		}
+
+		struct isr3_kgram_list* list = isr3_kgram_index_find(ptr, padded + i);
+
+		if (!list) {
+			return; /* No word has this k-gram, so none can match. */
+		}
+
+		lists[num_lists] = list;
+		positions[num_lists++] = 0;
+	}
+
+	if (!num_lists) {
+		/* Nothing to narrow the search down with. */
+		for (unsigned int id = 0; id < ptr->num_words; ++id) {
+			int word_len;
+			char* word = isr3_vocab_word(ptr->vocab, id, &word_len);
+
+			if (pattern_match(pattern, pattern_len, word, word_len)) {
+				callback(ptr->vocab, id, search_id);
+				++matches;
+			}
+		}
+
+		isr3_stats_add(search_comparisons, ptr->num_words);
+		isr3_stats_add(callbacks, matches);
+		return;
+	}
+
+	/* Walk the shortest list and probe the others, which only ever move forward since every list is ascending. */
+	qsort(lists, num_lists, sizeof *lists, isr3_kgram_list_cmp);
+
+	for (unsigned int i = 0; i < lists[0]->num_ids; ++i) {
+		uint32_t id = lists[0]->ids[i];
+		int found = 1;
+
+		for (int j = 1; j < num_lists && found; ++j) {
+			found = isr3_kgram_list_contains(lists[j], positions + j, id);
+		}
+
+		if (!found) {
+			continue;
+		}
+
+		++candidates;
+
+		int word_len;
+		char* word = isr3_vocab_word(ptr->vocab, id, &word_len);
+
+		/* The k-grams only say the pieces occur somewhere, the pattern decides their order and the wildcard lengths. */
+		if (pattern_match(pattern, pattern_len, word, word_len)) {
+			callback(ptr->vocab, id, search_id);
+			++matches;
+		}
+	}
+
+	isr3_stats_add(search_comparisons, candidates);
+	isr3_stats_add(callbacks, matches);
+}
+
+int isr3_kgram_list_contains(struct isr3_kgram_list* list, unsigned int* pos, uint32_t id) {
+	/* Galloping search from the last position, then a binary search in the last step. */
+	unsigned int low = *pos, step = 1, high = low;
+
+	while (high < list->num_ids && list->ids[high] < id) {
+		low = high + 1;
+		high += step;
+		step *= 2;
+	}
+
+	if (high > list->num_ids) {
+		high = list->num_ids;
+	}
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (list->ids[mid] < id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	*pos = low;
+	return low < list->num_ids && list->ids[low] == id;
+}
+
+int isr3_kgram_list_cmp(const void* a, const void* b) {
+	const struct isr3_kgram_list* x = *(struct isr3_kgram_list* const*) a, *y = *(struct isr3_kgram_list* const*) b;
+	return (x->num_ids > y->num_ids) - (x->num_ids < y->num_ids);
+}
+
+struct isr3_kgram_list* isr3_kgram_index_find(struct isr3_kgram_index* ptr, const char* gram) {
+	for (unsigned int i = isr3_kgram_hash(gram) & (ptr->num_slots - 1); ; i = (i + 1) & (ptr->num_slots - 1)) {
+		if (!ptr->lists[i].ids) {
+			return NULL;
+		}
+
+		if (!memcmp(ptr->lists[i].gram, gram, ISR3_KGRAM_K)) {
+			return ptr->lists + i;
+		}
+	}
+}
+
+struct isr3_kgram_list* isr3_kgram_index_slot(struct isr3_kgram_index* ptr, const char* gram) {
+	struct isr3_kgram_list* output = isr3_kgram_index_find(ptr, gram);
+
+	if (output) {
+		return output;
+	}
+
+	/* Keep the table at most half full. */
+	if (2 * (ptr->num_lists + 1) > ptr->num_slots) {
+		isr3_kgram_index_rehash(ptr);
+	}
+
+	unsigned int i = isr3_kgram_hash(gram) & (ptr->num_slots - 1);
+
+	while (ptr->lists[i].ids) {
+		i = (i + 1) & (ptr->num_slots - 1);
+	}
+
+	output = ptr->lists + i;
+	memcpy(output->gram, gram, ISR3_KGRAM_K);
+
+	output->max_ids = 4;
+	output->num_ids = 0;
+
+	if (!(output->ids = isr3_mem_alloc(ISR3_MEM_KGRAM_LIST, sizeof *output->ids * output->max_ids, output->max_ids))) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	ptr->num_lists++;
+	return output;
+}
+
+void isr3_kgram_index_rehash(struct isr3_kgram_index* ptr) {
+	unsigned int num_slots = ptr->num_slots * 2;
+	struct isr3_kgram_list* lists = isr3_mem_alloc(ISR3_MEM_KGRAM_TABLE, sizeof *lists * num_slots, num_slots);
+
+	if (!lists) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	memset(lists, 0, sizeof *lists * num_slots);
+
+	for (unsigned int i = 0; i < ptr->num_slots; ++i) {
+		if (!ptr->lists[i].ids) {
+			continue;
+		}
+
+		unsigned int j = isr3_kgram_hash(ptr->lists[i].gram) & (num_slots - 1);
+
+		while (lists[j].ids) {
+			j = (j + 1) & (num_slots - 1);
+		}
+
+		lists[j] = ptr->lists[i];
+	}
+
+	isr3_mem_free(ISR3_MEM_KGRAM_TABLE, ptr->lists, sizeof *ptr->lists * ptr->num_slots, ptr->num_slots);
+
+	ptr->lists = lists;
+	ptr->num_slots = num_slots;
+}
+
+void* isr3_kgram_realloc(enum isr3_mem_tag tag, void* ptr, size_t old_size, size_t new_size, size_t old_count, size_t new_count) {
+	if (ptr) {
+		isr3_mem_untrack(tag, ptr, old_size, old_count);
+	}
+
+	void* output = realloc(ptr, new_size);
+
+	if (!output) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	isr3_mem_track(tag, output, new_size, new_count);
+	return output;
+}
+
+unsigned int isr3_kgram_hash(const char* gram) {
+	uint32_t output = 0;
+
+	for (int i = 0; i < ISR3_KGRAM_K; ++i) {
+		output = (output << 8) | (unsigned char) gram[i];
+	}
+
+	return (output * 2654435761u) >> 8;
+}
@@ -0,0 +1,56 @@
+#ifndef KGRAM_H
+#define KGRAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "vocab.h"
+
+#define ISR3_KGRAM_K 3
+
+/*
+ * Character k-gram index, the low-memory alternative to the permuterm index (see `--engine`).
+ *
+ * Words are inserted in ascending order of their vocabulary IDs, and every k-gram of `$word$` maps to the ascending list of
+ * IDs of the words containing it. A word of length L costs L four byte postings, where the permuterm index stores L + 1 rotated keys of
+ * L + 1 bytes each, plus their B-tree slots.
+ *
+ * A wildcard pattern is answered by intersecting the lists of every k-gram which lies completely inside one of its literal
+ * runs (with `$` marking the word boundaries), then matching the surviving words against the whole pattern. Patterns
+ * without a single complete k-gram, like `a*`, have to check every word.
+ *
+ * Concurrent indexes are guarded by a read-write lock: inserts take it for writing, searches for reading.
+ */
+
+struct isr3_kgram_list {
+	char gram[ISR3_KGRAM_K];
+	unsigned int num_ids, max_ids;
+	uint32_t* ids; // NULL for an empty slot.
+};
+
+struct isr3_kgram_index {
+	struct isr3_kgram_list* lists; // Open addressing on the gram, `num_slots` is a power of two.
+	unsigned int num_slots, num_lists;
+
+	struct isr3_vocab* vocab;
+	unsigned int num_words; // One past the highest ID inserted.
+	unsigned long num_postings;
+
+	int concurrent;
+	pthread_rwlock_t lock;
+};
+
+struct isr3_kgram_index* isr3_kgram_index_create(struct isr3_vocab* vocab, int concurrent);
+void isr3_kgram_index_free(struct isr3_kgram_index* ptr);
+
+void isr3_kgram_index_insert(struct isr3_kgram_index* ptr, uint32_t word);
+
+/*
+ * Calls `callback` once for every word matching the `*` and `?` pattern. As with the permuterm index, a hand-written
+ * permuterm query S$P is understood as the pattern P*S and the empty query matches every word.
+ */
+void isr3_kgram_index_search(struct isr3_kgram_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+
+void isr3_kgram_index_shape(struct isr3_kgram_index* ptr, unsigned long* lists, unsigned long* postings); /* Distinct k-grams and list entries. */
+
+#endif
@@ -0,0 +1,83 @@
+#include "mem.h"
+
+#include <stdlib.h>
+#include <malloc.h>
+
+struct isr3_mem_counter {
+	unsigned long count, blocks, bytes, usable;
+};
+
+/* Ingest, the segment merger and query threads all allocate, so the counters are updated atomically. */
+static struct isr3_mem_counter isr3_mem_counters[ISR3_MEM_TAG_COUNT];
+
+static const char* isr3_mem_names[ISR3_MEM_TAG_COUNT] = {
+	"tree_node", "vocab", "word_string", "ref_entry", "permuterm_node", "permuterm_key", "key_bytes", "permuterm_value", "cache", "kgram_list", "kgram_table", "fm_index", "buffer_pool"
+};
+
+static void isr3_mem_add(enum isr3_mem_tag tag, long count, long blocks, long bytes, long usable);
+
+void* isr3_mem_alloc(enum isr3_mem_tag tag, size_t size, size_t count) {
+	void* output = malloc(size);
+
+	if (output) {
+		isr3_mem_track(tag, output, size, count);
+	}
+
+	return output;
+}
+
+void isr3_mem_free(enum isr3_mem_tag tag, void* ptr, size_t size, size_t count) {
+	if (!ptr) {
+		return;
+	}
+
+	isr3_mem_untrack(tag, ptr, size, count);
+	free(ptr);
+}
+
+void isr3_mem_track(enum isr3_mem_tag tag, void* ptr, size_t size, size_t count) {
+	isr3_mem_add(tag, count, 1, size, malloc_usable_size(ptr));
+}
+
+void isr3_mem_untrack(enum isr3_mem_tag tag, void* ptr, size_t size, size_t count) {
+	isr3_mem_add(tag, -(long) count, -1, -(long) size, -(long) malloc_usable_size(ptr));
+}
+
+void isr3_mem_add(enum isr3_mem_tag tag, long count, long blocks, long bytes, long usable) {
+	struct isr3_mem_counter* counter = isr3_mem_counters + tag;
+
+	__atomic_add_fetch(&counter->count, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counter->blocks, blocks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counter->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counter->usable, usable, __ATOMIC_RELAXED);
+}
+
+void isr3_mem_use(enum isr3_mem_tag tag, long size, long count) {
+	isr3_mem_add(tag, count, 0, size, 0);
+}
+
+unsigned long isr3_mem_heap_bytes(enum isr3_mem_tag tag) {
+	return __atomic_load_n(&isr3_mem_counters[tag].usable, __ATOMIC_RELAXED) + __atomic_load_n(&isr3_mem_counters[tag].blocks, __ATOMIC_RELAXED) * ISR3_MEM_CHUNK_HEADER;
+}
+
+void isr3_mem_report(FILE* fd) {
+	unsigned long total_bytes = 0, total_heap = 0;
+
+	for (int i = 0; i < ISR3_MEM_TAG_COUNT; ++i) {
+		unsigned long count = __atomic_load_n(&isr3_mem_counters[i].count, __ATOMIC_RELAXED);
+		unsigned long blocks = __atomic_load_n(&isr3_mem_counters[i].blocks, __ATOMIC_RELAXED);
+		unsigned long bytes = __atomic_load_n(&isr3_mem_counters[i].bytes, __ATOMIC_RELAXED);
+		unsigned long heap = __atomic_load_n(&isr3_mem_counters[i].usable, __ATOMIC_RELAXED) + blocks * ISR3_MEM_CHUNK_HEADER;
+
+		/* Overhead is everything the heap spends beyond the bytes the structures need: size class rounding and headers. */
+		fprintf(fd, "isr3-mem tag=%s count=%lu blocks=%lu bytes=%lu avg_bytes=%.1f heap_bytes=%lu overhead_bytes=%lu overhead_pct=%.1f\n",
+				isr3_mem_names[i], count, blocks, bytes, count ? (double) bytes / count : 0.0, heap, heap - bytes,
+				heap ? 100.0 * (heap - bytes) / heap : 0.0);
+
+		total_bytes += bytes;
+		total_heap += heap;
+	}
+
+	fprintf(fd, "isr3-mem tag=total bytes=%lu heap_bytes=%lu overhead_bytes=%lu overhead_pct=%.1f\n",
+			total_bytes, total_heap, total_heap - total_bytes, total_heap ? 100.0 * (total_heap - total_bytes) / total_heap : 0.0);
+}
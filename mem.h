@@ -0,0 +1,53 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Tracked allocations, tagged by the data structure they hold.
+ *
+ * Each tag keeps the number of live structures, the number of live heap blocks (a loaded segment keeps all of its words in
+ * one block, for example), the bytes the structures actually need and the bytes the allocator handed out for them.
+ * The latter come from malloc_usable_size(), so rounding up to the allocator's size classes shows up as overhead.
+ *
+ * The wrappers behave exactly like malloc()/free() otherwise: failures return NULL and are left to the caller.
+ * `size` must be the same at free time as at allocation time, and `count` is how many structures the block holds.
+ */
+
+enum isr3_mem_tag {
+	ISR3_MEM_TREE_NODE, // isr3_tree_node
+	ISR3_MEM_VOCAB, // Vocabulary columns (see vocab.h), counted per word.
+	ISR3_MEM_WORD_STRING, // Word text, accounted as word_len + 1 bytes.
+	ISR3_MEM_REF_ENTRY, // isr3_ref_entry, or a ref ID in the flat postings of a loaded segment.
+	ISR3_MEM_PERMUTERM_NODE,
+	ISR3_MEM_PERMUTERM_KEY,
+	ISR3_MEM_KEY_BYTES, // The rotated key strings themselves: whole in inner nodes, one front-coded buffer per leaf.
+	ISR3_MEM_PERMUTERM_VALUE, // Extra values of repeated keys.
+	ISR3_MEM_CACHE, // Query and term cache entries.
+	ISR3_MEM_KGRAM_LIST, // k-gram postings, counted per word ID slot.
+	ISR3_MEM_KGRAM_TABLE, // The k-gram hash table.
+	ISR3_MEM_FM, // FM-index BWT, rank checkpoints and word tables, counted per index.
+	ISR3_MEM_BUFFER_POOL, // Buffer pool frames for postings on disk (see bufpool.h), counted per page.
+	ISR3_MEM_TAG_COUNT
+};
+
+#define ISR3_MEM_CHUNK_HEADER sizeof(size_t) /* glibc keeps one size word in front of every block. */
+
+void* isr3_mem_alloc(enum isr3_mem_tag tag, size_t size, size_t count);
+void isr3_mem_free(enum isr3_mem_tag tag, void* ptr, size_t size, size_t count);
+
+/* For blocks allocated elsewhere (e.g. by the tokenizer) which become a tracked structure, and back. */
+void isr3_mem_track(enum isr3_mem_tag tag, void* ptr, size_t size, size_t count);
+void isr3_mem_untrack(enum isr3_mem_tag tag, void* ptr, size_t size, size_t count);
+
+/* For structures carved out of a block tracked with no structures (see pool.h): counts them as they're handed out and returned. */
+void isr3_mem_use(enum isr3_mem_tag tag, long size, long count);
+
+/* Heap bytes currently spent on one tag, as in the report. */
+unsigned long isr3_mem_heap_bytes(enum isr3_mem_tag tag);
+
+/* Prints one `isr3-mem tag=.. key=value ..` line per structure and a total line. */
+void isr3_mem_report(FILE* fd);
+
+#endif
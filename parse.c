@@ -0,0 +1,325 @@
+#include "parse.h"
+#include "debug.h"
+#include "perf.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct isr3_parse_chunk {
+	char* start;
+	size_t len;
+
+	/* The chunk's distinct (stemmed) words in the order they first appear, and an open addressing table of their indexes. */
+	char** words; // NULL once the word is handed to insert_word().
+	int* word_lens;
+	uint32_t* hashes;
+	int num_words, max_words;
+	int* table; // -1 marks a free slot.
+	int table_size;
+
+	int done, result; // `result` is 1 if the whole chunk was read, 0 if it stopped at a byte which reads as EOF and -1 on failure.
+	unsigned long tokens;
+};
+
+struct isr3_parse_job {
+	struct isr3_parse_chunk* chunks;
+	int num_chunks, ahead;
+	int next, merged, stop; // `next` is the first chunk nobody took yet, `merged` the first one which isn't inserted yet.
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Broadcast whenever a chunk is done or merged, and on shutdown.
+};
+
+static void* isr3_parse_worker(void* arg);
+static void isr3_parse_chunk_read(struct isr3_parse_chunk* chunk);
+static int isr3_parse_chunk_add(struct isr3_parse_chunk* chunk, char* word, int word_len); /* Takes over the word, 0 on failure. */
+static void isr3_parse_chunk_free(struct isr3_parse_chunk* chunk);
+
+int isr3_parse_parallel(FILE* fd, size_t size, unsigned int ref_id, isr3_tree_node** root, struct isr3_vocab* vocab, int* largest_word_length) {
+	char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+	struct isr3_parse_job job;
+
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	memset(&job, 0, sizeof job);
+
+	/* Every chunk but the last is at least ISR3_PARSE_CHUNK bytes long. */
+	if (!(job.chunks = calloc(size / ISR3_PARSE_CHUNK + 1, sizeof *job.chunks))) {
+		munmap(data, size);
+		return -1;
+	}
+
+	for (size_t start = 0; start < size; ) {
+		size_t end = size - start > ISR3_PARSE_CHUNK ? start + ISR3_PARSE_CHUNK : size;
+
+		/* read_word() passes a plain char to isspace() as well. */
+		while (end < size && !isspace(data[end - 1])) {
+			++end;
+		}
+
+		job.chunks[job.num_chunks].start = data + start;
+		job.chunks[job.num_chunks++].len = end - start;
+		start = end;
+	}
+
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t* threads = malloc(sizeof *threads * num_threads);
+	int started = 0, result = 1, last = -1; // `last` is the last chunk which was merged.
+
+	job.ahead = num_threads * ISR3_PARSE_AHEAD;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	/* The calling thread only merges, so every core gets a worker. */
+	for (long i = 0; threads && i < num_threads; ++i) {
+		if (!pthread_create(threads + started, NULL, isr3_parse_worker, &job)) {
+			++started;
+		}
+	}
+
+	isr3_debugf("tokenizing %zu bytes in %d chunks with %d threads\n", size, job.num_chunks, started);
+
+	if (started) {
+		struct isr3_perf_sample counters;
+
+		isr3_perf_begin(&counters);
+		isr3_stats_add(files, 1);
+
+		for (int i = 0; i < job.num_chunks; ++i) {
+			struct isr3_parse_chunk* chunk = job.chunks + i;
+
+			pthread_mutex_lock(&job.lock);
+
+			while (!chunk->done) {
+				pthread_cond_wait(&job.cond, &job.lock);
+			}
+
+			pthread_mutex_unlock(&job.lock);
+
+			unsigned long start = isr3_stats_now();
+
+			last = i;
+
+			for (int k = 0; k < chunk->num_words; ++k) {
+				if (largest_word_length && chunk->word_lens[k] >= *largest_word_length) {
+					*largest_word_length = chunk->word_lens[k];
+				}
+
+				if (!insert_word(chunk->words[k], chunk->word_lens[k], ref_id, root, vocab)) {
+					isr3_err("Failed to insert word into tree.\n");
+					chunk->result = -1;
+					break;
+				}
+
+				chunk->words[k] = NULL;
+			}
+
+			isr3_stats_phase_end(ISR3_PHASE_INSERT, start);
+
+			/* Like parse_file(), a failure still keeps the words before it. An EOF byte ends the file in this chunk. */
+			if (chunk->result <= 0) {
+				result = chunk->result == 0;
+				break;
+			}
+
+			pthread_mutex_lock(&job.lock);
+			job.merged = i + 1;
+			pthread_cond_broadcast(&job.cond);
+			pthread_mutex_unlock(&job.lock);
+		}
+
+		isr3_perf_end(ISR3_PHASE_INSERT, &counters);
+	} else {
+		result = -1; /* The caller parses the file itself. */
+	}
+
+	pthread_mutex_lock(&job.lock);
+	job.stop = 1;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
+
+	for (int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (int i = 0; i < job.num_chunks; ++i) {
+		if (i > last) {
+			isr3_stats_add(tokens, -job.chunks[i].tokens); /* Read ahead of the end of the file, they aren't part of it. */
+		}
+
+		isr3_parse_chunk_free(job.chunks + i);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+
+	free(threads);
+	free(job.chunks);
+	munmap(data, size);
+
+	return result;
+}
+
+void* isr3_parse_worker(void* arg) {
+	struct isr3_parse_job* job = arg;
+
+	pthread_mutex_lock(&job->lock);
+
+	while (!job->stop && job->next < job->num_chunks) {
+		/* Chunks wait for the merge with all of their words, so only a few may be done ahead of it. */
+		if (job->next - job->merged >= job->ahead) {
+			pthread_cond_wait(&job->cond, &job->lock);
+			continue;
+		}
+
+		struct isr3_parse_chunk* chunk = job->chunks + job->next++;
+
+		pthread_mutex_unlock(&job->lock);
+		isr3_parse_chunk_read(chunk);
+		pthread_mutex_lock(&job->lock);
+
+		chunk->done = 1;
+		pthread_cond_broadcast(&job->cond);
+	}
+
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+void isr3_parse_chunk_read(struct isr3_parse_chunk* chunk) {
+	/* The same loop as parse_file(), over the chunk's bytes. */
+	unsigned long start = isr3_stats_now(), stemmed = 0;
+	FILE* fd = fmemopen(chunk->start, chunk->len, "r");
+	char* word = NULL;
+	int word_len = 0, result = 0;
+
+	if (!fd) {
+		isr3_err("Failed to open a chunk for reading.\n");
+		chunk->result = -1;
+		return;
+	}
+
+	while ((result = read_word(fd, &word, &word_len)) > 0) {
+		chunk->tokens++;
+
+		unsigned long stem_start = isr3_stats_now();
+		int stem_length = stem(word, 0, word_len - 1) + 1;
+
+		stemmed += isr3_stats_now() - stem_start;
+		word[stem_length] = 0;
+
+		if (!isr3_parse_chunk_add(chunk, word, stem_length)) {
+			result = -1;
+			break;
+		}
+	}
+
+	/* read_word() returns 0 at the end of the chunk, and also at a byte which reads as EOF before the end, see parse.h. */
+	chunk->result = result < 0 ? -1 : !!feof(fd);
+	fclose(fd);
+
+	if (isr3_stats_enabled) {
+		isr3_stats_add(phase_ns[ISR3_PHASE_PARSE], isr3_stats_now() - start - stemmed);
+		isr3_stats_add(phase_ns[ISR3_PHASE_STEM], stemmed);
+	}
+}
+
+int isr3_parse_chunk_add(struct isr3_parse_chunk* chunk, char* word, int word_len) {
+	uint32_t hash = 0;
+
+	hash_word(word, word_len, (char*) &hash, sizeof hash);
+
+	if (2 * (chunk->num_words + 1) > chunk->table_size) {
+		/* Keep the table at most half full. */
+		int table_size = chunk->table_size ? chunk->table_size * 2 : 1024;
+		int* table = malloc(sizeof *table * table_size);
+
+		if (!table) {
+			isr3_err("malloc failure\n");
+			free(word);
+			return 0;
+		}
+
+		memset(table, -1, sizeof *table * table_size);
+
+		for (int i = 0; i < chunk->num_words; ++i) {
+			int slot = chunk->hashes[i] & (table_size - 1);
+
+			while (table[slot] != -1) {
+				slot = (slot + 1) & (table_size - 1);
+			}
+
+			table[slot] = i;
+		}
+
+		free(chunk->table);
+		chunk->table = table;
+		chunk->table_size = table_size;
+	}
+
+	int slot = hash & (chunk->table_size - 1);
+
+	while (chunk->table[slot] != -1) {
+		int cur = chunk->table[slot];
+
+		if (chunk->hashes[cur] == hash && !word_cmp(chunk->words[cur], chunk->word_lens[cur], word, word_len)) {
+			free(word); /* Already in this chunk, and so already in the file's postings once it is merged. */
+			return 1;
+		}
+
+		slot = (slot + 1) & (chunk->table_size - 1);
+	}
+
+	if (chunk->num_words == chunk->max_words) {
+		int max_words = chunk->max_words ? chunk->max_words * 2 : 512;
+		char** words = realloc(chunk->words, sizeof *words * max_words);
+
+		if (words) {
+			chunk->words = words;
+		}
+
+		int* word_lens = words ? realloc(chunk->word_lens, sizeof *word_lens * max_words) : NULL;
+
+		if (word_lens) {
+			chunk->word_lens = word_lens;
+		}
+
+		uint32_t* hashes = word_lens ? realloc(chunk->hashes, sizeof *hashes * max_words) : NULL;
+
+		if (!hashes) {
+			isr3_err("malloc failure\n");
+			free(word);
+			return 0;
+		}
+
+		chunk->hashes = hashes;
+		chunk->max_words = max_words;
+	}
+
+	chunk->words[chunk->num_words] = word;
+	chunk->word_lens[chunk->num_words] = word_len;
+	chunk->hashes[chunk->num_words] = hash;
+	chunk->table[slot] = chunk->num_words++;
+
+	return 1;
+}
+
+void isr3_parse_chunk_free(struct isr3_parse_chunk* chunk) {
+	/* Only the words which were never merged are still ours. */
+	for (int i = 0; i < chunk->num_words; ++i) {
+		free(chunk->words[i]);
+	}
+
+	free(chunk->words);
+	free(chunk->word_lens);
+	free(chunk->hashes);
+	free(chunk->table);
+}
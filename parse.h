@@ -0,0 +1,30 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "isr3.h"
+
+#define ISR3_PARSE_PARALLEL_MIN (16 << 20) /* Files smaller than this are tokenized on the calling thread. */
+#define ISR3_PARSE_CHUNK (4 << 20) /* Bytes per chunk, before its end is moved past the next whitespace. */
+#define ISR3_PARSE_AHEAD 4 /* Chunks per thread which may be tokenized ahead of the one being merged. */
+
+/*
+ * Tokenizing one large file on every core.
+ *
+ * The file is mapped and cut into chunks which each end right after a whitespace character. read_word() is in the same
+ * state after any whitespace character it consumes (about to skip to the next word), so every chunk tokenizes exactly
+ * like the same bytes in the middle of the file: each chunk is read through fmemopen() by the unchanged read_word(), and
+ * the chunks' tokens, in order, are the sequential token stream. A byte which reads as EOF between words still ends the
+ * file there, and the chunks after it are dropped.
+ *
+ * Worker threads tokenize and stem the chunks and keep each chunk's distinct words in the order they first appear. The
+ * calling thread inserts them chunk by chunk, in file order, under the file's ref ID. A repeated word of the same file
+ * doesn't change the vocabulary, so this ends in exactly the state a sequential parse does, with a fraction of the inserts.
+ */
+
+/* 1 on success and 0 on failure like parse_file(), or -1 if nothing was parsed because the file couldn't be mapped or no thread started. */
+int isr3_parse_parallel(FILE* fd, size_t size, unsigned int ref_id, isr3_tree_node** root, struct isr3_vocab* vocab, int* largest_word_length);
+
+#endif
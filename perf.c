@@ -0,0 +1,198 @@
+#include "perf.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* One counter group per thread. `slots` maps each event to its position in the group, or -1 if it couldn't be opened. */
+struct isr3_perf_group {
+	int fds[ISR3_PERF_COUNT], slots[ISR3_PERF_COUNT];
+	int num_open;
+};
+
+int isr3_perf_enabled = 0;
+
+static unsigned long isr3_perf_totals[ISR3_PHASE_COUNT][ISR3_PERF_COUNT];
+static int isr3_perf_counted[ISR3_PHASE_COUNT]; // Events which contributed to each phase, as in isr3_perf_sample.valid.
+
+static const char* isr3_perf_names[ISR3_PERF_COUNT] = {"cycles", "instructions", "llc_misses", "branch_misses", "dtlb_misses"};
+
+static pthread_key_t isr3_perf_key;
+static pthread_once_t isr3_perf_once = PTHREAD_ONCE_INIT;
+
+static void isr3_perf_key_create(void);
+static void isr3_perf_group_close(void* arg);
+static struct isr3_perf_group* isr3_perf_group_get(void);
+static int isr3_perf_read(struct isr3_perf_sample* sample);
+static void isr3_perf_print(FILE* fd, unsigned long* values, int valid);
+
+void isr3_perf_begin(struct isr3_perf_sample* sample) {
+	sample->valid = 0;
+
+	if (isr3_perf_enabled) {
+		isr3_perf_read(sample);
+	}
+}
+
+void isr3_perf_end(enum isr3_phase phase, struct isr3_perf_sample* sample) {
+	struct isr3_perf_sample end;
+
+	if (!sample->valid || !isr3_perf_read(&end)) {
+		sample->valid = 0;
+		return;
+	}
+
+	sample->valid &= end.valid;
+
+	for (int i = 0; i < ISR3_PERF_COUNT; ++i) {
+		sample->values[i] = (sample->valid & (1 << i)) ? end.values[i] - sample->values[i] : 0;
+
+		if (sample->valid & (1 << i)) {
+			__atomic_add_fetch(&isr3_perf_totals[phase][i], sample->values[i], __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_or_fetch(&isr3_perf_counted[phase], sample->valid, __ATOMIC_RELAXED);
+}
+
+void isr3_perf_dump(FILE* fd) {
+	for (int i = 0; i < ISR3_PHASE_COUNT; ++i) {
+		int valid = __atomic_load_n(&isr3_perf_counted[i], __ATOMIC_RELAXED);
+		unsigned long values[ISR3_PERF_COUNT];
+
+		if (!valid) {
+			continue;
+		}
+
+		for (int j = 0; j < ISR3_PERF_COUNT; ++j) {
+			values[j] = __atomic_load_n(&isr3_perf_totals[i][j], __ATOMIC_RELAXED);
+		}
+
+		fprintf(fd, "isr3-perf phase=%s", isr3_phase_names[i]);
+		isr3_perf_print(fd, values, valid);
+	}
+}
+
+void isr3_perf_dump_query(FILE* fd, unsigned long query_id, struct isr3_perf_sample* sample) {
+	if (!sample->valid) {
+		return;
+	}
+
+	fprintf(fd, "isr3-perf query=%lu", query_id);
+	isr3_perf_print(fd, sample->values, sample->valid);
+}
+
+void isr3_perf_print(FILE* fd, unsigned long* values, int valid) {
+	for (int i = 0; i < ISR3_PERF_COUNT; ++i) {
+		if (valid & (1 << i)) {
+			fprintf(fd, " %s=%lu", isr3_perf_names[i], values[i]);
+		}
+	}
+
+	if ((valid & (1 << ISR3_PERF_CYCLES)) && (valid & (1 << ISR3_PERF_INSTRUCTIONS)) && values[ISR3_PERF_CYCLES]) {
+		fprintf(fd, " ipc=%.2f", (double) values[ISR3_PERF_INSTRUCTIONS] / values[ISR3_PERF_CYCLES]);
+	}
+
+	fprintf(fd, "\n");
+}
+
+void isr3_perf_key_create(void) {
+	pthread_key_create(&isr3_perf_key, isr3_perf_group_close);
+}
+
+void isr3_perf_group_close(void* arg) {
+	struct isr3_perf_group* group = arg;
+
+	for (int i = 0; i < ISR3_PERF_COUNT; ++i) {
+		if (group->fds[i] >= 0) {
+			close(group->fds[i]);
+		}
+	}
+
+	free(group);
+}
+
+struct isr3_perf_group* isr3_perf_group_get(void) {
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[ISR3_PERF_COUNT] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, /* The generic cache miss event is the last level cache on x86. */
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	};
+
+	pthread_once(&isr3_perf_once, isr3_perf_key_create);
+
+	struct isr3_perf_group* group = pthread_getspecific(isr3_perf_key);
+
+	if (group) {
+		return group;
+	}
+
+	if (!(group = malloc(sizeof *group))) {
+		return NULL;
+	}
+
+	group->num_open = 0;
+
+	for (int i = 0; i < ISR3_PERF_COUNT; ++i) {
+		group->fds[i] = group->slots[i] = -1;
+	}
+
+	for (int i = 0; i < ISR3_PERF_COUNT; ++i) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_kernel = 1; /* Works with the default perf_event_paranoid setting, and the index never enters the kernel. */
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		/* Measure the calling thread on any CPU. The first event which opens leads the group. */
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group->fds[0], 0);
+
+		if (fd < 0) {
+			isr3_debugf("perf event %s is unavailable\n", isr3_perf_names[i]);
+			continue;
+		}
+
+		group->fds[group->num_open] = fd; /* fds[] is in group order, which is also the order read() returns them in. */
+		group->slots[i] = group->num_open++;
+	}
+
+	pthread_setspecific(isr3_perf_key, group); /* Threads without counters keep an empty group so we don't retry every time. */
+	return group;
+}
+
+int isr3_perf_read(struct isr3_perf_sample* sample) {
+	struct isr3_perf_group* group = isr3_perf_group_get();
+	uint64_t buf[3 + ISR3_PERF_COUNT]; /* nr, time_enabled, time_running, values[nr] */
+
+	sample->valid = 0;
+
+	if (!group || !group->num_open || read(group->fds[0], buf, sizeof buf) < (ssize_t) (sizeof *buf * (3 + group->num_open))) {
+		return 0;
+	}
+
+	/* The counters are only ever scaled up when the kernel had to multiplex them. */
+	double scale = (buf[2] && buf[2] < buf[1]) ? (double) buf[1] / buf[2] : 1.0;
+
+	for (int i = 0; i < ISR3_PERF_COUNT; ++i) {
+		if (group->slots[i] >= 0) {
+			sample->values[i] = (unsigned long) (buf[3 + group->slots[i]] * scale);
+			sample->valid |= 1 << i;
+		}
+	}
+
+	return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+
+#include "stats.h"
+
+/*
+ * Optional hardware performance counters (Linux perf_event_open), scoped to the same phases as the stats timers.
+ *
+ * Every thread which records a phase lazily opens its own counter group, counting user space only. Counters the kernel or
+ * the hardware refuses (no permission, no PMU in a VM, ..) are simply left out of the reports, and if none can be opened
+ * nothing is reported at all.
+ *
+ * Reading a counter group is a system call, so phases are measured at a coarser grain than the timers: `parse` covers all
+ * of parse_file() (including stemming and vocabulary inserts) and `btree` covers building the permuterm keys of a file or a
+ * loaded segment. Worker threads of the parallel sort are not measured.
+ */
+
+enum isr3_perf_event {
+	ISR3_PERF_CYCLES,
+	ISR3_PERF_INSTRUCTIONS,
+	ISR3_PERF_LLC_MISSES,
+	ISR3_PERF_BRANCH_MISSES,
+	ISR3_PERF_DTLB_MISSES,
+	ISR3_PERF_COUNT
+};
+
+struct isr3_perf_sample {
+	unsigned long values[ISR3_PERF_COUNT];
+	int valid; // Bit i is set when values[i] was counted.
+};
+
+extern int isr3_perf_enabled;
+
+/* isr3_perf_end() adds the counts since isr3_perf_begin() to the phase totals and leaves them in `sample`. */
+void isr3_perf_begin(struct isr3_perf_sample* sample);
+void isr3_perf_end(enum isr3_phase phase, struct isr3_perf_sample* sample);
+
+/* `isr3-perf phase=.. cycles=.. ..` lines, next to the isr3-stats ones. */
+void isr3_perf_dump(FILE* fd);
+void isr3_perf_dump_query(FILE* fd, unsigned long query_id, struct isr3_perf_sample* sample);
+
+#endif
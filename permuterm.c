@@ -1,364 +1,759 @@
 #include "permuterm.h"
+#include "mem.h"
+#include "stats.h"
+#include "sort.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define ISR3_PERMUTERM_SCRATCH 512 /* Stack space for decoding a whole leaf, longer keys fall back to malloc(). */
+#define ISR3_PERMUTERM_PACKED_ALIGN 32 /* Leaf buffers grow in steps of this many bytes, so most inserts fit in place. */
+
+/* Decodes the keys of one node in order, see isr3_permuterm_node_key(). */
+struct isr3_permuterm_cursor {
+	struct isr3_permuterm_index* ptr;
+	struct isr3_permuterm_node* node;
+	const unsigned char* next;
+	int index; // The key in `view`, -1 before the first one.
+	struct isr3_permuterm_key view;
+};
+
+/* The bottom-up layout of one level of a bulk loaded tree: every node holds `size` keys, the first `extra` nodes one more. */
+struct isr3_permuterm_level {
+	uint32_t num_nodes, size, extra;
+};
+
+/* Shared by the threads building the leaves of a bulk loaded tree. */
+struct isr3_permuterm_build {
+	struct isr3_permuterm_index* ptr;
+	struct isr3_sort_item* items; // Every key, in order.
+	uint32_t first_key, first_leaf; // The handles of the first key and leaf, the others follow in order.
+	struct isr3_permuterm_level leaves;
+	uint32_t next; // The first leaf nobody took yet.
+};
+
+static int isr3_permuterm_node_search(struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+
+static void isr3_permuterm_index_insert_key(struct isr3_permuterm_index* ptr, uint32_t key);
+static void isr3_permuterm_level_init(struct isr3_permuterm_level* level, uint32_t num_keys);
+static uint32_t isr3_permuterm_level_start(struct isr3_permuterm_level* level, uint32_t node); /* The position of the node's first key within the level. */
+static int isr3_permuterm_level_keys(struct isr3_permuterm_level* level, uint32_t node);
+static void* isr3_permuterm_build_worker(void* arg);
+static void isr3_permuterm_build_leaves(struct isr3_permuterm_build* build, uint32_t first, uint32_t last);
+static void isr3_permuterm_index_publish(struct isr3_permuterm_index* ptr, uint32_t root);
+static uint32_t isr3_permuterm_node_create(struct isr3_permuterm_index* ptr, int is_leaf);
+static struct isr3_permuterm_node* isr3_permuterm_node_at(struct isr3_permuterm_index* ptr, uint32_t node);
+static struct isr3_permuterm_key* isr3_permuterm_key_at(struct isr3_permuterm_index* ptr, uint32_t key);
+static void isr3_permuterm_key_merge(struct isr3_permuterm_index* ptr, uint32_t existing, uint32_t key);
+static void isr3_permuterm_key_visit(struct isr3_permuterm_index* ptr, struct isr3_permuterm_key* key, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+static int isr3_permuterm_node_is_full(struct isr3_permuterm_node* node);
+static void isr3_permuterm_node_free(struct isr3_permuterm_index* ptr, uint32_t node);
+static void isr3_permuterm_node_release(struct isr3_permuterm_index* ptr, uint32_t node);
+static int isr3_permuterm_node_shape(struct isr3_permuterm_index* ptr, uint32_t node, unsigned long* nodes, unsigned long* keys);
+
+static uint32_t isr3_permuterm_node_copy(struct isr3_permuterm_index* ptr, uint32_t node);
+static void isr3_permuterm_node_insert_key(struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, int index, uint32_t key, uint32_t right);
+static uint32_t isr3_permuterm_node_split(struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, uint32_t* median);
+static void isr3_permuterm_index_retire(struct isr3_permuterm_index* ptr, uint32_t node, unsigned long epoch);
+static void isr3_permuterm_index_reclaim(struct isr3_permuterm_index* ptr);
+static void isr3_permuterm_cursor_init(struct isr3_permuterm_cursor* cursor, struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, char* buffer);
+static struct isr3_permuterm_key* isr3_permuterm_node_key(struct isr3_permuterm_cursor* cursor, int index);
+static char* isr3_permuterm_leaf_decode(struct isr3_permuterm_node* node, char** keys, int* key_lens, char* buffer);
+static void isr3_permuterm_leaf_encode(struct isr3_permuterm_node* node, char** keys, int* key_lens);
+static void isr3_permuterm_leaf_insert(struct isr3_permuterm_node* node, int index, char* key, int key_len);
+static void isr3_permuterm_leaf_reserve(struct isr3_permuterm_node* node, int size);
+static int isr3_permuterm_common_prefix(const char* a, int a_len, const char* b, int b_len);
+static int isr3_permuterm_varint_put(unsigned char* output, unsigned int value);
+static unsigned int isr3_permuterm_varint_get(const unsigned char** input);
+static int isr3_permuterm_epoch_enter(struct isr3_permuterm_index* ptr);
+static void isr3_permuterm_epoch_exit(struct isr3_permuterm_index* ptr, int slot);
+
+struct isr3_permuterm_index* isr3_permuterm_index_create(struct isr3_vocab* vocab) {
+	struct isr3_permuterm_index* output = malloc(sizeof *output);
+
+	if (!output) {
+		return NULL;
+	}
 
-static int cmp_permuterm_node(char* query, int query_len, struct isr3_permuterm_key* key);
-static int cmp_permuterm_prefix(char* query, int query_len, struct isr3_permuterm_key* key);
-static int isr3_permuterm_node_search(struct isr3_permuterm_node* node, char* query, int query_len, int search_id, void (*callback)(struct isr3_word_entry* value, int search_id));
+	memset(output, 0, sizeof *output);
+	output->vocab = vocab;
 
-static void isr3_permuterm_node_insert_root(struct isr3_permuterm_node** root, struct isr3_permuterm_key* value);
-static int isr3_permuterm_node_insert_mid(struct isr3_permuterm_node* parent, int index, struct isr3_permuterm_key* value);
-static int isr3_permuterm_node_insert_leaf(struct isr3_permuterm_node* parent, int index, struct isr3_permuterm_key* value);
-static int isr3_permuterm_node_is_full(struct isr3_permuterm_node* node);
+	isr3_pool_init(&output->nodes, sizeof(struct isr3_permuterm_node), ISR3_MEM_PERMUTERM_NODE);
+	isr3_pool_init(&output->keys, sizeof(struct isr3_permuterm_key), ISR3_MEM_PERMUTERM_KEY);
 
-struct isr3_permuterm_index* isr3_permuterm_index_create(void) {
-	struct isr3_permuterm_index* output = malloc(sizeof *output);
+	return output;
+}
+
+struct isr3_permuterm_index* isr3_permuterm_index_create_concurrent(struct isr3_vocab* vocab) {
+	struct isr3_permuterm_index* output = isr3_permuterm_index_create(vocab);
 
 	if (!output) {
 		return NULL;
 	}
 
-	output->root = NULL;
+	output->concurrent = 1;
+	output->epoch = 1; /* Epoch 0 marks a free reader slot. */
+
 	return output;
 }
 
 void isr3_permuterm_index_free(struct isr3_permuterm_index* ptr) {
-	/* TODO: recursively free tree */
+	/* No readers may be left at this point, so every retired node can go. */
+	for (int i = 0; i < ptr->num_retired; ++i) {
+		isr3_permuterm_node_release(ptr, ptr->retired[i].node);
+	}
+
+	isr3_permuterm_node_free(ptr, ptr->root);
+
+	/* The pools hand back every node and key at once. */
+	isr3_pool_destroy(&ptr->nodes);
+	isr3_pool_destroy(&ptr->keys);
 
+	free(ptr->retired);
 	free(ptr);
 }
 
-void isr3_permuterm_index_insert(struct isr3_permuterm_index* ptr, char* key, int key_len, struct isr3_word_entry* value) {
-	struct isr3_permuterm_key* new_key = malloc(sizeof *new_key);
+void isr3_permuterm_node_free(struct isr3_permuterm_index* ptr, uint32_t handle) {
+	/* Keys are owned by the tree, but the words they point to belong to the vocabulary. */
 
-	if (!new_key) {
-		isr3_err("malloc failed with new btree node\n");
-		exit(1);
+	if (!handle) {
+		return;
 	}
 
-	new_key->key = malloc(key_len);
+	struct isr3_permuterm_node* node = isr3_permuterm_node_at(ptr, handle);
 
-	if (!new_key->key) {
-		isr3_err("malloc failed with new btree key\n");
-		exit(1);
+	for (int i = 0; i < node->num_keys; ++i) {
+		struct isr3_permuterm_key* key = isr3_permuterm_key_at(ptr, node->keys[i]);
+		struct isr3_permuterm_value* cur = key->more_values, *tmp = NULL;
+
+		while (cur) {
+			tmp = cur->next;
+			isr3_mem_free(ISR3_MEM_PERMUTERM_VALUE, cur, sizeof *cur, 1);
+			cur = tmp;
+		}
+
+		isr3_mem_free(ISR3_MEM_KEY_BYTES, key->key, key->key_len, 1);
+	}
+
+	if (!node->is_leaf) {
+		for (int i = 0; i <= node->num_keys; ++i) {
+			isr3_permuterm_node_free(ptr, node->children[i]);
+		}
 	}
 
-	memcpy(new_key->key, key, key_len);
+	isr3_mem_free(ISR3_MEM_KEY_BYTES, node->packed, node->packed_size, 1);
+}
+
+void isr3_permuterm_node_release(struct isr3_permuterm_index* ptr, uint32_t handle) {
+	/* Only the node itself: its keys may still be shared with a copy of it. */
+	struct isr3_permuterm_node* node = isr3_permuterm_node_at(ptr, handle);
 
+	isr3_mem_free(ISR3_MEM_KEY_BYTES, node->packed, node->packed_size, 1);
+	isr3_pool_free(&ptr->nodes, handle);
+}
+
+struct isr3_permuterm_node* isr3_permuterm_node_at(struct isr3_permuterm_index* ptr, uint32_t node) {
+	return isr3_pool_get(&ptr->nodes, node);
+}
+
+struct isr3_permuterm_key* isr3_permuterm_key_at(struct isr3_permuterm_index* ptr, uint32_t key) {
+	return isr3_pool_get(&ptr->keys, key);
+}
+
+void isr3_permuterm_index_insert(struct isr3_permuterm_index* ptr, char* key, int key_len, uint32_t value) {
+	uint32_t handle = isr3_pool_alloc(&ptr->keys);
+	struct isr3_permuterm_key* new_key = isr3_permuterm_key_at(ptr, handle);
+
+	/* New keys always end up in a leaf, which copies the bytes into its own buffer, so the caller's bytes are only borrowed. */
+	new_key->key = key;
 	new_key->key_len = key_len;
 	new_key->value = value;
+	new_key->more_values = NULL;
+
+	isr3_debugf("inserting node with key [%.*s], word %u\n", key_len, key, value);
 
-	isr3_debugf("inserting node with key [%.*s], value %p (%.*s)\n", key_len, key, (void*) value, value->word_len, value->word);
-	isr3_permuterm_node_insert_root(&ptr->root, new_key);
+	isr3_permuterm_index_insert_key(ptr, handle);
 }
 
-void isr3_permuterm_node_insert_root(struct isr3_permuterm_node** root, struct isr3_permuterm_key* key) {
-	if (!*root) {
-		*root = malloc(sizeof **root);
-		(*root)->is_leaf = 1;
-		(*root)->num_keys = 1;
-		(*root)->keys[0] = key;
+void isr3_permuterm_index_insert_key(struct isr3_permuterm_index* ptr, uint32_t key) {
+	/*
+	 * Single-pass top-down insert: every full node on the way down is split before we descend into it, so the leaf always
+	 * has room and a split never has to propagate back up.
+	 *
+	 * Concurrent indexes copy every node on the path before touching it and only publish the copied path once the insert
+	 * is complete. The replaced nodes are retired and freed later by isr3_permuterm_index_reclaim().
+	 */
+	unsigned long epoch = __atomic_load_n(&ptr->epoch, __ATOMIC_SEQ_CST);
+	uint32_t root = ptr->root, median = 0;
+	struct isr3_permuterm_node* cur = NULL;
+	struct isr3_permuterm_key* new_key = isr3_permuterm_key_at(ptr, key);
 
+	if (!root) {
+		root = isr3_permuterm_node_create(ptr, 1);
+		isr3_permuterm_node_insert_key(ptr, isr3_permuterm_node_at(ptr, root), 0, key, 0);
+
+		isr3_permuterm_index_publish(ptr, root);
 		return;
 	}
 
-	if ((*root)->is_leaf) {
-		int full = isr3_permuterm_node_is_full(*root), i, result;
-		/* This is a leaf node, we insert the key where it belongs while pushing the other elements to the side. */
-		i = (*root)->num_keys - 1;
-
-		/* We add another slot to cycle the keys. */
-		(*root)->num_keys++;
+	if (ptr->concurrent) {
+		isr3_permuterm_index_retire(ptr, root, epoch);
+		root = isr3_permuterm_node_copy(ptr, root);
+	}
 
-		while (1) {
-			if (i < 0) {
-				/* i has crossed into OOB space, and the whole array has shifted -- insert at i + 1. */
-				break;
-			}
+	if (isr3_permuterm_node_is_full(isr3_permuterm_node_at(ptr, root))) {
+		/* The only way the tree grows taller: the full root is split under a new root. */
+		uint32_t new_root = isr3_permuterm_node_create(ptr, 0), right = isr3_permuterm_node_split(ptr, isr3_permuterm_node_at(ptr, root), &median);
+		struct isr3_permuterm_node* node = isr3_permuterm_node_at(ptr, new_root);
 
-			result = cmp_permuterm_node(key->key, key->key_len, (*root)->keys[i]);
+		node->children[0] = root;
+		node->children[1] = right;
+		node->keys[0] = median;
+		node->num_keys = 1;
 
-			if (result > 0) {
-				/* The node in the key list is no longer greater than the passed key param. The correct location to insert the key is now i + 1. */
-				break;
-			}
+		isr3_debug("split root\n");
+		root = new_root;
+	}
 
-			if (!result) {
-				/* -- debug : notify repeated keys -- */
-				isr3_debugf("REPEATED KEY %.*s\n", key->key_len, key->key);
-				exit(1);
-			}
+	cur = isr3_permuterm_node_at(ptr, root);
 
-			(*root)->keys[i + 1] = (*root)->keys[i];
-			i--;
-		}
+	while (1) {
+		int i, result = 1;
+		char buffer[cur->max_key_len + 1];
+		struct isr3_permuterm_cursor cursor;
 
-		(*root)->keys[i + 1] = key;
+		isr3_permuterm_cursor_init(&cursor, ptr, cur, buffer);
 
-		if (full) {
-			/* root was full and now has to split */
+		for (i = 0; i < cur->num_keys; ++i) {
+			result = cmp_permuterm_node(new_key->key, new_key->key_len, isr3_permuterm_node_key(&cursor, i));
 
-			struct isr3_permuterm_node* new_root = malloc(sizeof *new_root), *right_split = malloc(sizeof *right_split), *left_split = *root;
+			if (result <= 0) {
+				break;
+			}
+		}
 
-			new_root->is_leaf = 0;
-			new_root->num_keys = 1;
-			new_root->keys[0] = left_split->keys[(BTREE_DEGREE - 1) / 2]; /* Median value at pos 5 if key limit is 8. */
-			new_root->children[0] = left_split;
-			new_root->children[1] = right_split;
+		isr3_stats_add(insert_comparisons, i + (i < cur->num_keys));
 
-			/* Left split is still filled with all of the old data. */
-			right_split->is_leaf = 1;
-			right_split->num_keys = (BTREE_DEGREE - 1) / 2;
+		if (!result) {
+			/* Repeated key: merge the value into the key we already have. Any splits on the way down are still valid. */
+			isr3_permuterm_key_merge(ptr, cur->keys[i], key);
+			break;
+		}
 
-			for (int j = 0; j < (BTREE_DEGREE - 1) / 2; ++j) {
-				right_split->keys[j] = left_split->keys[j + 1 + (BTREE_DEGREE - 1) / 2]; /* We have to add two to skip the median. */
-			}
+		if (cur->is_leaf) {
+			isr3_permuterm_node_insert_key(ptr, cur, i, key, 0);
+			break;
+		}
 
-			left_split->num_keys = (BTREE_DEGREE - 1) / 2;
+		uint32_t child = cur->children[i];
 
-			*root = new_root;
+		if (ptr->concurrent) {
+			isr3_permuterm_index_retire(ptr, child, epoch);
+			child = cur->children[i] = isr3_permuterm_node_copy(ptr, child);
 		}
-	} else {
-		int i, result;
 
-		for (i = 0; i < (*root)->num_keys; ++i) {
-			result = cmp_permuterm_node(key->key, key->key_len, (*root)->keys[i]);
+		if (isr3_permuterm_node_is_full(isr3_permuterm_node_at(ptr, child))) {
+			/* Split the child before descending. The median moves up into `cur`, which we know has room. */
+			uint32_t right = isr3_permuterm_node_split(ptr, isr3_permuterm_node_at(ptr, child), &median);
+			isr3_permuterm_node_insert_key(ptr, cur, i, median, right);
 
-			if (result <= 0) {
+			isr3_debugf("split child %d\n", i);
+
+			/* Our key may belong in the right half now. */
+			result = cmp_permuterm_node(new_key->key, new_key->key_len, isr3_permuterm_key_at(ptr, median));
+			isr3_stats_add(insert_comparisons, 1);
+
+			if (!result) {
+				isr3_permuterm_key_merge(ptr, median, key);
 				break;
 			}
+
+			if (result > 0) {
+				child = right;
+			}
 		}
 
-		/* Appropriate child is at index i. */
-		result = 0;
+		cur = isr3_permuterm_node_at(ptr, child);
+	}
 
-		if ((*root)->children[i]->is_leaf) {
-			result = isr3_permuterm_node_insert_leaf(*root, i, key);
+	isr3_permuterm_index_publish(ptr, root);
+}
 
-			if (result) {
-				/* the child leaf was full and after splitting, we are also full. perform a root split. */
-				isr3_debug("split root (leaf child overflow)\n");
-			}
-		} else {
-			result = isr3_permuterm_node_insert_mid(*root, i, key);
+void isr3_permuterm_index_build(struct isr3_permuterm_index* ptr) {
+	/*
+	 * Vocabulary words are distinct and every rotation keeps the '$' where its word ended, so no two rotations are the same
+	 * key: sorted, they are exactly the keys of the tree in order.
+	 *
+	 * The rotations of word$ are the substrings of word$word$, so each word is written out twice and the sort items point
+	 * into that instead of copying every rotation. isr3_sort_items() buckets them by their first character and sorts the
+	 * buckets on its own threads, in the same unsigned bytewise order as cmp_permuterm_node().
+	 *
+	 * The sorted keys are then cut into leaves and inner levels (see isr3_permuterm_level_init()), so the place of every
+	 * key and leaf is known before any of them is built. Their handles are reserved as two consecutive ranges and the
+	 * leaves are built by a pool of threads, ISR3_PERMUTERM_BUILD_LEAVES at a time. The inner levels, about one node in
+	 * nine, are stitched on top of them on the calling thread.
+	 */
+	unsigned long start = isr3_stats_now();
+	struct isr3_vocab* vocab = ptr->vocab;
+	size_t num_keys = 0;
 
-			if (result) {
-				/* something down the line overflowed and we are also full. perform a root split. */
-				isr3_debug("split root (mid child overflow)\n");
-			}
-		}
+	for (uint32_t word = 0; word < vocab->num_words; ++word) {
+		int word_len;
+
+		isr3_vocab_word(vocab, word, &word_len);
+		num_keys += word_len + 1;
+	}
 
-		if (result) {
-			/* a root split is required, except we also have to copy children in the node to the right split */
-			struct isr3_permuterm_node* new_root = malloc(sizeof *new_root), *right_split = malloc(sizeof *right_split), *left_split = *root;
+	if (!num_keys) {
+		return;
+	}
 
-			new_root->is_leaf = 0;
-			new_root->num_keys = 1;
-			new_root->keys[0] = left_split->keys[(BTREE_DEGREE - 1) / 2]; /* Median value at pos 5 if key limit is 8. */
-			new_root->children[0] = left_split;
-			new_root->children[1] = right_split;
+	if (num_keys >= UINT32_MAX) {
+		isr3_err("too many permuterm keys\n");
+		exit(1);
+	}
 
-			/* Left split is still filled with all of the old data. */
-			right_split->is_leaf = 0;
-			right_split->num_keys = (BTREE_DEGREE - 1) / 2;
+	char* doubled = malloc(num_keys * 2), *cur = doubled;
+	struct isr3_sort_item* items = malloc(sizeof *items * num_keys), *item = items;
 
-			right_split->children[0] = left_split->children[(BTREE_DEGREE - 1) / 2 + 1]; /* The loop doesn't get to the first child of right_split, so we assign it the child to the right of the median */
+	if (!doubled || !items) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
 
-			for (int j = 0; j < (BTREE_DEGREE - 1) / 2; ++j) {
-				right_split->keys[j] = left_split->keys[j + 1 + (BTREE_DEGREE - 1) / 2]; /* We have to add two to skip the median. */
-				right_split->children[j + 1] = left_split->children[j + 2 + (BTREE_DEGREE - 1) / 2]; /* We add two to skip the median and to query the right child. */
-			}
+	for (uint32_t word = 0; word < vocab->num_words; ++word) {
+		int word_len;
+		char* word_buf = isr3_vocab_word(vocab, word, &word_len);
 
-			left_split->num_keys = (BTREE_DEGREE - 1) / 2;
+		memcpy(cur, word_buf, word_len);
+		cur[word_len] = '$';
+		memcpy(cur + word_len + 1, cur, word_len + 1);
 
-			*root = new_root;
+		for (int i = 0; i <= word_len; ++i, ++item) {
+			item->str = cur + i;
+			item->len = word_len + 1;
+			item->id = word;
 		}
+
+		cur += 2 * (word_len + 1);
 	}
-}
 
-int isr3_permuterm_node_insert_mid(struct isr3_permuterm_node* parent, int index, struct isr3_permuterm_key* key) {
-	struct isr3_permuterm_node* node = parent->children[index], *app_child;
-	int i, result, parent_full = isr3_permuterm_node_is_full(parent);
+	isr3_sort_items(items, num_keys);
 
-	for (i = 0; i < node->num_keys; ++i) {
-		result = cmp_permuterm_node(key->key, key->key_len, node->keys[i]);
+	isr3_stats_phase_end(ISR3_PHASE_PERMUTERM, start);
+	start = isr3_stats_now();
 
-		if (result <= 0) {
-			break;
+	struct isr3_permuterm_build build = {ptr, items, 0, 0, {0, 0, 0}, 0};
+
+	isr3_permuterm_level_init(&build.leaves, num_keys);
+	build.first_key = isr3_pool_alloc_range(&ptr->keys, num_keys);
+	build.first_leaf = isr3_pool_alloc_range(&ptr->nodes, build.leaves.num_nodes);
+
+	long num_threads = num_keys >= ISR3_PERMUTERM_BUILD_PARALLEL_MIN ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	pthread_t* threads = num_threads > 1 ? malloc(sizeof *threads * num_threads) : NULL;
+	int started = 0;
+
+	for (long i = 1; threads && i < num_threads; ++i) {
+		if (!pthread_create(threads + started, NULL, isr3_permuterm_build_worker, &build)) {
+			++started;
 		}
 	}
 
-	/* -- debug : notify repeated keys -- */
-	if (!result) {
-		isr3_errf("REPEATED KEY %.*s\n", key->key_len, key->key);
+	isr3_debugf("building %zu keys into %u leaves with %d extra threads\n", num_keys, build.leaves.num_nodes, started);
+	isr3_permuterm_build_worker(&build); /* The calling thread helps out too. */
+
+	for (int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+
+	/* `seq` holds the keys which moved up out of the level below (the last entry is unused) and `nodes` its nodes. */
+	uint32_t num_nodes = build.leaves.num_nodes;
+	uint32_t* seq = malloc(sizeof *seq * num_nodes), *nodes = malloc(sizeof *nodes * num_nodes);
+
+	if (!seq || !nodes) {
+		isr3_err("malloc failure\n");
 		exit(1);
 	}
 
-	/* Appropriate child is at index i */
-	app_child = node->children[i];
+	for (uint32_t i = 0; i < num_nodes; ++i) {
+		seq[i] = build.first_key + isr3_permuterm_level_start(&build.leaves, i) + isr3_permuterm_level_keys(&build.leaves, i);
+		nodes[i] = build.first_leaf + i;
+	}
+
+	while (num_nodes > 1) {
+		struct isr3_permuterm_level level;
 
-	if (app_child->is_leaf) {
-		result = isr3_permuterm_node_insert_leaf(node, i, key);
+		isr3_permuterm_level_init(&level, num_nodes - 1);
 
-		if (result) {
-			/* Inserting into the leaf has caused us to overflow. Split! */
-			isr3_debug("split mid\n");
+		/* Node j only reads entries at or after j, so the level above is written over this one. */
+		for (uint32_t j = 0; j < level.num_nodes; ++j) {
+			uint32_t first = isr3_permuterm_level_start(&level, j), handle = isr3_permuterm_node_create(ptr, 0);
+			struct isr3_permuterm_node* node = isr3_permuterm_node_at(ptr, handle);
 
-			/* if the parent was full before the split, parent has overflowed. */
-			if (parent_full) {
-				isr3_debug("mid parent overflow\n");
+			node->num_keys = isr3_permuterm_level_keys(&level, j);
+
+			for (int i = 0; i < node->num_keys; ++i) {
+				node->keys[i] = seq[first + i];
+				node->children[i] = nodes[first + i];
 			}
-		} else {
-			/* We did not overflow from the insert -- our parent will not overflow. */
-			return 0;
+
+			node->children[node->num_keys] = nodes[first + node->num_keys];
+
+			seq[j] = seq[first + node->num_keys];
+			nodes[j] = handle;
 		}
-	} else {
-		result = isr3_permuterm_node_insert_mid(node, i, key);
 
-		if (result) {
-			/* Something down the line caused us to overflow. Split! */
-			isr3_debug("split mid\n");
+		num_nodes = level.num_nodes;
+	}
+
+	isr3_permuterm_index_publish(ptr, nodes[0]);
 
-			/* if the parent was full before the split, parent has overflowed. */
-			if (parent_full) {
-				isr3_debug("mid parent overflow\n");
+	free(seq);
+	free(nodes);
+	free(items);
+	free(doubled);
+
+	isr3_stats_phase_end(ISR3_PHASE_BTREE, start);
+}
+
+void isr3_permuterm_level_init(struct isr3_permuterm_level* level, uint32_t num_keys) {
+	/*
+	 * Cuts `num_keys` keys (in order) into as few nodes of at most BTREE_NUM_KEYS keys as there can be, with one key between
+	 * each pair of nodes moving up to the level above. The nodes are filled evenly, so each is at least half full unless there is only one.
+	 */
+	level->num_nodes = num_keys / BTREE_NUM_CHILDREN + 1;
+	level->size = (num_keys - (level->num_nodes - 1)) / level->num_nodes;
+	level->extra = (num_keys - (level->num_nodes - 1)) % level->num_nodes;
+}
+
+uint32_t isr3_permuterm_level_start(struct isr3_permuterm_level* level, uint32_t node) {
+	/* Each node before this one, and the key after it. */
+	return node * (level->size + 1) + (node < level->extra ? node : level->extra);
+}
+
+int isr3_permuterm_level_keys(struct isr3_permuterm_level* level, uint32_t node) {
+	return level->size + (node < level->extra);
+}
+
+void* isr3_permuterm_build_worker(void* arg) {
+	struct isr3_permuterm_build* build = arg;
+	uint32_t first;
+
+	while ((first = __atomic_fetch_add(&build->next, ISR3_PERMUTERM_BUILD_LEAVES, __ATOMIC_RELAXED)) < build->leaves.num_nodes) {
+		uint32_t last = build->leaves.num_nodes - first < ISR3_PERMUTERM_BUILD_LEAVES ? build->leaves.num_nodes : first + ISR3_PERMUTERM_BUILD_LEAVES;
+
+		isr3_permuterm_build_leaves(build, first, last);
+	}
+
+	return NULL;
+}
+
+void isr3_permuterm_build_leaves(struct isr3_permuterm_build* build, uint32_t first, uint32_t last) {
+	/* Every leaf owns its keys and the key which moves up after it, so no two threads touch the same node or key. */
+	char* keys[BTREE_NUM_KEYS];
+	int key_lens[BTREE_NUM_KEYS];
+
+	for (uint32_t leaf = first; leaf < last; ++leaf) {
+		uint32_t start = isr3_permuterm_level_start(&build->leaves, leaf);
+		int num_keys = isr3_permuterm_level_keys(&build->leaves, leaf), moves_up = leaf + 1 < build->leaves.num_nodes;
+		struct isr3_permuterm_node* node = isr3_permuterm_node_at(build->ptr, build->first_leaf + leaf);
+
+		node->is_leaf = 1;
+		node->num_keys = num_keys;
+		node->packed = NULL;
+		node->packed_len = node->packed_size = node->max_key_len = 0;
+
+		for (int i = 0; i < num_keys + moves_up; ++i) {
+			struct isr3_sort_item* item = build->items + start + i;
+			struct isr3_permuterm_key* key = isr3_permuterm_key_at(build->ptr, build->first_key + start + i);
+
+			key->key = NULL;
+			key->key_len = item->len;
+			key->value = item->id;
+			key->more_values = NULL;
+
+			if (i < num_keys) {
+				node->keys[i] = build->first_key + start + i;
+				keys[i] = (char*) item->str;
+				key_lens[i] = item->len;
+			} else {
+				/* The key after the leaf goes into an inner node, which stores its keys whole. */
+				if (!(key->key = isr3_mem_alloc(ISR3_MEM_KEY_BYTES, item->len, 1))) {
+					isr3_err("malloc failed with new btree key\n");
+					exit(1);
+				}
+
+				memcpy(key->key, item->str, item->len);
 			}
-		} else {
-			/* We did not overflow from the insert -- our parent will not overflow. */
-			return 0;
 		}
+
+		isr3_permuterm_leaf_encode(node, keys, key_lens);
 	}
+}
 
-	if (result) {
-		/* We will be splitting! We must do everything a root-mid split does, except we also have to ensure correct placement in the parent. */
-		struct isr3_permuterm_node* right_split = malloc(sizeof *right_split), *left_split = node;
+void isr3_permuterm_index_publish(struct isr3_permuterm_index* ptr, uint32_t root) {
+	if (!ptr->concurrent) {
+		ptr->root = root;
+		return;
+	}
 
-		/* We'll steal some code from leaf and root. */
-		int j = parent->num_keys;
-		parent->num_keys++;
+	/* Readers which already loaded the old root keep walking the old (unchanged) nodes. */
+	__atomic_store_n(&ptr->root, root, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ptr->epoch, 1, __ATOMIC_SEQ_CST);
 
-		/* in the parent, we need to perform something similar to a leaf shift, although we also need to shift children. */
-		while (j > index) {
-			parent->keys[j] = parent->keys[j - 1];
-			parent->children[j + 1] = parent->children[j]; /* i may have gotten this wrong TODO */
-			j--;
-		}
+	if (ptr->num_retired >= ISR3_EPOCH_SLOTS) {
+		isr3_permuterm_index_reclaim(ptr);
+	}
+}
+
+void isr3_permuterm_key_merge(struct isr3_permuterm_index* ptr, uint32_t existing_handle, uint32_t handle) {
+	/* `key` is never linked into the tree, so it is freed here. The merged value may be seen by concurrent readers. */
+	struct isr3_permuterm_key* existing = isr3_permuterm_key_at(ptr, existing_handle), *key = isr3_permuterm_key_at(ptr, handle);
+	struct isr3_permuterm_value* cur = existing->more_values;
+	int located = existing->value == key->value;
 
-		parent->keys[index] = left_split->keys[(BTREE_DEGREE - 1) / 2];
-		parent->children[index + 1] = right_split;
+	isr3_debugf("merging repeated key [%.*s]\n", key->key_len, key->key);
 
-		/* Left split is still filled with all of the old data. */
-		right_split->is_leaf = 0;
-		right_split->num_keys = (BTREE_DEGREE - 1) / 2;
+	while (cur && !located) {
+		located = cur->value == key->value;
+		cur = cur->next;
+	}
 
-		right_split->children[0] = left_split->children[(BTREE_DEGREE - 1) / 2 + 1]; /* The loop doesn't get to the first child of right_split, so we assign it the child to the right of the median */
+	if (!located) {
+		struct isr3_permuterm_value* new_value = isr3_mem_alloc(ISR3_MEM_PERMUTERM_VALUE, sizeof *new_value, 1);
 
-		for (int j = 0; j < (BTREE_DEGREE - 1) / 2; ++j) {
-			right_split->keys[j] = left_split->keys[j + 1 + (BTREE_DEGREE - 1) / 2]; /* We have to add two to skip the median. */
-			right_split->children[j + 1] = left_split->children[j + 2 + (BTREE_DEGREE - 1) / 2]; /* We add two to skip the median and to query the right child. */
+		if (!new_value) {
+			isr3_err("malloc failed with new btree value\n");
+			exit(1);
 		}
 
-		left_split->num_keys = (BTREE_DEGREE - 1) / 2;
+		new_value->value = key->value;
+		new_value->next = existing->more_values;
+
+		__atomic_store_n(&existing->more_values, new_value, __ATOMIC_RELEASE);
 	}
 
-	/* if the parent was full before the split, parent has overflowed. */
-	if (parent_full) {
-		isr3_debug("mid parent overflow\n");
+	isr3_pool_free(&ptr->keys, handle);
+}
+
+void isr3_permuterm_key_visit(struct isr3_permuterm_index* ptr, struct isr3_permuterm_key* key, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	unsigned long count = 1;
+
+	callback(ptr->vocab, key->value, search_id);
+
+	for (struct isr3_permuterm_value* cur = __atomic_load_n(&key->more_values, __ATOMIC_ACQUIRE); cur; cur = cur->next, ++count) {
+		callback(ptr->vocab, cur->value, search_id);
 	}
 
-	return parent_full;
+	isr3_stats_add(callbacks, count);
 }
 
-int isr3_permuterm_node_insert_leaf(struct isr3_permuterm_node* parent, int index, struct isr3_permuterm_key* key) {
-	struct isr3_permuterm_node* node = parent->children[index];
-	int i, full = isr3_permuterm_node_is_full(node), parent_full = isr3_permuterm_node_is_full(parent), result;
+uint32_t isr3_permuterm_node_create(struct isr3_permuterm_index* ptr, int is_leaf) {
+	uint32_t handle = isr3_pool_alloc(&ptr->nodes);
+	struct isr3_permuterm_node* output = isr3_permuterm_node_at(ptr, handle);
 
-	/* This is a leaf node, we insert the key where it belongs while pushing the other elements to the side. */
-	i = node->num_keys - 1;
+	output->is_leaf = is_leaf;
+	output->num_keys = 0;
+	output->packed = NULL;
+	output->packed_len = output->packed_size = output->max_key_len = 0;
 
-	/* We add another slot to cycle the keys. */
-	node->num_keys++;
+	return handle;
+}
 
-	while (1) {
-		if (i < 0) {
-			/* i has crossed into OOB space, and the whole array has shifted -- insert at i + 1. */
-			break;
+uint32_t isr3_permuterm_node_copy(struct isr3_permuterm_index* ptr, uint32_t original) {
+	uint32_t handle = isr3_pool_alloc(&ptr->nodes);
+	struct isr3_permuterm_node* output = isr3_permuterm_node_at(ptr, handle), *node = isr3_permuterm_node_at(ptr, original);
+
+	memcpy(output, node, sizeof *output);
+
+	/* Every node owns its leaf buffer, the original may still be read (or retired and freed). */
+	if (node->packed) {
+		if (!(output->packed = isr3_mem_alloc(ISR3_MEM_KEY_BYTES, node->packed_size, 1))) {
+			isr3_err("malloc failed with new btree node\n");
+			exit(1);
 		}
 
-		result = cmp_permuterm_node(key->key, key->key_len, node->keys[i]);
+		memcpy(output->packed, node->packed, node->packed_len);
+	}
 
-		if (result > 0) {
-			/* The node in the key list is no longer greater than the passed key param. The correct location to insert the key is now i + 1. */
-			break;
+	return handle;
+}
+
+void isr3_permuterm_node_insert_key(struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, int index, uint32_t key, uint32_t right) {
+	if (node->is_leaf) {
+		/* The leaf takes over the key's bytes, front-coded. */
+		struct isr3_permuterm_key* leaf_key = isr3_permuterm_key_at(ptr, key);
+
+		isr3_permuterm_leaf_insert(node, index, leaf_key->key, leaf_key->key_len);
+		leaf_key->key = NULL;
+	}
+
+	/* Shift the keys (and the children right of them) over by one, then place the key and its right child. */
+	for (int j = node->num_keys; j > index; --j) {
+		node->keys[j] = node->keys[j - 1];
+
+		if (!node->is_leaf) {
+			node->children[j + 1] = node->children[j];
 		}
+	}
 
-		if (!result) {
-			/* -- debug : notify repeated keys -- */
-			isr3_errf("REPEATED KEY %.*s\n", key->key_len, key->key);
+	node->keys[index] = key;
+
+	if (!node->is_leaf) {
+		node->children[index + 1] = right;
+	}
+
+	node->num_keys++;
+}
+
+uint32_t isr3_permuterm_node_split(struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, uint32_t* median) {
+	/* `node` keeps the left half, the median moves up and the right half goes into a new node. */
+	uint32_t handle = isr3_permuterm_node_create(ptr, node->is_leaf);
+	struct isr3_permuterm_node* right = isr3_permuterm_node_at(ptr, handle);
+	int mid = node->num_keys / 2;
+	char* keys[BTREE_NUM_KEYS], buffer[ISR3_PERMUTERM_SCRATCH], *scratch = NULL;
+	int key_lens[BTREE_NUM_KEYS];
+
+	if (node->is_leaf) {
+		scratch = isr3_permuterm_leaf_decode(node, keys, key_lens, buffer);
+
+		/* The median moves up into an inner node, which stores its keys whole. */
+		struct isr3_permuterm_key* key = isr3_permuterm_key_at(ptr, node->keys[mid]);
+
+		if (!(key->key = isr3_mem_alloc(ISR3_MEM_KEY_BYTES, key_lens[mid], 1))) {
+			isr3_err("malloc failed with new btree key\n");
 			exit(1);
 		}
 
-		node->keys[i + 1] = node->keys[i];
-		i--;
+		memcpy(key->key, keys[mid], key_lens[mid]);
 	}
 
-	node->keys[i + 1] = key;
+	right->num_keys = node->num_keys - mid - 1;
+
+	for (int j = 0; j < right->num_keys; ++j) {
+		right->keys[j] = node->keys[mid + 1 + j];
+	}
 
-	/* Now, the key is in the buffer and at the correct location. We still need to check for overflows and split accordingly. */
-	if (full) {
-		/* If the node was full before it has now overflowed. Split! */
+	if (!node->is_leaf) {
+		for (int j = 0; j <= right->num_keys; ++j) {
+			right->children[j] = node->children[mid + 1 + j];
+		}
+	}
 
-		/*
-		 * When a leaf splits, it is a very similar process to a root split -- except it's very important that we know exactly where the new node should go in the parent.
-		 */
+	*median = node->keys[mid];
+	node->num_keys = mid;
 
-		isr3_debugf("splitting leaf node at parent index %d\n", index);
+	if (node->is_leaf) {
+		isr3_permuterm_leaf_encode(right, keys + mid + 1, key_lens + mid + 1);
+		isr3_permuterm_leaf_encode(node, keys, key_lens);
 
-		struct isr3_permuterm_node* right_split = malloc(sizeof *right_split), *left_split = node;
+		if (scratch != buffer) {
+			free(scratch);
+		}
+	}
 
-		int j = parent->num_keys;
-		parent->num_keys++;
+	isr3_stats_add(splits, 1);
 
-		/* in the parent, we need to perform something similar to a leaf shift, although we also need to shift children. */
-		while (j > index) {
-			parent->keys[j] = parent->keys[j - 1];
-			parent->children[j + 1] = parent->children[j]; /* i may have gotten this wrong TODO */
-			j--;
+	return handle;
+}
+
+void isr3_permuterm_index_retire(struct isr3_permuterm_index* ptr, uint32_t node, unsigned long epoch) {
+	if (ptr->num_retired == ptr->max_retired) {
+		ptr->max_retired = ptr->max_retired ? ptr->max_retired * 2 : ISR3_EPOCH_SLOTS;
+		ptr->retired = realloc(ptr->retired, sizeof *ptr->retired * ptr->max_retired);
+
+		if (!ptr->retired) {
+			isr3_err("realloc failed with retired node list\n");
+			exit(1);
 		}
+	}
+
+	ptr->retired[ptr->num_retired].node = node;
+	ptr->retired[ptr->num_retired++].epoch = epoch;
+}
 
-		parent->keys[index] = left_split->keys[(BTREE_DEGREE - 1) / 2];
-		parent->children[index + 1] = right_split;
+void isr3_permuterm_index_reclaim(struct isr3_permuterm_index* ptr) {
+	/* A node retired in epoch E is unreachable for every reader which announced an epoch after E. */
+	unsigned long oldest = (unsigned long) -1;
 
-		/* Left split is still filled with all of the old data. */
-		right_split->is_leaf = 1;
-		right_split->num_keys = (BTREE_DEGREE - 1) / 2;
+	for (int i = 0; i < ISR3_EPOCH_SLOTS; ++i) {
+		unsigned long epoch = __atomic_load_n(&ptr->reader_epochs[i], __ATOMIC_SEQ_CST);
 
-		for (int j = 0; j < (BTREE_DEGREE - 1) / 2; ++j) {
-			right_split->keys[j] = left_split->keys[j + 1 + (BTREE_DEGREE - 1) / 2]; /* We have to add two to skip the median. */
+		if (epoch && epoch < oldest) {
+			oldest = epoch;
 		}
+	}
 
-		left_split->num_keys = (BTREE_DEGREE - 1) / 2;
+	int kept = 0;
 
-		/* If the parent was full before the split, the parent has overflowed. */
-		if (parent_full) {
-			isr3_debug("leaf parent overflow\n");
+	for (int i = 0; i < ptr->num_retired; ++i) {
+		if (ptr->retired[i].epoch < oldest) {
+			isr3_permuterm_node_release(ptr, ptr->retired[i].node);
+		} else {
+			ptr->retired[kept++] = ptr->retired[i];
 		}
+	}
 
-		return parent_full;
+	isr3_debugf("reclaimed %d of %d retired nodes\n", ptr->num_retired - kept, ptr->num_retired);
+	ptr->num_retired = kept;
+}
+
+int isr3_permuterm_epoch_enter(struct isr3_permuterm_index* ptr) {
+	unsigned long epoch = __atomic_load_n(&ptr->epoch, __ATOMIC_SEQ_CST), current;
+	int slot = 0;
+
+	/* Claim a free slot. There are far more slots than query threads, so this practically never loops. */
+	while (1) {
+		unsigned long expected = 0;
+
+		if (__atomic_compare_exchange_n(&ptr->reader_epochs[slot], &expected, epoch, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+
+		slot = (slot + 1) % ISR3_EPOCH_SLOTS;
 	}
 
-	/* The node wasn't full before the insert, it is impossible for an overflow to have occurred. */
+	/* The writer may have moved on between reading the epoch and claiming the slot -- re-announce until we're current. */
+	while ((current = __atomic_load_n(&ptr->epoch, __ATOMIC_SEQ_CST)) != epoch) {
+		__atomic_store_n(&ptr->reader_epochs[slot], current, __ATOMIC_SEQ_CST);
+		epoch = current;
+	}
 
-	return full;
+	return slot;
 }
 
-void isr3_permuterm_index_search(struct isr3_permuterm_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_word_entry* value, int search_id)) {
-	isr3_permuterm_node_search(ptr->root, query, query_len, search_id, callback);
+void isr3_permuterm_epoch_exit(struct isr3_permuterm_index* ptr, int slot) {
+	__atomic_store_n(&ptr->reader_epochs[slot], 0, __ATOMIC_RELEASE);
 }
 
-int isr3_permuterm_node_search(struct isr3_permuterm_node* node, char* query, int query_len, int search_id, void (*callback)(struct isr3_word_entry* value, int search_id)) {
+void isr3_permuterm_index_search(struct isr3_permuterm_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	isr3_stats_add(searches, 1);
+
+	if (!ptr->concurrent) {
+		if (ptr->root) {
+			isr3_permuterm_node_search(ptr, isr3_permuterm_node_at(ptr, ptr->root), query, query_len, search_id, callback);
+		}
+
+		return;
+	}
+
+	/* Concurrent indexes are searched lock-free: announce our epoch and walk whatever root is current. */
+	int slot = isr3_permuterm_epoch_enter(ptr);
+	uint32_t root = __atomic_load_n(&ptr->root, __ATOMIC_SEQ_CST);
+
+	if (root) {
+		isr3_permuterm_node_search(ptr, isr3_permuterm_node_at(ptr, root), query, query_len, search_id, callback);
+	}
+
+	isr3_permuterm_epoch_exit(ptr, slot);
+}
+
+int isr3_permuterm_node_search(struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
 	/* The permuterm search process varies heavily from a normal B-tree search in that we need to be able to find all matching keys (any equal prefixes).
 	 * To do this, we must find the smallest value greater than the prefix. This is somewhat simple.
 	 * After finding this value, we recurse through the lowest tree nodes and keep going "forward" until the prefix no longer matches.
@@ -375,33 +770,41 @@ int isr3_permuterm_node_search(struct isr3_permuterm_node* node, char* query, in
 	 */
 
 	int result, i;
+	char buffer[node->max_key_len + 1];
+	struct isr3_permuterm_cursor cursor;
+
+	isr3_permuterm_cursor_init(&cursor, ptr, node, buffer);
 
 	for (i = 0; i < node->num_keys; ++i) {
-		result = cmp_permuterm_node(query, query_len, node->keys[i]);
+		result = cmp_permuterm_node(query, query_len, isr3_permuterm_node_key(&cursor, i));
 
 		if (result <= 0) {
 			break;
 		}
 	}
 
+	isr3_stats_add(search_comparisons, i + (i < node->num_keys));
+
 	if (result == 1) {
 		/* Nothing found in keys. If we're not a leaf, the target could still be in the last child. Continuity is passed. */
 		if (node->is_leaf) {
 			return 0;
 		} else {
-			return isr3_permuterm_node_search(node->children[i], query, query_len, search_id, callback);
+			return isr3_permuterm_node_search(ptr, isr3_permuterm_node_at(ptr, node->children[i]), query, query_len, search_id, callback);
 		}
 	}
 
 	if (result < 0) {
 		/* We found a node that is greater than the key. The chain could begin in the left leaf (or on this node). */
 		if (!node->is_leaf) {
-			isr3_permuterm_node_search(node->children[i], query, query_len, search_id, callback);
+			isr3_permuterm_node_search(ptr, isr3_permuterm_node_at(ptr, node->children[i]), query, query_len, search_id, callback);
 		}
 
 		/* We don't actually need to consider the result -- we will have to check ourselves anyway. */
 
-		if (!cmp_permuterm_prefix(query, query_len, node->keys[i])) {
+		isr3_stats_add(search_comparisons, 1);
+
+		if (!cmp_permuterm_prefix(query, query_len, isr3_permuterm_node_key(&cursor, i))) {
 			return 0; /* Greater than, but not matching prefix. It is impossible for a chain to start. */
 		}
 	}
@@ -411,16 +814,17 @@ int isr3_permuterm_node_search(struct isr3_permuterm_node* node, char* query, in
 
 	for (; i < node->num_keys; ++i) {
 		/* We check the current node (i) and then the right child (i + 1) */
+		isr3_stats_add(search_comparisons, 1);
 
-		if (cmp_permuterm_prefix(query, query_len, node->keys[i])) {
-			callback(node->keys[i]->value, search_id);
+		if (cmp_permuterm_prefix(query, query_len, isr3_permuterm_node_key(&cursor, i))) {
+			isr3_permuterm_key_visit(ptr, isr3_permuterm_key_at(ptr, node->keys[i]), search_id, callback);
 		} else {
 			result = 0;
 			break;
 		}
 
 		if (!node->is_leaf) {
-			if (!isr3_permuterm_node_search(node->children[i + 1], query, query_len, search_id, callback)) {
+			if (!isr3_permuterm_node_search(ptr, isr3_permuterm_node_at(ptr, node->children[i + 1]), query, query_len, search_id, callback)) {
 				result = 0;
 				break;
 			}
@@ -430,6 +834,242 @@ int isr3_permuterm_node_search(struct isr3_permuterm_node* node, char* query, in
 	return result;
 }
 
+void isr3_permuterm_index_shape(struct isr3_permuterm_index* ptr, unsigned long* nodes, unsigned long* keys, int* height) {
+	/* Only safe while nothing is inserting into the index. */
+	*nodes = *keys = 0;
+	*height = isr3_permuterm_node_shape(ptr, ptr->root, nodes, keys);
+}
+
+int isr3_permuterm_node_shape(struct isr3_permuterm_index* ptr, uint32_t handle, unsigned long* nodes, unsigned long* keys) {
+	int height = 0;
+
+	if (!handle) {
+		return 0;
+	}
+
+	struct isr3_permuterm_node* node = isr3_permuterm_node_at(ptr, handle);
+
+	++*nodes;
+	*keys += node->num_keys;
+
+	if (!node->is_leaf) {
+		for (int i = 0; i <= node->num_keys; ++i) {
+			int child_height = isr3_permuterm_node_shape(ptr, node->children[i], nodes, keys);
+
+			if (child_height > height) {
+				height = child_height;
+			}
+		}
+	}
+
+	return height + 1;
+}
+
+void isr3_permuterm_cursor_init(struct isr3_permuterm_cursor* cursor, struct isr3_permuterm_index* ptr, struct isr3_permuterm_node* node, char* buffer) {
+	/* `buffer` needs room for node->max_key_len bytes. */
+	cursor->ptr = ptr;
+	cursor->node = node;
+	cursor->next = node->packed;
+	cursor->index = -1;
+	cursor->view.key = buffer;
+	cursor->view.key_len = 0;
+	cursor->view.value = ISR3_VOCAB_NONE;
+	cursor->view.more_values = NULL;
+}
+
+struct isr3_permuterm_key* isr3_permuterm_node_key(struct isr3_permuterm_cursor* cursor, int index) {
+	/* Inner keys are whole. A leaf key is decoded on top of the one before it, so a scan may only ever move forward. */
+	if (!cursor->node->is_leaf) {
+		return isr3_permuterm_key_at(cursor->ptr, cursor->node->keys[index]);
+	}
+
+	while (cursor->index < index) {
+		unsigned int shared = isr3_permuterm_varint_get(&cursor->next), suffix_len = isr3_permuterm_varint_get(&cursor->next);
+
+		memcpy(cursor->view.key + shared, cursor->next, suffix_len);
+
+		cursor->next += suffix_len;
+		cursor->view.key_len = shared + suffix_len;
+		cursor->index++;
+	}
+
+	return &cursor->view;
+}
+
+char* isr3_permuterm_leaf_decode(struct isr3_permuterm_node* node, char** keys, int* key_lens, char* buffer) {
+	/* Every key of the leaf, whole, in `buffer` (ISR3_PERMUTERM_SCRATCH bytes) if they fit, otherwise in a new buffer for the caller to free. */
+	size_t size = (size_t) node->max_key_len * node->num_keys;
+	char* output = size <= ISR3_PERMUTERM_SCRATCH ? buffer : malloc(size);
+	const unsigned char* next = node->packed;
+
+	if (!output) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < node->num_keys; ++i) {
+		unsigned int shared = isr3_permuterm_varint_get(&next), suffix_len = isr3_permuterm_varint_get(&next);
+
+		keys[i] = output + (size_t) node->max_key_len * i;
+
+		if (shared) {
+			memcpy(keys[i], keys[i - 1], shared);
+		}
+
+		memcpy(keys[i] + shared, next, suffix_len);
+
+		next += suffix_len;
+		key_lens[i] = shared + suffix_len;
+	}
+
+	return output;
+}
+
+void isr3_permuterm_leaf_encode(struct isr3_permuterm_node* node, char** keys, int* key_lens) {
+	/* Encodes the leaf's first `num_keys` keys (in order) over its buffer. The keys must not point into the buffer. */
+	unsigned char varint[5];
+	int shared[BTREE_NUM_KEYS], size = 0, max_key_len = 0;
+
+	for (int i = 0; i < node->num_keys; ++i) {
+		shared[i] = i ? isr3_permuterm_common_prefix(keys[i], key_lens[i], keys[i - 1], key_lens[i - 1]) : 0;
+
+		size += isr3_permuterm_varint_put(varint, shared[i]) + isr3_permuterm_varint_put(varint, key_lens[i] - shared[i]) + key_lens[i] - shared[i];
+
+		if (key_lens[i] > max_key_len) {
+			max_key_len = key_lens[i];
+		}
+	}
+
+	isr3_permuterm_leaf_reserve(node, size);
+	unsigned char* cur = node->packed;
+
+	for (int i = 0; i < node->num_keys; ++i) {
+		cur += isr3_permuterm_varint_put(cur, shared[i]);
+		cur += isr3_permuterm_varint_put(cur, key_lens[i] - shared[i]);
+
+		memcpy(cur, keys[i] + shared[i], key_lens[i] - shared[i]);
+		cur += key_lens[i] - shared[i];
+	}
+
+	node->packed_len = size;
+	node->max_key_len = max_key_len;
+}
+
+void isr3_permuterm_leaf_insert(struct isr3_permuterm_node* node, int index, char* key, int key_len) {
+	/*
+	 * Adds the bytes of a key which is about to become key `index`, before `num_keys` is updated.
+	 *
+	 * Only two entries change: the new key, coded against the key before it, and the key after it, which is now coded
+	 * against the new key. Everything else is moved over as it is.
+	 */
+	char buffer[(key_len > node->max_key_len ? key_len : node->max_key_len) + 1];
+	unsigned char head[10], tail[10];
+	struct isr3_permuterm_cursor cursor;
+	struct isr3_permuterm_key* cur = NULL;
+	int head_len, tail_len = 0, shared = 0, next_shared = 0;
+
+	isr3_permuterm_cursor_init(&cursor, NULL, node, buffer); /* Leaf keys never need the pools. */
+
+	if (index) {
+		cur = isr3_permuterm_node_key(&cursor, index - 1);
+		shared = isr3_permuterm_common_prefix(key, key_len, cur->key, cur->key_len);
+	}
+
+	head_len = isr3_permuterm_varint_put(head, shared);
+	head_len += isr3_permuterm_varint_put(head + head_len, key_len - shared);
+
+	int start = cursor.next - node->packed, end = start, suffix_len = 0;
+
+	if (index < node->num_keys) {
+		/* Decoding the next key overwrites the previous one in `buffer`, which isn't needed any more. */
+		cur = isr3_permuterm_node_key(&cursor, index);
+		next_shared = isr3_permuterm_common_prefix(key, key_len, cur->key, cur->key_len);
+		suffix_len = cur->key_len - next_shared;
+		end = cursor.next - node->packed;
+
+		tail_len = isr3_permuterm_varint_put(tail, next_shared);
+		tail_len += isr3_permuterm_varint_put(tail + tail_len, suffix_len);
+	}
+
+	int size = node->packed_len - (end - start) + head_len + key_len - shared + tail_len + suffix_len;
+
+	isr3_permuterm_leaf_reserve(node, size);
+
+	unsigned char* out = node->packed + start;
+
+	memmove(out + head_len + key_len - shared + tail_len + suffix_len, node->packed + end, node->packed_len - end);
+	memcpy(out, head, head_len);
+	memcpy(out + head_len, key + shared, key_len - shared);
+
+	if (index < node->num_keys) {
+		out += head_len + key_len - shared;
+		memcpy(out, tail, tail_len);
+		memcpy(out + tail_len, cur->key + next_shared, suffix_len);
+	}
+
+	node->packed_len = size;
+
+	if (key_len > node->max_key_len) {
+		node->max_key_len = key_len;
+	}
+}
+
+void isr3_permuterm_leaf_reserve(struct isr3_permuterm_node* node, int size) {
+	if (size <= node->packed_size) {
+		return;
+	}
+
+	int packed_size = (size + ISR3_PERMUTERM_PACKED_ALIGN - 1) / ISR3_PERMUTERM_PACKED_ALIGN * ISR3_PERMUTERM_PACKED_ALIGN;
+
+	if (node->packed) {
+		isr3_mem_untrack(ISR3_MEM_KEY_BYTES, node->packed, node->packed_size, 1);
+	}
+
+	if (!(node->packed = realloc(node->packed, packed_size))) {
+		isr3_err("malloc failed with new btree key\n");
+		exit(1);
+	}
+
+	isr3_mem_track(ISR3_MEM_KEY_BYTES, node->packed, packed_size, 1);
+	node->packed_size = packed_size;
+}
+
+int isr3_permuterm_common_prefix(const char* a, int a_len, const char* b, int b_len) {
+	int output = 0, min_length = a_len < b_len ? a_len : b_len;
+
+	while (output < min_length && a[output] == b[output]) {
+		++output;
+	}
+
+	return output;
+}
+
+int isr3_permuterm_varint_put(unsigned char* output, unsigned int value) {
+	/* Seven bits per byte, low bits first; the high bit marks that another byte follows. Returns the bytes written. */
+	int length = 0;
+
+	while (value >= 0x80) {
+		output[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+
+	output[length++] = value;
+	return length;
+}
+
+unsigned int isr3_permuterm_varint_get(const unsigned char** input) {
+	unsigned int output = 0;
+	int shift = 0;
+
+	while (**input & 0x80) {
+		output |= (unsigned int) (*(*input)++ & 0x7f) << shift;
+		shift += 7;
+	}
+
+	output |= (unsigned int) *(*input)++ << shift;
+	return output;
+}
+
 int cmp_permuterm_node(char* query, int query_len, struct isr3_permuterm_key* key) {
 	isr3_debugf("comparing [%.*s] with [%.*s] : ", query_len, query, key->key_len, key->key);
 
@@ -437,10 +1077,10 @@ int cmp_permuterm_node(char* query, int query_len, struct isr3_permuterm_key* ke
 	isr3_debugf("min length : %d\n", min_length);
 
 	for (int i = 0; i < min_length; ++i) {
-		if (query[i] < key->key[i]) {
+		if ((unsigned char) query[i] < (unsigned char) key->key[i]) {
 			isr3_debug("-1 (memcmp)\n");
 			return -1;
-		} else if (query[i] > key->key[i]) {
+		} else if ((unsigned char) query[i] > (unsigned char) key->key[i]) {
 			isr3_debug("1  (memcmp)\n");
 			return 1;
 		}
@@ -467,7 +1107,7 @@ int cmp_permuterm_prefix(char* query, int query_len, struct isr3_permuterm_key*
 	}
 
 	for (int i = 0; i < query_len; ++i) {
-		if (query[i] != key->key[i]) {
+		if ((unsigned char) query[i] != (unsigned char) key->key[i]) {
 			isr3_debugf("fail mismatch on %d\n", i);
 			return 0;
 		}
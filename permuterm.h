@@ -2,36 +2,110 @@
 #define PERMUTERM_H
 
 #define BTREE_DEGREE 9
-#define BTREE_NUM_KEYS BTREE_DEGREE - 1
+#define BTREE_NUM_KEYS (BTREE_DEGREE - 1)
 #define BTREE_NUM_CHILDREN BTREE_DEGREE
 
+#include <stdint.h>
+
 #include "debug.h"
-#include "entry_types.h"
+#include "pool.h"
+#include "vocab.h"
+
+/* Insertion splits full nodes on the way down, so nodes never overflow and need no spare slots. */
 
-/* There are more children than keys, but we add an extra child and an extra key to allow for temporary overflows by one element. */
+/*
+ * Different words can produce the same key (e.g. a word indexed twice), so a key can carry more than one value.
+ * Inserting a duplicate key merges its value into the existing key instead of adding a second copy of the key.
+ */
+
+struct isr3_permuterm_value {
+	uint32_t value;
+	struct isr3_permuterm_value* next;
+};
 
 struct isr3_permuterm_key {
-	char* key;
+	char* key; // NULL once the key is stored in a leaf, see below.
 	int key_len;
-	struct isr3_word_entry* value;
+	uint32_t value; // Word ID in the index's vocabulary.
+	struct isr3_permuterm_value* more_values; // Any further values for this key, usually NULL.
 };
 
+/*
+ * Leaves front-code their keys: the first key of a leaf (its anchor) is stored whole, and every following key as the length
+ * of the prefix it shares with the key before it, then its remaining bytes. Sorted rotations share long prefixes, so this
+ * is a fraction of the key bytes, all in one buffer per leaf. Searches decode the keys one after another as they scan the
+ * leaf, each step only copying the bytes after the shared prefix.
+ *
+ * Keys only move up (as split medians), so inner nodes keep whole keys and a leaf's median is decoded when it moves up.
+ */
+
+/*
+ * Nodes and keys live in the index's pools and refer to each other through 32-bit handles (see pool.h), which halves the
+ * size of the key and child arrays. Handle 0 is NULL.
+ */
+
 struct isr3_permuterm_node {
 	int is_leaf, num_keys;
-	struct isr3_permuterm_key* keys[BTREE_NUM_KEYS + 1];
-	struct isr3_permuterm_node* children[BTREE_NUM_CHILDREN + 1];
+	uint32_t keys[BTREE_NUM_KEYS]; // Handles into `keys` of the index.
+	uint32_t children[BTREE_NUM_CHILDREN]; // Handles into `nodes` of the index.
+
+	unsigned char* packed; // Leaves only: varint shared length, varint suffix length and the suffix, per key.
+	int packed_len, packed_size, max_key_len; // Bytes used and allocated, and the longest key.
+};
+
+/*
+ * Concurrent indexes never modify a published node. An insert copies the path from the root to the leaf, applies the insert
+ * (and any splits) to the copies and publishes them with a single atomic store to `root`, so searches never take a lock.
+ *
+ * Replaced nodes are retired with the epoch they were unlinked in and freed once no reader can still hold them:
+ * each reader announces the epoch it started in through one of the `reader_epochs` slots (0 means the slot is free).
+ * Only one thread may insert at a time.
+ */
+
+#define ISR3_EPOCH_SLOTS 64
+
+/*
+ * Indexes over a complete vocabulary (loaded segments) are bulk loaded instead: every rotation is sorted at once and the
+ * tree is laid out bottom-up with full nodes. The leaves, which are nearly all of the work, are built by a pool of threads,
+ * see isr3_permuterm_index_build().
+ */
+
+#define ISR3_PERMUTERM_BUILD_PARALLEL_MIN 65536 /* Fewer keys than this are built on the calling thread. */
+#define ISR3_PERMUTERM_BUILD_LEAVES 256 /* Leaves handed to a build thread at a time. */
+
+struct isr3_permuterm_retired {
+	uint32_t node;
+	unsigned long epoch;
 };
 
 struct isr3_permuterm_index {
-	struct isr3_permuterm_node* root;
+	uint32_t root;
+	int concurrent;
+	struct isr3_vocab* vocab; // The words the values refer to.
+
+	struct isr3_pool nodes, keys;
+
+	unsigned long epoch;
+	unsigned long reader_epochs[ISR3_EPOCH_SLOTS];
+
+	struct isr3_permuterm_retired* retired;
+	int num_retired, max_retired;
 };
 
-struct isr3_permuterm_index* isr3_permuterm_index_create(void);
+struct isr3_permuterm_index* isr3_permuterm_index_create(struct isr3_vocab* vocab);
+struct isr3_permuterm_index* isr3_permuterm_index_create_concurrent(struct isr3_vocab* vocab);
 void isr3_permuterm_index_free(struct isr3_permuterm_index* ptr);
 
-void isr3_permuterm_index_insert(struct isr3_permuterm_index* ptr, char* key, int key_len, struct isr3_word_entry* value);
-void isr3_permuterm_index_search(struct isr3_permuterm_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_word_entry* value, int search_id));
+void isr3_permuterm_index_insert(struct isr3_permuterm_index* ptr, char* key, int key_len, uint32_t value);
+void isr3_permuterm_index_build(struct isr3_permuterm_index* ptr); /* Every rotation of every word in the vocabulary, into an empty non-concurrent index. */
+void isr3_permuterm_index_search(struct isr3_permuterm_index* ptr, char* query, int query_len, int search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
 
 void isr3_permuterm_index_dump(struct isr3_permuterm_index* ptr);
+void isr3_permuterm_index_shape(struct isr3_permuterm_index* ptr, unsigned long* nodes, unsigned long* keys, int* height); /* Node and key counts and the height of the tree. */
+
+/* Key comparison kernels, exposed for the microbenchmarks. */
+
+int cmp_permuterm_node(char* query, int query_len, struct isr3_permuterm_key* key);
+int cmp_permuterm_prefix(char* query, int query_len, struct isr3_permuterm_key* key);
 
 #endif
@@ -0,0 +1,143 @@
+#include "pool.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void isr3_pool_grow(struct isr3_pool* pool);
+
+void isr3_pool_init(struct isr3_pool* pool, uint32_t item_size, enum isr3_mem_tag tag) {
+	memset(pool, 0, sizeof *pool);
+
+	/* The free list needs room for a handle, and items stay 4 byte aligned. */
+	pool->item_size = item_size < sizeof(uint32_t) ? sizeof(uint32_t) : (item_size + 3) & ~3u;
+	pool->next = 1;
+	pool->tag = tag;
+}
+
+void isr3_pool_destroy(struct isr3_pool* pool) {
+	for (uint32_t i = 0; i < pool->num_chunks; ++i) {
+		isr3_mem_free(pool->tag, pool->chunks[i], 0, 0);
+	}
+
+	for (int i = 0; i < pool->num_old_chunks; ++i) {
+		isr3_mem_free(pool->tag, pool->old_chunks[i], 0, 0);
+	}
+
+	isr3_mem_free(pool->tag, pool->chunks, 0, 0);
+	isr3_mem_use(pool->tag, -(long) (pool->num_items * pool->item_size), -(long) pool->num_items);
+
+	free(pool->old_chunks);
+	memset(pool, 0, sizeof *pool);
+}
+
+uint32_t isr3_pool_alloc(struct isr3_pool* pool) {
+	uint32_t output = pool->free_list;
+
+	if (output) {
+		memcpy(&pool->free_list, isr3_pool_get(pool, output), sizeof pool->free_list);
+	} else {
+		if (!pool->next) {
+			isr3_err("pool is out of handles\n");
+			exit(1);
+		}
+
+		if ((pool->next >> ISR3_POOL_CHUNK_SHIFT) == pool->num_chunks) {
+			isr3_pool_grow(pool);
+		}
+
+		output = pool->next++;
+	}
+
+	pool->num_items++;
+	isr3_mem_use(pool->tag, pool->item_size, 1);
+
+	return output;
+}
+
+uint32_t isr3_pool_alloc_range(struct isr3_pool* pool, uint32_t count) {
+	/* Never reuses freed handles, a range has to be contiguous. Other threads may fill the items once this returns. */
+	uint32_t output = pool->next;
+
+	if (!count) {
+		return output;
+	}
+
+	if (!pool->next || count > UINT32_MAX - pool->next) {
+		isr3_err("pool is out of handles\n");
+		exit(1);
+	}
+
+	while (((pool->next + count - 1) >> ISR3_POOL_CHUNK_SHIFT) >= pool->num_chunks) {
+		isr3_pool_grow(pool);
+	}
+
+	pool->next += count;
+	pool->num_items += count;
+	isr3_mem_use(pool->tag, (long) count * pool->item_size, count);
+
+	return output;
+}
+
+void isr3_pool_free(struct isr3_pool* pool, uint32_t handle) {
+	if (!handle) {
+		return;
+	}
+
+	memcpy(isr3_pool_get(pool, handle), &pool->free_list, sizeof pool->free_list);
+	pool->free_list = handle;
+
+	pool->num_items--;
+	isr3_mem_use(pool->tag, -(long) pool->item_size, -1);
+}
+
+void* isr3_pool_get(struct isr3_pool* pool, uint32_t handle) {
+	char** chunks = __atomic_load_n(&pool->chunks, __ATOMIC_ACQUIRE);
+	return chunks[handle >> ISR3_POOL_CHUNK_SHIFT] + (size_t) (handle & (ISR3_POOL_CHUNK - 1)) * pool->item_size;
+}
+
+void isr3_pool_grow(struct isr3_pool* pool) {
+	/* Adds the next chunk. The first chunk also holds the unused handle 0. */
+	/* Chunks and directories are tracked as heap only, the items are counted as they are handed out. */
+	char* chunk = malloc((size_t) pool->item_size * ISR3_POOL_CHUNK);
+
+	if (!chunk) {
+		isr3_err("malloc failed with new pool chunk\n");
+		exit(1);
+	}
+
+	isr3_mem_track(pool->tag, chunk, 0, 0);
+
+	if (pool->num_chunks == pool->max_chunks) {
+		uint32_t max_chunks = pool->max_chunks ? pool->max_chunks * 2 : 4;
+		char** chunks = malloc(sizeof *chunks * max_chunks);
+		char*** old_chunks = realloc(pool->old_chunks, sizeof *old_chunks * (pool->num_old_chunks + 1));
+
+		if (!chunks || !old_chunks) {
+			isr3_err("malloc failed with new pool directory\n");
+			exit(1);
+		}
+
+		isr3_mem_track(pool->tag, chunks, 0, 0);
+
+		if (pool->num_chunks) {
+			memcpy(chunks, pool->chunks, sizeof *chunks * pool->num_chunks);
+		}
+
+		chunks[pool->num_chunks] = chunk;
+
+		/* Readers may still hold the old directory, so it is only freed with the pool. */
+		pool->old_chunks = old_chunks;
+
+		if (pool->chunks) {
+			pool->old_chunks[pool->num_old_chunks++] = pool->chunks;
+		}
+
+		pool->max_chunks = max_chunks;
+		__atomic_store_n(&pool->chunks, chunks, __ATOMIC_RELEASE);
+	} else {
+		pool->chunks[pool->num_chunks] = chunk;
+	}
+
+	pool->num_chunks++;
+}
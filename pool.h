@@ -0,0 +1,45 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include "mem.h"
+
+#define ISR3_POOL_CHUNK_SHIFT 8
+#define ISR3_POOL_CHUNK (1 << ISR3_POOL_CHUNK_SHIFT) /* Items per chunk. */
+
+/*
+ * Fixed-size items addressed by 32-bit handles instead of pointers.
+ *
+ * Items live in chunks of ISR3_POOL_CHUNK, and a handle is the item's chunk and slot packed into one uint32_t. Handle 0 is
+ * never handed out and stands for NULL. Freed items are reused before the pool grows.
+ *
+ * Chunks never move, so a resolved item stays put. The chunk directory does move when it grows: the new directory is
+ * published with a release store and the old ones are kept until the pool is destroyed, so a thread may resolve handles
+ * while another one allocates, as long as it learned of the handle through a release/acquire pair (like a published
+ * root). Allocating and freeing are single-threaded.
+ */
+
+struct isr3_pool {
+	char** chunks;
+	uint32_t num_chunks, max_chunks;
+
+	uint32_t item_size, next; // `next` is the lowest handle which was never handed out.
+	uint32_t free_list; // Freed handles, linked through the first four bytes of each item.
+	unsigned long num_items; // Live items.
+
+	char*** old_chunks; // Superseded directories.
+	int num_old_chunks;
+
+	enum isr3_mem_tag tag;
+};
+
+void isr3_pool_init(struct isr3_pool* pool, uint32_t item_size, enum isr3_mem_tag tag);
+void isr3_pool_destroy(struct isr3_pool* pool); /* Frees every item at once. */
+
+uint32_t isr3_pool_alloc(struct isr3_pool* pool); /* Exits on failure, like the B-tree's allocations. */
+uint32_t isr3_pool_alloc_range(struct isr3_pool* pool, uint32_t count); /* `count` consecutive new handles, returns the first. */
+void isr3_pool_free(struct isr3_pool* pool, uint32_t handle);
+void* isr3_pool_get(struct isr3_pool* pool, uint32_t handle);
+
+#endif
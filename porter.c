@@ -53,8 +53,10 @@
    should be done before stem(...) is called.
 */
 
-static char * b;       /* buffer for word to be stemmed */
-static int k,k0,j;     /* j is a general offset into the string */
+/* The statics are thread-local so the ingest and query threads can stem at the same time. */
+
+static __thread char * b;       /* buffer for word to be stemmed */
+static __thread int k,k0,j;     /* j is a general offset into the string */
 
 /* cons(i) is TRUE <=> b[i] is a consonant. */
 
@@ -0,0 +1,937 @@
+#include "segment.h"
+#include "mem.h"
+#include "perf.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static struct isr3_segment* isr3_segment_create(int concurrent, enum isr3_engine engine);
+static void isr3_segment_release(struct isr3_segment* seg);
+static struct isr3_segment** isr3_segment_set_snapshot(struct isr3_segment_set* set, int* count); /* Referenced segments, release each one. */
+static void isr3_segment_free(struct isr3_segment* seg);
+static uint32_t isr3_segment_find_word(struct isr3_segment* seg, char* word, int word_len);
+static void isr3_segment_index_word(struct isr3_segment* seg, uint32_t word);
+
+static uint32_t* isr3_segment_reserve(uint32_t** buffer, uint32_t* size, uint32_t count);
+
+static struct isr3_segment* isr3_segment_flush(struct isr3_segment_set* set, struct isr3_segment* seg);
+static struct isr3_segment* isr3_segment_merge(struct isr3_segment_set* set, struct isr3_segment* first, struct isr3_segment* second);
+static char* isr3_segment_next_path(struct isr3_segment_set* set);
+static char* isr3_segment_postings_path(const char* path);
+static const uint32_t* isr3_segment_postings(struct isr3_vocab* vocab, uint32_t word, uint32_t** buffer, uint32_t* size); /* A loaded word's postings in one array. */
+static void* isr3_segment_merger(void* arg);
+
+struct isr3_segment_set* isr3_segment_set_create(const char* dir, unsigned int segment_docs, enum isr3_engine engine, struct isr3_buffer_pool* pool) {
+	struct isr3_segment_set* output = malloc(sizeof *output);
+
+	if (!output) {
+		return NULL;
+	}
+
+	output->dir = malloc(strlen(dir) + 1);
+
+	if (!output->dir) {
+		free(output);
+		return NULL;
+	}
+
+	strcpy(output->dir, dir);
+
+	output->active = output->segments = NULL;
+	output->segment_docs = segment_docs;
+	output->published = 0;
+	output->version = 0;
+	output->next_file_id = 0;
+	output->engine = engine;
+	output->pool = pool;
+	output->shutdown = 0;
+
+	pthread_mutex_init(&output->lock, NULL);
+	pthread_cond_init(&output->cond, NULL);
+
+	if (pthread_create(&output->merger, NULL, isr3_segment_merger, output)) {
+		isr3_err("Failed to start the segment merger thread.\n");
+		pthread_mutex_destroy(&output->lock);
+		pthread_cond_destroy(&output->cond);
+		free(output->dir);
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+void isr3_segment_set_free(struct isr3_segment_set* set) {
+	pthread_mutex_lock(&set->lock);
+	set->shutdown = 1;
+	pthread_cond_broadcast(&set->cond);
+	pthread_mutex_unlock(&set->lock);
+
+	pthread_join(set->merger, NULL);
+
+	struct isr3_segment* cur = set->segments, *tmp = NULL;
+
+	while (cur) {
+		tmp = cur->next;
+		isr3_segment_release(cur);
+		cur = tmp;
+	}
+
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->cond);
+
+	free(set->dir);
+	free(set);
+}
+
+int isr3_segment_set_add_file(struct isr3_segment_set* set, const char* filename, unsigned int ref_id) {
+	pthread_mutex_lock(&set->lock);
+
+	if (!set->active) {
+		struct isr3_segment* seg = isr3_segment_create(1, set->engine), **tail = &set->segments;
+
+		if (!seg) {
+			pthread_mutex_unlock(&set->lock);
+			isr3_err("Failed to allocate a new segment.\n");
+			return 0;
+		}
+
+		while (*tail) tail = &(*tail)->next;
+
+		*tail = seg;
+		set->active = seg;
+	}
+
+	struct isr3_segment* seg = set->active;
+	pthread_mutex_unlock(&set->lock);
+
+	/* Only this thread ever writes to the active segment, readers search it concurrently without locking. */
+	uint32_t old_words = seg->vocab.num_words;
+	int result = parse_file(filename, ref_id, &seg->root, &seg->vocab, NULL);
+
+	struct isr3_perf_sample counters;
+	isr3_perf_begin(&counters);
+
+	/* Word IDs are handed out in order, so every ID from the old word count on is new. */
+	for (uint32_t word = old_words; word < seg->vocab.num_words; ++word) {
+		isr3_segment_index_word(seg, word);
+	}
+
+	isr3_perf_end(ISR3_PHASE_BTREE, &counters);
+
+	seg->num_docs++;
+
+	pthread_mutex_lock(&set->lock);
+	set->published++;
+	set->version++;
+
+	if (set->segment_docs && seg->num_docs >= set->segment_docs) {
+		isr3_debugf("sealing segment with %u documents\n", seg->num_docs);
+
+		seg->sealed = 1;
+		set->active = NULL;
+		pthread_cond_signal(&set->cond);
+	}
+
+	pthread_mutex_unlock(&set->lock);
+	return result;
+}
+
+int isr3_segment_set_add_index(struct isr3_segment_set* set, const char* dir) {
+	struct isr3_segment* seg = malloc(sizeof *seg), **tail = &set->segments;
+
+	if (!seg) {
+		isr3_err("Failed to allocate a new segment.\n");
+		return 0;
+	}
+
+	memset(seg, 0, sizeof *seg);
+	isr3_vocab_init(&seg->vocab);
+
+	if (!(seg->disk = isr3_disk_index_open(dir, &seg->vocab, &seg->num_docs, set->pool))) {
+		free(seg);
+		return 0;
+	}
+
+	seg->sealed = 1;
+	seg->refcount = 1;
+
+	pthread_mutex_lock(&set->lock);
+
+	while (*tail) tail = &(*tail)->next;
+
+	*tail = seg;
+	set->published += seg->num_docs;
+	set->version++;
+
+	pthread_mutex_unlock(&set->lock);
+	return 1;
+}
+
+void isr3_segment_set_search(struct isr3_segment_set* set, char* query, int query_len, int wildcard_count, int* search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id)) {
+	int count = 0, end_id = *search_id;
+	struct isr3_segment** snapshot = isr3_segment_set_snapshot(set, &count);
+
+	/* Documents never span segments, so every segment is searched with the same search IDs. */
+	for (int i = 0; i < count; ++i) {
+		int cur_id = *search_id;
+
+		if (exact_term(query, query_len, wildcard_count)) {
+			/* Exact terms skip the permuterm index: one vocabulary lookup, and no rotations of longer words. */
+			uint32_t word = isr3_segment_find_word(snapshot[i], query, query_len);
+
+			if (word != ISR3_VOCAB_NONE) {
+				callback(&snapshot[i]->vocab, word, cur_id + 1);
+			}
+
+			++cur_id;
+			isr3_stats_add(lookups, 1);
+		} else if (snapshot[i]->disk) {
+			isr3_disk_index_search(snapshot[i]->disk, query, query_len, wildcard_count, &cur_id, callback);
+		} else if (snapshot[i]->kgram) {
+			isr3_kgram_index_search(snapshot[i]->kgram, query, query_len, ++cur_id, callback);
+		} else if (snapshot[i]->fm) {
+			isr3_fm_index_search(snapshot[i]->fm, query, query_len, ++cur_id, callback);
+		} else {
+			search_permuterm(query, query_len, snapshot[i]->index, wildcard_count, &cur_id, callback);
+		}
+
+		isr3_segment_release(snapshot[i]);
+		end_id = cur_id;
+	}
+
+	*search_id = end_id;
+
+	free(snapshot);
+}
+
+uint32_t isr3_segment_find_word(struct isr3_segment* seg, char* word, int word_len) {
+	if (seg->vocab.loaded) {
+		return isr3_vocab_find(&seg->vocab, word, word_len); /* Loaded segments keep their words sorted. */
+	}
+
+	/*
+	 * insert_word() publishes the root with a release store, so read it once with acquire like find_word() reads the rest.
+	 * isr3_vocab_add() counts a segment's first word before its root is published, so an empty root can't mean loaded.
+	 */
+	isr3_tree_node* root = __atomic_load_n(&seg->root, __ATOMIC_ACQUIRE);
+
+	return root ? find_word(word, word_len, root, &seg->vocab) : ISR3_VOCAB_NONE;
+}
+
+void isr3_segment_index_word(struct isr3_segment* seg, uint32_t word) {
+	if (seg->kgram) {
+		isr3_kgram_index_insert(seg->kgram, word);
+	} else {
+		gen_permuterm(word, seg->index);
+	}
+}
+
+struct isr3_segment** isr3_segment_set_snapshot(struct isr3_segment_set* set, int* count) {
+	/* Take a snapshot of the segment list so the merger can keep swapping segments while we search. */
+	struct isr3_segment** snapshot = NULL, *cur = NULL;
+
+	*count = 0;
+
+	pthread_mutex_lock(&set->lock);
+
+	for (cur = set->segments; cur; cur = cur->next) {
+		++*count;
+	}
+
+	snapshot = malloc(sizeof *snapshot * *count + 1);
+
+	if (!snapshot) {
+		pthread_mutex_unlock(&set->lock);
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	*count = 0;
+
+	for (cur = set->segments; cur; cur = cur->next) {
+		__atomic_add_fetch(&cur->refcount, 1, __ATOMIC_RELAXED);
+		snapshot[(*count)++] = cur;
+	}
+
+	pthread_mutex_unlock(&set->lock);
+	return snapshot;
+}
+
+unsigned int isr3_segment_set_published(struct isr3_segment_set* set) {
+	pthread_mutex_lock(&set->lock);
+	unsigned int output = set->published;
+	pthread_mutex_unlock(&set->lock);
+
+	return output;
+}
+
+unsigned long isr3_segment_set_version(struct isr3_segment_set* set, unsigned int* published) {
+	pthread_mutex_lock(&set->lock);
+	unsigned long output = set->version;
+
+	if (published) {
+		*published = set->published;
+	}
+
+	pthread_mutex_unlock(&set->lock);
+	return output;
+}
+
+void isr3_segment_set_shape(struct isr3_segment_set* set, unsigned long* nodes, unsigned long* keys, int* height) {
+	/* The caller makes sure nothing is being ingested, the merger only ever swaps whole segments under the lock. */
+	*nodes = *keys = 0;
+	*height = 0;
+
+	pthread_mutex_lock(&set->lock);
+
+	for (struct isr3_segment* cur = set->segments; cur; cur = cur->next) {
+		unsigned long seg_nodes, seg_keys;
+		int seg_height;
+
+		if (!cur->index) {
+			continue;
+		}
+
+		isr3_permuterm_index_shape(cur->index, &seg_nodes, &seg_keys, &seg_height);
+
+		*nodes += seg_nodes;
+		*keys += seg_keys;
+
+		if (seg_height > *height) {
+			*height = seg_height;
+		}
+	}
+
+	pthread_mutex_unlock(&set->lock);
+}
+
+int isr3_segment_write(struct isr3_segment* seg, const char* path) {
+	uint32_t* order = isr3_vocab_sort(&seg->vocab), *refs = NULL, max_refs = 0;
+	unsigned long start = isr3_stats_now();
+	struct isr3_perf_sample counters;
+	struct isr3_segment_header hdr;
+	char* tmp_path = malloc(strlen(path) + 5);
+
+	if (!tmp_path) {
+		isr3_err("malloc failure\n");
+		free(order);
+		return 0;
+	}
+
+	sprintf(tmp_path, "%s.tmp", path);
+	isr3_perf_begin(&counters);
+
+	FILE* fd = isr3_segment_file_open(tmp_path, &hdr);
+
+	if (!fd) {
+		free(order);
+		free(tmp_path);
+		return 0;
+	}
+
+	hdr.num_docs = seg->num_docs;
+
+	for (uint32_t i = 0; i < seg->vocab.num_words; ++i) {
+		/* The postings are gathered into one array so each word is written with a single call. */
+		struct isr3_postings postings;
+		uint32_t num_refs = 0, *cur = isr3_segment_reserve(&refs, &max_refs, isr3_vocab_doc_freq(&seg->vocab, order[i]));
+		unsigned int ref_id;
+		int word_len;
+		char* word = isr3_vocab_word(&seg->vocab, order[i], &word_len);
+
+		isr3_vocab_postings(&seg->vocab, order[i], &postings);
+
+		while (isr3_postings_next(&postings, &ref_id)) {
+			cur[num_refs++] = ref_id;
+		}
+
+		if (!isr3_segment_file_word(fd, &hdr, word, word_len, cur, num_refs)) {
+			fclose(fd);
+			unlink(tmp_path);
+			free(order);
+			free(refs);
+			free(tmp_path);
+			return 0;
+		}
+	}
+
+	int result = isr3_segment_file_close(fd, &hdr, tmp_path, path);
+
+	free(order);
+	free(refs);
+	free(tmp_path);
+
+	isr3_perf_end(ISR3_PHASE_FLUSH, &counters);
+	isr3_stats_phase_end(ISR3_PHASE_FLUSH, start);
+	return result;
+}
+
+struct isr3_segment* isr3_segment_read(const char* path, enum isr3_engine engine, struct isr3_buffer_pool* pool) {
+	unsigned long start = isr3_stats_now();
+	struct isr3_segment_header hdr;
+	FILE* fd = isr3_segment_file_read(path, &hdr);
+
+	if (!fd) {
+		return NULL;
+	}
+
+	struct isr3_segment* output = isr3_segment_create(0, engine);
+
+	if (!output) {
+		fclose(fd);
+		return NULL;
+	}
+
+	output->num_docs = hdr.num_docs;
+	output->sealed = 1;
+
+	/*
+	 * Every word goes straight from the file into the columns, so a loaded segment costs a handful of allocations. With a
+	 * buffer pool, the postings are copied to a flat file next to the segment instead and read from there, see vocab.h.
+	 */
+	int loaded = pool ? isr3_vocab_load_words(&output->vocab, hdr.num_words, hdr.num_chars, -1, pool) : isr3_vocab_load(&output->vocab, hdr.num_words, hdr.num_refs, hdr.num_chars);
+	struct isr3_vocab* vocab = &output->vocab;
+	char* post_path = pool ? isr3_segment_postings_path(path) : NULL;
+	FILE* post = post_path ? fopen(post_path, "wb") : NULL;
+	uint32_t* refs = NULL, max_refs = 0;
+
+	output->path = malloc(strlen(path) + 1);
+
+	if (!loaded || !output->path || (pool && !post)) {
+		if (loaded && output->path) {
+			isr3_errf("Failed to create postings file [%s].\n", post_path);
+		} else {
+			isr3_err("malloc failure\n");
+		}
+
+		fclose(fd);
+		free(output->path);
+		free(post_path);
+		output->path = NULL;
+		isr3_segment_free(output);
+		return NULL;
+	}
+
+	strcpy(output->path, path);
+
+	uint32_t cur_string = 0, cur_ref = 0;
+	int result = 1;
+
+	for (uint32_t i = 0; i < hdr.num_words && result; ++i) {
+		uint32_t lengths[2];
+
+		/* The counts have to fit the header's totals (`cur_string` also counts one terminator per word). */
+		if (fread(lengths, sizeof *lengths, 2, fd) != 2 || !lengths[1] || lengths[0] > hdr.num_chars - (cur_string - i) || lengths[1] > hdr.num_refs - cur_ref
+				|| fread(vocab->strings + cur_string, 1, lengths[0], fd) != lengths[0]
+				|| fread(pool ? isr3_segment_reserve(&refs, &max_refs, lengths[1]) : vocab->postings + cur_ref, sizeof *refs, lengths[1], fd) != lengths[1]) {
+			isr3_errf("Segment [%s] is truncated.\n", path);
+			result = 0;
+			break;
+		}
+
+		if (post && fwrite(refs, sizeof *refs, lengths[1], post) != lengths[1]) {
+			isr3_errf("Failed to write postings file [%s].\n", post_path);
+			result = 0;
+			break;
+		}
+
+		vocab->offsets[i] = cur_string;
+		vocab->lengths[i] = lengths[0];
+
+		if (pool) {
+			vocab->postings_starts[i] = cur_ref;
+		} else {
+			vocab->postings_offsets[i] = cur_ref;
+		}
+
+		vocab->strings[cur_string + lengths[0]] = 0;
+		cur_string += lengths[0] + 1;
+		cur_ref += lengths[1];
+	}
+
+	fclose(fd);
+	free(refs);
+
+	if (post && (fclose(post) || (result && (vocab->postings_fd = open(post_path, O_RDONLY)) < 0))) {
+		isr3_errf("Failed to write postings file [%s].\n", post_path);
+		result = 0;
+	}
+
+	if (!result) {
+		if (post) {
+			unlink(post_path);
+		}
+
+		free(post_path);
+		free(output->path);
+		output->path = NULL; /* Don't unlink a file we didn't write. */
+		isr3_segment_free(output);
+		return NULL;
+	}
+
+	free(post_path);
+
+	if (pool) {
+		vocab->postings_starts[hdr.num_words] = cur_ref;
+	} else {
+		vocab->postings_offsets[hdr.num_words] = cur_ref;
+	}
+
+	isr3_stats_phase_end(ISR3_PHASE_FLUSH, start); /* Rebuilding the wildcard index is counted separately. */
+
+	struct isr3_perf_sample counters;
+	isr3_perf_begin(&counters);
+
+	if (engine == ISR3_ENGINE_FM) {
+		/* The words are complete now, so the FM-index is built once over all of them. */
+		if (!(output->fm = isr3_fm_index_create(vocab))) {
+			isr3_err("malloc failure\n");
+			exit(1);
+		}
+	} else if (output->index) {
+		isr3_permuterm_index_build(output->index); /* Bulk loaded on all cores, see permuterm.h. */
+	} else {
+		for (uint32_t word = 0; word < vocab->num_words; ++word) {
+			isr3_segment_index_word(output, word);
+		}
+	}
+
+	isr3_perf_end(ISR3_PHASE_BTREE, &counters);
+
+	return output;
+}
+
+struct isr3_segment* isr3_segment_create(int concurrent, enum isr3_engine engine) {
+	struct isr3_segment* output = malloc(sizeof *output);
+
+	if (!output) {
+		return NULL;
+	}
+
+	memset(output, 0, sizeof *output);
+	isr3_vocab_init(&output->vocab);
+
+	if (engine == ISR3_ENGINE_FM && !concurrent) {
+		output->refcount = 1;
+		return output; /* isr3_segment_read() builds the FM-index once every word is loaded. */
+	}
+
+	if (engine != ISR3_ENGINE_PERMUTERM) {
+		output->kgram = isr3_kgram_index_create(&output->vocab, concurrent);
+	} else {
+		output->index = concurrent ? isr3_permuterm_index_create_concurrent(&output->vocab) : isr3_permuterm_index_create(&output->vocab);
+	}
+
+	output->refcount = 1;
+
+	if (!output->index && !output->kgram) {
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+void isr3_segment_release(struct isr3_segment* seg) {
+	if (!__atomic_sub_fetch(&seg->refcount, 1, __ATOMIC_ACQ_REL)) {
+		isr3_segment_free(seg);
+	}
+}
+
+void isr3_segment_free(struct isr3_segment* seg) {
+	if (seg->kgram) {
+		isr3_kgram_index_free(seg->kgram);
+	} else if (seg->fm) {
+		isr3_fm_index_free(seg->fm);
+	} else if (seg->index) {
+		isr3_permuterm_index_free(seg->index);
+	} else if (seg->disk) {
+		isr3_disk_index_free(seg->disk);
+	}
+
+	if (seg->vocab.postings_starts && seg->path) {
+		/* The postings file of a segment loaded with a buffer pool. Its pages have to leave the pool before the descriptor is reused. */
+		char* post_path = isr3_segment_postings_path(seg->path);
+
+		isr3_buffer_pool_forget(seg->vocab.pool, seg->vocab.postings_fd);
+		close(seg->vocab.postings_fd);
+		unlink(post_path);
+		free(post_path);
+	}
+
+	isr3_vocab_destroy(&seg->vocab);
+	free_tree(seg->root);
+
+	if (seg->path) {
+		unlink(seg->path); /* Segment files are private to this process, a released segment is never read again. */
+		free(seg->path);
+	}
+
+	free(seg);
+}
+
+FILE* isr3_segment_file_open(const char* path, struct isr3_segment_header* hdr) {
+	FILE* fd = fopen(path, "wb");
+
+	if (!fd) {
+		isr3_errf("Failed to open segment [%s] for writing.\n", path);
+		return NULL;
+	}
+
+	memset(hdr, 0, sizeof *hdr);
+
+	/* Reserve room for the header, it is rewritten once the counts are known. */
+	if (fwrite(hdr, sizeof *hdr, 1, fd) != 1) {
+		isr3_errf("Failed to write segment [%s].\n", path);
+		fclose(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	return fd;
+}
+
+int isr3_segment_file_word(FILE* fd, struct isr3_segment_header* hdr, char* word, int word_len, const uint32_t* refs, uint32_t num_refs) {
+	uint32_t lengths[2] = {word_len, num_refs};
+
+	if (fwrite(lengths, sizeof *lengths, 2, fd) != 2 || fwrite(word, 1, word_len, fd) != (size_t) word_len || fwrite(refs, sizeof *refs, num_refs, fd) != num_refs) {
+		return 0;
+	}
+
+	hdr->num_words++;
+	hdr->num_refs += lengths[1];
+	hdr->num_chars += lengths[0];
+
+	return 1;
+}
+
+uint32_t* isr3_segment_reserve(uint32_t** buffer, uint32_t* size, uint32_t count) {
+	/* A scratch array for at least `count` ref IDs, reused from word to word. */
+	if (count > *size) {
+		uint32_t* output = realloc(*buffer, sizeof *output * count);
+
+		if (!output) {
+			isr3_err("malloc failure\n");
+			exit(1);
+		}
+
+		*buffer = output;
+		*size = count;
+	}
+
+	return *buffer;
+}
+
+int isr3_segment_file_close(FILE* fd, struct isr3_segment_header* hdr, const char* tmp_path, const char* path) {
+	memcpy(hdr->magic, ISR3_SEGMENT_MAGIC, sizeof hdr->magic);
+
+	int failed = fseek(fd, 0, SEEK_SET) || fwrite(hdr, sizeof *hdr, 1, fd) != 1;
+	failed = fclose(fd) || failed;
+
+	/* The segment only appears under its real name once it is complete. */
+	if (failed || rename(tmp_path, path)) {
+		isr3_errf("Failed to write segment [%s].\n", path);
+		unlink(tmp_path);
+		return 0;
+	}
+
+	return 1;
+}
+
+FILE* isr3_segment_file_read(const char* path, struct isr3_segment_header* hdr) {
+	FILE* fd = fopen(path, "rb");
+
+	if (!fd) {
+		isr3_errf("Failed to open segment [%s] for reading.\n", path);
+		return NULL;
+	}
+
+	if (fread(hdr, sizeof *hdr, 1, fd) != 1 || memcmp(hdr->magic, ISR3_SEGMENT_MAGIC, sizeof hdr->magic)) {
+		isr3_errf("[%s] is not a segment file.\n", path);
+		fclose(fd);
+		return NULL;
+	}
+
+	return fd;
+}
+
+int isr3_segment_file_next(FILE* fd, struct isr3_segment_record* rec) {
+	uint32_t lengths[2];
+
+	if (fread(lengths, sizeof *lengths, 2, fd) != 2 || !lengths[1]) {
+		return 0;
+	}
+
+	/* The buffers only ever grow, so a run of records costs a handful of allocations. */
+	if (lengths[0] + 1 > rec->max_word) {
+		char* word = realloc(rec->word, lengths[0] + 1);
+
+		if (!word) {
+			isr3_err("malloc failure\n");
+			exit(1);
+		}
+
+		rec->word = word;
+		rec->max_word = lengths[0] + 1;
+	}
+
+	isr3_segment_reserve(&rec->refs, &rec->max_refs, lengths[1]);
+
+	if (fread(rec->word, 1, lengths[0], fd) != lengths[0] || fread(rec->refs, sizeof *rec->refs, lengths[1], fd) != lengths[1]) {
+		return 0;
+	}
+
+	rec->word[lengths[0]] = 0;
+	rec->word_len = lengths[0];
+	rec->num_refs = lengths[1];
+
+	return 1;
+}
+
+char* isr3_segment_postings_path(const char* path) {
+	char* output = malloc(strlen(path) + 6);
+
+	if (!output) {
+		isr3_err("malloc failure\n");
+		exit(1);
+	}
+
+	sprintf(output, "%s.post", path);
+	return output;
+}
+
+const uint32_t* isr3_segment_postings(struct isr3_vocab* vocab, uint32_t word, uint32_t** buffer, uint32_t* size) {
+	/* Resident postings are used where they are, postings on disk are read into the buffer. */
+	if (!vocab->postings_starts) {
+		return vocab->postings + vocab->postings_offsets[word];
+	}
+
+	struct isr3_postings postings;
+	uint32_t* output = isr3_segment_reserve(buffer, size, isr3_vocab_doc_freq(vocab, word)), count = 0;
+	unsigned int ref_id;
+
+	isr3_vocab_postings(vocab, word, &postings);
+
+	while (isr3_postings_next(&postings, &ref_id)) {
+		output[count++] = ref_id;
+	}
+
+	return output;
+}
+
+char* isr3_segment_next_path(struct isr3_segment_set* set) {
+	char* output = malloc(strlen(set->dir) + 32);
+
+	if (!output) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	sprintf(output, "%s/seg-%06u.isr3", set->dir, set->next_file_id++);
+	pthread_mutex_unlock(&set->lock);
+
+	return output;
+}
+
+struct isr3_segment* isr3_segment_flush(struct isr3_segment_set* set, struct isr3_segment* seg) {
+	/* The segment is sealed, so its vocabulary doesn't change while isr3_segment_write() sorts and writes it. */
+	char* path = isr3_segment_next_path(set);
+
+	if (!path || !isr3_segment_write(seg, path)) {
+		free(path);
+		return NULL;
+	}
+
+	struct isr3_segment* output = isr3_segment_read(path, set->engine, set->pool);
+
+	if (!output) {
+		unlink(path);
+	}
+
+	free(path);
+	return output;
+}
+
+struct isr3_segment* isr3_segment_merge(struct isr3_segment_set* set, struct isr3_segment* first, struct isr3_segment* second) {
+	unsigned long start = isr3_stats_now();
+	struct isr3_perf_sample counters;
+	char* path = isr3_segment_next_path(set), *tmp_path = path ? malloc(strlen(path) + 5) : NULL;
+	struct isr3_segment_header hdr;
+	FILE* fd = NULL;
+
+	if (!tmp_path) {
+		free(path);
+		return NULL;
+	}
+
+	sprintf(tmp_path, "%s.tmp", path);
+	isr3_perf_begin(&counters);
+
+	if (!(fd = isr3_segment_file_open(tmp_path, &hdr))) {
+		free(path);
+		free(tmp_path);
+		return NULL;
+	}
+
+	hdr.num_docs = first->num_docs + second->num_docs;
+
+	/* Both vocabularies are loaded, so their IDs are in sorted order and this is the merge step of a mergesort. */
+	struct isr3_vocab* x = &first->vocab, *y = &second->vocab;
+	uint32_t a = 0, b = 0, *refs = NULL, max_refs = 0, *x_refs = NULL, max_x_refs = 0, *y_refs = NULL, max_y_refs = 0;
+	int result = 1;
+
+	while (result && (a < x->num_words || b < y->num_words)) {
+		int a_len = 0, b_len = 0;
+		char* a_word = a < x->num_words ? isr3_vocab_word(x, a, &a_len) : NULL, *b_word = b < y->num_words ? isr3_vocab_word(y, b, &b_len) : NULL;
+		int cmp = (a_word && b_word) ? word_cmp(a_word, a_len, b_word, b_len) : (a_word ? -1 : 1);
+
+		if (!cmp) {
+			/* The same word in both: merge the two ascending postings. */
+			const uint32_t* p = isr3_segment_postings(x, a, &x_refs, &max_x_refs), *p_end = p + isr3_vocab_doc_freq(x, a);
+			const uint32_t* q = isr3_segment_postings(y, b, &y_refs, &max_y_refs), *q_end = q + isr3_vocab_doc_freq(y, b);
+			uint32_t* cur = isr3_segment_reserve(&refs, &max_refs, (p_end - p) + (q_end - q)), num_refs = 0;
+
+			while (p < p_end || q < q_end) {
+				if (p < p_end && q < q_end && *p == *q) {
+					cur[num_refs++] = *p++;
+					++q;
+				} else if (q == q_end || (p < p_end && *p < *q)) {
+					cur[num_refs++] = *p++;
+				} else {
+					cur[num_refs++] = *q++;
+				}
+			}
+
+			result = isr3_segment_file_word(fd, &hdr, a_word, a_len, cur, num_refs);
+			++a;
+			++b;
+		} else if (cmp < 0) {
+			result = isr3_segment_file_word(fd, &hdr, a_word, a_len, isr3_segment_postings(x, a, &x_refs, &max_x_refs), isr3_vocab_doc_freq(x, a));
+			++a;
+		} else {
+			result = isr3_segment_file_word(fd, &hdr, b_word, b_len, isr3_segment_postings(y, b, &y_refs, &max_y_refs), isr3_vocab_doc_freq(y, b));
+			++b;
+		}
+	}
+
+	free(refs);
+	free(x_refs);
+	free(y_refs);
+
+	if (!result) {
+		isr3_errf("Failed to write segment [%s].\n", tmp_path);
+		fclose(fd);
+		unlink(tmp_path);
+		free(path);
+		free(tmp_path);
+		return NULL;
+	}
+
+	struct isr3_segment* output = NULL;
+	int written = isr3_segment_file_close(fd, &hdr, tmp_path, path);
+
+	isr3_perf_end(ISR3_PHASE_FLUSH, &counters);
+	isr3_stats_phase_end(ISR3_PHASE_FLUSH, start);
+
+	if (written && !(output = isr3_segment_read(path, set->engine, set->pool))) {
+		unlink(path);
+	}
+
+	free(path);
+	free(tmp_path);
+	return output;
+}
+
+void* isr3_segment_merger(void* arg) {
+	struct isr3_segment_set* set = arg;
+
+	pthread_mutex_lock(&set->lock);
+
+	while (!set->shutdown) {
+		struct isr3_segment* target = NULL, *other = NULL, *replacement = NULL, **cur = NULL;
+		int flushed = 0;
+
+		/* Flushing sealed in-memory segments always comes first, it is what frees memory. */
+		for (struct isr3_segment* seg = set->segments; seg; seg = seg->next) {
+			if (seg->sealed && !seg->path && !seg->disk) {
+				target = seg;
+				break;
+			}
+
+			if (seg->path) {
+				++flushed;
+			}
+		}
+
+		if (!target && flushed > ISR3_SEGMENT_MAX_FLUSHED) {
+			/* Merge the two smallest on-disk segments. */
+			for (struct isr3_segment* seg = set->segments; seg; seg = seg->next) {
+				if (!seg->path) {
+					continue;
+				}
+
+				if (!target || seg->vocab.num_words < target->vocab.num_words) {
+					other = target;
+					target = seg;
+				} else if (!other || seg->vocab.num_words < other->vocab.num_words) {
+					other = seg;
+				}
+			}
+		}
+
+		if (!target) {
+			pthread_cond_wait(&set->cond, &set->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&set->lock);
+
+		if (other) {
+			isr3_debugf("merging segments [%s] and [%s]\n", target->path, other->path);
+			replacement = isr3_segment_merge(set, target, other);
+		} else {
+			isr3_debug("flushing sealed segment\n");
+			replacement = isr3_segment_flush(set, target);
+		}
+
+		pthread_mutex_lock(&set->lock);
+
+		if (!replacement) {
+			isr3_err("Segment flush/merge failed, keeping the old segments.\n");
+			pthread_cond_wait(&set->cond, &set->lock); /* Don't spin on a persistent I/O error. */
+			continue;
+		}
+
+		/* Swap the replacement in where `target` was and unlink `other`. Readers holding a reference keep the old segments alive. */
+		for (cur = &set->segments; *cur; ) {
+			if (*cur == target) {
+				replacement->next = target->next;
+				*cur = replacement;
+				cur = &replacement->next;
+			} else if (*cur == other) {
+				*cur = other->next;
+			} else {
+				cur = &(*cur)->next;
+			}
+		}
+
+		pthread_mutex_unlock(&set->lock);
+
+		isr3_segment_release(target);
+
+		if (other) {
+			isr3_segment_release(other);
+		}
+
+		pthread_mutex_lock(&set->lock);
+	}
+
+	pthread_mutex_unlock(&set->lock);
+	return NULL;
+}
@@ -0,0 +1,116 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "isr3.h"
+#include "kgram.h"
+#include "fm.h"
+#include "disk.h"
+
+#define ISR3_SEGMENT_DOCS 64 /* Default number of documents an in-memory segment takes before it is sealed. */
+#define ISR3_SEGMENT_MAX_FLUSHED 4 /* The merger keeps merging on-disk segments until there are at most this many. */
+#define ISR3_SEGMENT_MAGIC "ISR3SEG1"
+
+/*
+ * A segment is an independent slice of the index: a vocabulary, its postings and a permuterm index over that vocabulary.
+ *
+ * New documents are always parsed into the single in-memory (active) segment. Once it holds enough documents it is sealed,
+ * and the background thread flushes it to an on-disk file and reloads it as a compact immutable segment.
+ * The same thread merges on-disk segments pairwise so the number of segments a query has to visit stays bounded.
+ *
+ * Every document belongs to exactly one segment, so a query simply runs against every segment with the same search IDs.
+ *
+ * Nobody takes a lock to search a segment: the active segment uses a concurrent (copy-on-write) permuterm index, postings
+ * are appended with release stores, and every other segment is immutable. The k-gram engine is the exception, its active
+ * segment takes a read-write lock (see kgram.h).
+ *
+ * The FM-index can't grow, so the FM engine only builds it for immutable (loaded) segments and indexes the active segment
+ * with k-grams until it's flushed.
+ *
+ * An index built out of core (see disk.h) joins the set as one more immutable segment, whatever the engine. Its postings
+ * and rotations stay on disk, and the merger leaves it alone.
+ */
+
+/* The wildcard index every segment of a set builds over its vocabulary. */
+enum isr3_engine {
+	ISR3_ENGINE_PERMUTERM,
+	ISR3_ENGINE_KGRAM,
+	ISR3_ENGINE_FM
+};
+
+struct isr3_segment {
+	isr3_tree_node* root; // Vocabulary hash tree, only present for in-memory segments.
+	struct isr3_vocab vocab; // Every word in the segment. Loaded segments number them in sorted order.
+	struct isr3_permuterm_index* index; // Exactly one of `index`, `kgram` and `fm` is set, depending on the engine.
+	struct isr3_kgram_index* kgram;
+	struct isr3_fm_index* fm;
+	struct isr3_disk_index* disk; // Instead of all three for an out-of-core index.
+
+	unsigned int num_docs;
+	int sealed, refcount;
+	char* path; // NULL until the segment has been flushed.
+
+	struct isr3_segment* next;
+};
+
+struct isr3_segment_set {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t merger;
+
+	struct isr3_segment* active, *segments; // `active` is also part of the `segments` list.
+	unsigned int segment_docs, published; // `published` counts the documents which are completely searchable.
+	unsigned long version; // Bumped whenever the searchable contents change, for result caches.
+	unsigned int next_file_id;
+	enum isr3_engine engine;
+	struct isr3_buffer_pool* pool; // Loaded segments read their postings from disk through this, if set (see vocab.h).
+	int shutdown;
+
+	char* dir;
+};
+
+struct isr3_segment_set* isr3_segment_set_create(const char* dir, unsigned int segment_docs, enum isr3_engine engine, struct isr3_buffer_pool* pool);
+void isr3_segment_set_free(struct isr3_segment_set* set);
+
+int isr3_segment_set_add_file(struct isr3_segment_set* set, const char* filename, unsigned int ref_id);
+int isr3_segment_set_add_index(struct isr3_segment_set* set, const char* dir); /* Opens the out-of-core index built in `dir`, see disk.h. Its documents come first. */
+void isr3_segment_set_search(struct isr3_segment_set* set, char* query, int query_len, int wildcard_count, int* search_id, void (*callback)(struct isr3_vocab* vocab, uint32_t word, int search_id));
+unsigned int isr3_segment_set_published(struct isr3_segment_set* set);
+unsigned long isr3_segment_set_version(struct isr3_segment_set* set, unsigned int* published); /* The current version and, optionally, the published count of that version. */
+void isr3_segment_set_shape(struct isr3_segment_set* set, unsigned long* nodes, unsigned long* keys, int* height); /* Permuterm B-tree totals over all segments, height is the tallest. Zero for the k-gram engine. */
+
+int isr3_segment_write(struct isr3_segment* seg, const char* path);
+struct isr3_segment* isr3_segment_read(const char* path, enum isr3_engine engine, struct isr3_buffer_pool* pool); /* With a pool, the postings stay on disk. */
+
+/*
+ * On-disk segment format (native byte order, all integers are uint32_t):
+ *
+ *  header : magic[8] num_words num_refs num_docs num_chars
+ *  words  : word_len ref_count word[word_len] ref_id[ref_count]   (repeated num_words times, sorted by word_cmp)
+ *
+ * The header is written last, once the counts are known. Segment files can also be written and read one word at a time,
+ * which is how out-of-core builds (see disk.h) use them as sorted runs.
+ */
+
+struct isr3_segment_header {
+	char magic[8];
+	uint32_t num_words, num_refs, num_docs, num_chars;
+};
+
+/* One word read back from a segment file. The buffers are reused (and grown) from word to word, free() them when done. */
+struct isr3_segment_record {
+	char* word; // NUL-terminated.
+	uint32_t word_len, num_refs;
+	uint32_t* refs;
+	uint32_t max_word, max_refs;
+};
+
+FILE* isr3_segment_file_open(const char* path, struct isr3_segment_header* hdr); /* Starts writing a segment, the caller sets `num_docs`. */
+int isr3_segment_file_word(FILE* fd, struct isr3_segment_header* hdr, char* word, int word_len, const uint32_t* refs, uint32_t num_refs);
+int isr3_segment_file_close(FILE* fd, struct isr3_segment_header* hdr, const char* tmp_path, const char* path); /* Writes the header and renames the file into place. */
+FILE* isr3_segment_file_read(const char* path, struct isr3_segment_header* hdr); /* Opens a segment and reads its header, NULL if it isn't one. */
+int isr3_segment_file_next(FILE* fd, struct isr3_segment_record* rec); /* The next of the header's `num_words` words, 0 if the file is truncated. */
+
+#endif
@@ -0,0 +1,272 @@
+#include "shard.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static int isr3_shard_add(struct isr3_shard_set* set, int fd, pid_t pid); /* Takes over `fd`, 0 on failure. */
+static int isr3_shard_read(struct isr3_shard* shard, unsigned long* value); /* 1 for a number, 0 for the empty line, -1 if the shard is lost. */
+static int isr3_shard_write(struct isr3_shard* shard, const char* data, size_t len);
+
+void isr3_shard_range(int num_shards, int num_files, int shard, int* first, int* count) {
+	*first = (long) shard * num_files / num_shards;
+	*count = (long) (shard + 1) * num_files / num_shards - *first;
+}
+
+int isr3_shard_fork(struct isr3_shard_set* set, int num_shards, int* shard) {
+	memset(set, 0, sizeof *set);
+
+	/* Anything still buffered would be written by every shard as well. */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 0; i < num_shards; ++i) {
+		int fds[2];
+		pid_t pid;
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+			isr3_err("Failed to create a shard socket.\n");
+			isr3_shard_set_free(set);
+			return -1;
+		}
+
+		if ((pid = fork()) < 0) {
+			isr3_err("Failed to fork a shard.\n");
+			close(fds[0]);
+			close(fds[1]);
+			isr3_shard_set_free(set);
+			return -1;
+		}
+
+		if (!pid) {
+			/* The shards forked before us have to see the coordinator go away, so we can't hold on to their sockets. */
+			for (int k = 0; k < set->num_shards; ++k) {
+				fclose(set->shards[k].in);
+			}
+
+			free(set->shards);
+			memset(set, 0, sizeof *set);
+			close(fds[0]);
+
+			if (dup2(fds[1], STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0) {
+				isr3_errf("Failed to connect shard %d to the coordinator.\n", i);
+				exit(1);
+			}
+
+			close(fds[1]);
+			*shard = i;
+
+			return 0;
+		}
+
+		close(fds[1]);
+
+		if (!isr3_shard_add(set, fds[0], pid)) {
+			isr3_shard_set_free(set);
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+int isr3_shard_serve(const char* path) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0), conn = -1;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		isr3_errf("Socket path [%s] is too long.\n", path);
+		close(fd);
+		return 0;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof addr)) {
+		isr3_errf("Failed to listen on [%s].\n", path);
+		close(fd);
+		return 0;
+	}
+
+	if (!listen(fd, 1)) {
+		isr3_debugf("waiting for a coordinator on %s\n", path);
+		conn = accept(fd, NULL, NULL);
+	}
+
+	/* A shard has exactly one coordinator, so nobody else needs to find the socket. */
+	close(fd);
+	unlink(path);
+
+	if (conn < 0 || dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0) {
+		isr3_errf("Failed to accept a coordinator on [%s].\n", path);
+		close(conn);
+		return 0;
+	}
+
+	close(conn);
+	return 1;
+}
+
+int isr3_shard_connect(struct isr3_shard_set* set, const char* path) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		isr3_errf("Socket path [%s] is too long.\n", path);
+		close(fd);
+		return 0;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof addr)) {
+		isr3_errf("Failed to connect to the shard on [%s].\n", path);
+		close(fd);
+		return 0;
+	}
+
+	return isr3_shard_add(set, fd, 0);
+}
+
+int isr3_shard_set_start(struct isr3_shard_set* set) {
+	set->num_docs = 0;
+
+	for (int i = 0; i < set->num_shards; ++i) {
+		struct isr3_shard* cur = set->shards + i;
+		unsigned long num_docs = 0;
+
+		if (isr3_shard_read(cur, &num_docs) <= 0 || num_docs > UINT32_MAX - set->num_docs) {
+			isr3_errf("Shard %d failed to start.\n", i);
+			return 0;
+		}
+
+		cur->first = set->num_docs;
+		cur->num_docs = num_docs;
+		set->num_docs += num_docs;
+	}
+
+	return 1;
+}
+
+int isr3_shard_set_query(struct isr3_shard_set* set, const char* query, unsigned int* result, unsigned int* num_results) {
+	size_t len = strlen(query);
+
+	*num_results = 0;
+
+	/* Scatter the query before gathering anything, so every shard works on it at once. */
+	for (int i = 0; i < set->num_shards; ++i) {
+		if (!isr3_shard_write(set->shards + i, query, len)) {
+			isr3_errf("Lost shard %d.\n", i);
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < set->num_shards; ++i) {
+		struct isr3_shard* cur = set->shards + i;
+		unsigned long ref_id = 0;
+		unsigned int count = 0;
+		int read;
+
+		while ((read = isr3_shard_read(cur, &ref_id)) > 0) {
+			if (ref_id >= cur->num_docs || count++ == cur->num_docs) {
+				read = -1;
+				break;
+			}
+
+			result[(*num_results)++] = cur->first + ref_id;
+		}
+
+		if (read < 0) {
+			isr3_errf("Lost shard %d.\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void isr3_shard_set_free(struct isr3_shard_set* set) {
+	/* A shard stops once its socket is closed, like the program does at the end of its input. */
+	for (int i = 0; i < set->num_shards; ++i) {
+		fclose(set->shards[i].in);
+	}
+
+	for (int i = 0; i < set->num_shards; ++i) {
+		if (set->shards[i].pid) {
+			waitpid(set->shards[i].pid, NULL, 0);
+		}
+	}
+
+	free(set->shards);
+	memset(set, 0, sizeof *set);
+}
+
+int isr3_shard_add(struct isr3_shard_set* set, int fd, pid_t pid) {
+	struct isr3_shard* shards = realloc(set->shards, sizeof *shards * (set->num_shards + 1));
+	FILE* in = shards ? fdopen(fd, "r") : NULL;
+
+	if (shards) {
+		set->shards = shards;
+	}
+
+	if (!in) {
+		isr3_err("malloc failure\n");
+		close(fd);
+
+		if (pid) {
+			waitpid(pid, NULL, 0); /* Sees its socket closed and stops. */
+		}
+
+		return 0;
+	}
+
+	shards[set->num_shards].fd = fd;
+	shards[set->num_shards].in = in;
+	shards[set->num_shards].pid = pid;
+	shards[set->num_shards].first = shards[set->num_shards].num_docs = 0;
+	set->num_shards++;
+
+	return 1;
+}
+
+int isr3_shard_read(struct isr3_shard* shard, unsigned long* value) {
+	char line[32], *end;
+
+	if (!fgets(line, sizeof line, shard->in)) {
+		return -1;
+	}
+
+	if (line[0] == '\n') {
+		return 0;
+	}
+
+	*value = strtoul(line, &end, 10);
+	return end != line && *end == '\n' ? 1 : -1;
+}
+
+int isr3_shard_write(struct isr3_shard* shard, const char* data, size_t len) {
+	/* MSG_NOSIGNAL: a shard which died is reported, not a SIGPIPE. */
+	while (len) {
+		ssize_t sent = send(shard->fd, data, len, MSG_NOSIGNAL);
+
+		if (sent <= 0) {
+			return 0;
+		}
+
+		data += sent;
+		len -= sent;
+	}
+
+	return 1;
+}
@@ -0,0 +1,52 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Document-partitioned shards (`--shards`, `--serve` and `--connect`).
+ *
+ * Every shard is an ordinary index process over a contiguous range of the files, so its ref IDs are shard-local: the
+ * shard's first file is ref ID 0. A coordinator holds no index at all. It sends every query line to all of its shards
+ * before it reads any answer, so the shards search in parallel, and then gathers the answers in shard order. Adding the
+ * first global ref ID of each shard to its local IDs maps them back to the file names, and since the ranges are in order
+ * the concatenated answers are still ascending.
+ *
+ * `--shards N` forks N shards of the coordinator's files, each talking to it over a socket pair. `--serve PATH` turns
+ * a process into a shard which waits for a coordinator on a Unix socket before it indexes its files, and `--connect PATH`
+ * (repeated, in file order) makes a coordinator of shards served that way, which may as well use different options.
+ *
+ * The protocol is line based. A shard sends its number of documents once it is searchable, then answers every query
+ * line with its matching local ref IDs, one per line, and an empty line. The coordinator closing the socket ends the
+ * shard.
+ */
+
+struct isr3_shard {
+	int fd;
+	FILE* in; // Answers from the shard, read through `fd`.
+	pid_t pid; // 0 unless we forked the shard.
+	unsigned int first, num_docs; // Global ref ID of the shard's first document.
+};
+
+struct isr3_shard_set {
+	struct isr3_shard* shards;
+	int num_shards;
+	unsigned int num_docs;
+};
+
+void isr3_shard_range(int num_shards, int num_files, int shard, int* first, int* count); /* The files of one of `num_shards` forked shards. */
+
+/*
+ * Forks `num_shards` shards. Returns 1 in the coordinator, which gets them in `set`, and 0 in each shard, which gets its
+ * index in `shard` and the coordinator on stdin and stdout. -1 on failure, leaving no shard behind.
+ */
+int isr3_shard_fork(struct isr3_shard_set* set, int num_shards, int* shard);
+int isr3_shard_serve(const char* path); /* Waits for a coordinator on `path` and puts it on stdin and stdout, 0 on failure. */
+int isr3_shard_connect(struct isr3_shard_set* set, const char* path); /* Adds a served shard, 0 on failure. */
+
+int isr3_shard_set_start(struct isr3_shard_set* set); /* Waits until every shard is searchable and numbers their documents, 0 on failure. */
+int isr3_shard_set_query(struct isr3_shard_set* set, const char* query, unsigned int* result, unsigned int* num_results); /* Global ref IDs in `result` (room for all documents), 0 if a shard is lost. */
+void isr3_shard_set_free(struct isr3_shard_set* set); /* Ends the shards, and waits for the forked ones. */
+
+#endif
@@ -0,0 +1,208 @@
+#include "sort.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Multikey quicksort (Bentley & Sedgewick) over an array of items.
+ * Each pass partitions on a single character, so no prefix is ever compared twice and the array is scanned sequentially.
+ *
+ * Large inputs first get a single MSD radix pass on the leading byte, and the resulting buckets are sorted by a small pool
+ * of threads (largest bucket first).
+ */
+
+struct isr3_sort_job {
+	struct isr3_sort_item* items;
+	size_t bucket_start[258];
+	int order[257], next;
+};
+
+static int isr3_sort_char(const struct isr3_sort_item* item, int depth);
+static void isr3_sort_swap(struct isr3_sort_item* items, size_t a, size_t b);
+static void isr3_sort_insertion(struct isr3_sort_item* items, size_t count, int depth);
+static void isr3_sort_mkqs(struct isr3_sort_item* items, size_t count, int depth);
+static void isr3_sort_parallel(struct isr3_sort_item* items, size_t count);
+static void* isr3_sort_worker(void* arg);
+
+void isr3_sort_items(struct isr3_sort_item* items, size_t count) {
+	if (count >= ISR3_SORT_PARALLEL_MIN && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		isr3_sort_parallel(items, count);
+	} else {
+		isr3_sort_mkqs(items, count, 0);
+	}
+}
+
+int isr3_sort_char(const struct isr3_sort_item* item, int depth) {
+	/* 0 marks the end of the string, so shorter strings sort before anything they are a prefix of. */
+	return depth < item->len ? (unsigned char) item->str[depth] + 1 : 0;
+}
+
+void isr3_sort_swap(struct isr3_sort_item* items, size_t a, size_t b) {
+	struct isr3_sort_item tmp = items[a];
+
+	items[a] = items[b];
+	items[b] = tmp;
+}
+
+void isr3_sort_insertion(struct isr3_sort_item* items, size_t count, int depth) {
+	/* Everything in here already shares the first `depth` characters. */
+	for (size_t i = 1; i < count; ++i) {
+		struct isr3_sort_item cur = items[i];
+		size_t j = i;
+
+		while (j > 0) {
+			const struct isr3_sort_item* prev = items + j - 1;
+			int min_length = (prev->len < cur.len ? prev->len : cur.len) - depth;
+			int result = min_length > 0 ? memcmp(prev->str + depth, cur.str + depth, min_length) : 0;
+
+			if (result < 0 || (!result && prev->len <= cur.len)) {
+				break;
+			}
+
+			items[j] = items[j - 1];
+			--j;
+		}
+
+		items[j] = cur;
+	}
+}
+
+void isr3_sort_mkqs(struct isr3_sort_item* items, size_t count, int depth) {
+	while (count > ISR3_SORT_INSERTION_MAX) {
+		/* Median of three for the pivot character. */
+		int a = isr3_sort_char(items, depth), b = isr3_sort_char(items + count / 2, depth), c = isr3_sort_char(items + count - 1, depth);
+		int pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+
+		/* Three-way partition: [0, lt) < pivot, [lt, gt) == pivot, [gt, count) > pivot. */
+		size_t lt = 0, i = 0, gt = count;
+
+		while (i < gt) {
+			int cur = isr3_sort_char(items + i, depth);
+
+			if (cur < pivot) {
+				isr3_sort_swap(items, lt++, i++);
+			} else if (cur > pivot) {
+				isr3_sort_swap(items, i, --gt);
+			} else {
+				++i;
+			}
+		}
+
+		/* If the pivot was the end of the string, the middle partition is a run of equal strings and needs no more work. */
+		struct { struct isr3_sort_item* items; size_t count; int depth; } parts[3] = {
+			{items, lt, depth},
+			{items + lt, pivot ? gt - lt : 0, depth + 1},
+			{items + gt, count - gt, depth},
+		};
+
+		/* Recurse into the two smaller parts and loop on the largest one, which keeps the stack depth logarithmic. */
+		int largest = 0;
+
+		for (int j = 1; j < 3; ++j) {
+			if (parts[j].count > parts[largest].count) {
+				largest = j;
+			}
+		}
+
+		for (int j = 0; j < 3; ++j) {
+			if (j != largest && parts[j].count > 1) {
+				isr3_sort_mkqs(parts[j].items, parts[j].count, parts[j].depth);
+			}
+		}
+
+		items = parts[largest].items;
+		count = parts[largest].count;
+		depth = parts[largest].depth;
+	}
+
+	if (count > 1) {
+		isr3_sort_insertion(items, count, depth);
+	}
+}
+
+void isr3_sort_parallel(struct isr3_sort_item* items, size_t count) {
+	struct isr3_sort_item* tmp = malloc(sizeof *tmp * count);
+	struct isr3_sort_job job;
+
+	if (!tmp) {
+		/* Not worth failing over -- the sequential sort works in place. */
+		isr3_sort_mkqs(items, count, 0);
+		return;
+	}
+
+	/* One counting sort pass on the first character splits the input into independent buckets. */
+	size_t counts[257] = {0}, offsets[257];
+
+	for (size_t i = 0; i < count; ++i) {
+		counts[isr3_sort_char(items + i, 0)]++;
+	}
+
+	job.bucket_start[0] = 0;
+
+	for (int i = 0; i < 257; ++i) {
+		offsets[i] = job.bucket_start[i];
+		job.bucket_start[i + 1] = job.bucket_start[i] + counts[i];
+		job.order[i] = i;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		tmp[offsets[isr3_sort_char(items + i, 0)]++] = items[i];
+	}
+
+	memcpy(items, tmp, sizeof *items * count);
+	free(tmp);
+
+	/* Hand out the largest buckets first so one big bucket doesn't end up last on a single thread. */
+	for (int i = 1; i < 257; ++i) {
+		int cur = job.order[i], j = i;
+
+		while (j > 0 && counts[job.order[j - 1]] < counts[cur]) {
+			job.order[j] = job.order[j - 1];
+			--j;
+		}
+
+		job.order[j] = cur;
+	}
+
+	job.items = items;
+	job.next = 0;
+
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t* threads = malloc(sizeof *threads * num_threads);
+	int started = 0;
+
+	for (long i = 1; threads && i < num_threads; ++i) {
+		if (!pthread_create(threads + started, NULL, isr3_sort_worker, &job)) {
+			++started;
+		}
+	}
+
+	isr3_debugf("sorting %zu items with %d extra threads\n", count, started);
+	isr3_sort_worker(&job); /* The calling thread helps out too. */
+
+	for (int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+}
+
+void* isr3_sort_worker(void* arg) {
+	struct isr3_sort_job* job = arg;
+	int cur;
+
+	while ((cur = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < 257) {
+		int bucket = job->order[cur];
+
+		/* Bucket 0 holds empty strings, which are all equal already. */
+		if (bucket) {
+			isr3_sort_mkqs(job->items + job->bucket_start[bucket], job->bucket_start[bucket + 1] - job->bucket_start[bucket], 1);
+		}
+	}
+
+	return NULL;
+}
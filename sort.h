@@ -0,0 +1,23 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ISR3_SORT_PARALLEL_MIN 65536 /* Inputs smaller than this are sorted on the calling thread. */
+#define ISR3_SORT_INSERTION_MAX 16 /* Partitions this small are finished off with an insertion sort. */
+
+/*
+ * A string to be sorted, with the ID of the word it belongs to.
+ * Items are ordered like word_cmp(): bytewise, with a proper prefix sorting first.
+ */
+
+struct isr3_sort_item {
+	const char* str;
+	int len;
+	uint32_t id;
+};
+
+void isr3_sort_items(struct isr3_sort_item* items, size_t count);
+
+#endif
@@ -0,0 +1,58 @@
+#include "stats.h"
+
+#include <time.h>
+
+int isr3_stats_enabled = 0;
+struct isr3_stats isr3_stats;
+
+const char* isr3_phase_names[ISR3_PHASE_COUNT] = {"parse", "stem", "insert", "sort", "permuterm", "btree", "flush", "query"};
+
+unsigned long isr3_stats_now(void) {
+	struct timespec ts;
+
+	if (!isr3_stats_enabled) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+void isr3_stats_snapshot(struct isr3_stats* out) {
+	/* Field by field, so a snapshot taken while other threads record is never torn within a counter. */
+	unsigned long* dst = (unsigned long*) out, *src = (unsigned long*) &isr3_stats;
+
+	for (size_t i = 0; i < sizeof *out / sizeof *dst; ++i) {
+		dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+	}
+}
+
+void isr3_stats_dump(FILE* fd, unsigned long btree_nodes, unsigned long btree_keys, int btree_height) {
+	struct isr3_stats cur;
+	isr3_stats_snapshot(&cur);
+
+	for (int i = 0; i < ISR3_PHASE_COUNT; ++i) {
+		fprintf(fd, "isr3-stats phase=%s seconds=%.6f\n", isr3_phase_names[i], cur.phase_ns[i] * 1e-9);
+	}
+
+	fprintf(fd, "isr3-stats files=%lu tokens=%lu unique_words=%lu\n", cur.files, cur.tokens, cur.unique_words);
+	fprintf(fd, "isr3-stats btree_nodes=%lu btree_keys=%lu btree_height=%d splits=%lu insert_comparisons=%lu\n",
+			btree_nodes, btree_keys, btree_height, cur.splits, cur.insert_comparisons);
+	fprintf(fd, "isr3-stats queries=%lu searches=%lu search_comparisons=%lu comparisons_per_search=%.2f callbacks=%lu postings=%lu lookups=%lu\n",
+			cur.queries, cur.searches, cur.search_comparisons, cur.searches ? (double) cur.search_comparisons / cur.searches : 0.0,
+			cur.callbacks, cur.postings, cur.lookups);
+	fprintf(fd, "isr3-stats page_hits=%lu page_misses=%lu page_hit_rate=%.3f page_evictions=%lu page_bypasses=%lu\n",
+			cur.page_hits, cur.page_misses, cur.page_hits + cur.page_misses ? (double) cur.page_hits / (cur.page_hits + cur.page_misses) : 0.0,
+			cur.page_evictions, cur.page_bypasses);
+}
+
+void isr3_stats_dump_query(FILE* fd, unsigned long query_id, struct isr3_stats* before, unsigned long matches) {
+	struct isr3_stats cur;
+	isr3_stats_snapshot(&cur);
+
+	fprintf(fd, "isr3-stats query=%lu seconds=%.6f searches=%lu search_comparisons=%lu callbacks=%lu postings=%lu lookups=%lu page_hits=%lu page_misses=%lu matches=%lu\n",
+			query_id, (cur.phase_ns[ISR3_PHASE_QUERY] - before->phase_ns[ISR3_PHASE_QUERY]) * 1e-9,
+			cur.searches - before->searches, cur.search_comparisons - before->search_comparisons,
+			cur.callbacks - before->callbacks, cur.postings - before->postings, cur.lookups - before->lookups,
+			cur.page_hits - before->page_hits, cur.page_misses - before->page_misses, matches);
+}
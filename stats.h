@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+ * Runtime statistics: phase timers and hot-path counters.
+ *
+ * Everything is always compiled in but only recorded while `isr3_stats_enabled` is set (`--stats`), so the hot paths pay a
+ * single predictable branch otherwise. Counters are updated with relaxed atomic adds because the ingest, merger and sort
+ * threads all record into the same totals; phase times are summed over every thread which ran the phase.
+ */
+
+enum isr3_phase {
+	ISR3_PHASE_PARSE, // Tokenizing, i.e. parse_file() minus stemming and vocabulary inserts.
+	ISR3_PHASE_STEM,
+	ISR3_PHASE_INSERT, // Vocabulary (hash tree) inserts.
+	ISR3_PHASE_SORT,
+	ISR3_PHASE_PERMUTERM, // Generating rotations, i.e. gen_permuterm() minus the B-tree inserts.
+	ISR3_PHASE_BTREE,
+	ISR3_PHASE_FLUSH, // Writing sealed segments and merging on-disk segments (their B-tree builds are counted in BTREE).
+	ISR3_PHASE_QUERY,
+	ISR3_PHASE_COUNT
+};
+
+struct isr3_stats {
+	unsigned long phase_ns[ISR3_PHASE_COUNT];
+
+	unsigned long tokens, unique_words, files;
+	unsigned long splits, insert_comparisons;
+	unsigned long queries, searches, search_comparisons, callbacks, postings, lookups; // lookups: exact terms found through the vocabulary.
+	unsigned long page_hits, page_misses, page_evictions, page_bypasses; // Postings pages read through the buffer pool, see bufpool.h.
+};
+
+extern int isr3_stats_enabled;
+extern struct isr3_stats isr3_stats;
+
+#define isr3_stats_add(field, n) do { if (isr3_stats_enabled) __atomic_add_fetch(&isr3_stats.field, (n), __ATOMIC_RELAXED); } while (0)
+#define isr3_stats_phase_end(phase, start) isr3_stats_add(phase_ns[phase], isr3_stats_now() - (start))
+
+unsigned long isr3_stats_now(void); /* Monotonic nanoseconds, 0 while stats are disabled. */
+void isr3_stats_snapshot(struct isr3_stats* out);
+
+/*
+ * Reports are plain `isr3-stats key=value ..` lines, one record per line, so they can be grepped or split without a parser.
+ * The B-tree shape isn't tracked by counters, callers pass in what they measured.
+ */
+
+void isr3_stats_dump(FILE* fd, unsigned long btree_nodes, unsigned long btree_keys, int btree_height);
+void isr3_stats_dump_query(FILE* fd, unsigned long query_id, struct isr3_stats* before, unsigned long matches);
+
+extern const char* isr3_phase_names[ISR3_PHASE_COUNT];
+
+#endif
@@ -0,0 +1,395 @@
+#include "vocab.h"
+#include "isr3.h"
+#include "mem.h"
+#include "perf.h"
+#include "sort.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ISR3_VOCAB_WORD_BYTES (sizeof(struct isr3_vocab_chunk) / ISR3_VOCAB_CHUNK) /* Column bytes per in-memory word. */
+
+static struct isr3_vocab_chunk* isr3_vocab_chunk(struct isr3_vocab* vocab, uint32_t word, uint32_t* slot);
+static void isr3_vocab_grow(struct isr3_vocab* vocab);
+static void isr3_postings_read(struct isr3_postings* cursor);
+
+void isr3_vocab_init(struct isr3_vocab* vocab) {
+	memset(vocab, 0, sizeof *vocab);
+}
+
+int isr3_vocab_load(struct isr3_vocab* vocab, uint32_t num_words, uint32_t num_postings, uint32_t num_chars) {
+	memset(vocab, 0, sizeof *vocab);
+
+	vocab->loaded = 1;
+	vocab->num_words = num_words;
+	vocab->num_postings = num_postings;
+	vocab->num_chars = num_chars;
+
+	/* The three word columns count as one structure per word, the strings and postings as theirs. */
+	vocab->offsets = isr3_mem_alloc(ISR3_MEM_VOCAB, sizeof *vocab->offsets * num_words + 1, num_words);
+	vocab->lengths = isr3_mem_alloc(ISR3_MEM_VOCAB, sizeof *vocab->lengths * num_words + 1, 0);
+	vocab->postings_offsets = isr3_mem_alloc(ISR3_MEM_VOCAB, sizeof *vocab->postings_offsets * (num_words + 1), 0);
+	vocab->postings = isr3_mem_alloc(ISR3_MEM_REF_ENTRY, sizeof *vocab->postings * num_postings + 1, num_postings);
+	vocab->strings = isr3_mem_alloc(ISR3_MEM_WORD_STRING, num_chars + num_words + 1, num_words);
+
+	return vocab->offsets && vocab->lengths && vocab->postings_offsets && vocab->postings && vocab->strings;
+}
+
+int isr3_vocab_load_words(struct isr3_vocab* vocab, uint32_t num_words, uint32_t num_chars, int postings_fd, struct isr3_buffer_pool* pool) {
+	memset(vocab, 0, sizeof *vocab);
+
+	vocab->loaded = 1;
+	vocab->num_words = num_words;
+	vocab->num_chars = num_chars;
+	vocab->postings_fd = postings_fd;
+	vocab->pool = pool;
+
+	vocab->offsets = isr3_mem_alloc(ISR3_MEM_VOCAB, sizeof *vocab->offsets * num_words + 1, num_words);
+	vocab->lengths = isr3_mem_alloc(ISR3_MEM_VOCAB, sizeof *vocab->lengths * num_words + 1, 0);
+	vocab->postings_starts = isr3_mem_alloc(ISR3_MEM_VOCAB, sizeof *vocab->postings_starts * (num_words + 1), 0);
+	vocab->strings = isr3_mem_alloc(ISR3_MEM_WORD_STRING, num_chars + num_words + 1, num_words);
+
+	return vocab->offsets && vocab->lengths && vocab->postings_starts && vocab->strings;
+}
+
+void isr3_vocab_destroy(struct isr3_vocab* vocab) {
+	if (vocab->loaded) {
+		if (vocab->postings_starts) {
+			isr3_mem_free(ISR3_MEM_VOCAB, vocab->postings_starts, sizeof *vocab->postings_starts * (vocab->num_words + 1), 0);
+		} else {
+			isr3_mem_free(ISR3_MEM_VOCAB, vocab->postings_offsets, sizeof *vocab->postings_offsets * (vocab->num_words + 1), 0);
+			isr3_mem_free(ISR3_MEM_REF_ENTRY, vocab->postings, sizeof *vocab->postings * vocab->num_postings + 1, vocab->num_postings);
+		}
+
+		isr3_mem_free(ISR3_MEM_VOCAB, vocab->offsets, sizeof *vocab->offsets * vocab->num_words + 1, vocab->num_words);
+		isr3_mem_free(ISR3_MEM_VOCAB, vocab->lengths, sizeof *vocab->lengths * vocab->num_words + 1, 0);
+		isr3_mem_free(ISR3_MEM_WORD_STRING, vocab->strings, vocab->num_chars + vocab->num_words + 1, vocab->num_words);
+
+		memset(vocab, 0, sizeof *vocab);
+		return;
+	}
+
+	for (uint32_t word = 0; word < vocab->num_words; ++word) {
+		uint32_t slot;
+		struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, word, &slot);
+		isr3_ref_entry* cur_ref = chunk->heads[slot], *tmp_ref = NULL;
+
+		while (cur_ref) {
+			tmp_ref = cur_ref->next;
+			isr3_mem_free(ISR3_MEM_REF_ENTRY, cur_ref, sizeof *cur_ref, 1);
+			cur_ref = tmp_ref;
+		}
+
+		isr3_mem_free(ISR3_MEM_WORD_STRING, chunk->words[slot], chunk->lengths[slot] + 1, 1);
+	}
+
+	for (uint32_t i = 0; i < vocab->num_chunks; ++i) {
+		isr3_mem_free(ISR3_MEM_VOCAB, vocab->chunks[i], 0, 0);
+	}
+
+	for (int i = 0; i < vocab->num_old_chunks; ++i) {
+		isr3_mem_free(ISR3_MEM_VOCAB, vocab->old_chunks[i], 0, 0);
+	}
+
+	isr3_mem_free(ISR3_MEM_VOCAB, vocab->chunks, 0, 0);
+	isr3_mem_use(ISR3_MEM_VOCAB, -(long) (vocab->num_words * ISR3_VOCAB_WORD_BYTES), -(long) vocab->num_words);
+
+	free(vocab->old_chunks);
+	memset(vocab, 0, sizeof *vocab);
+}
+
+uint32_t isr3_vocab_add(struct isr3_vocab* vocab, char* word, int word_len, isr3_ref_entry* ref) {
+	if (vocab->num_words == ISR3_VOCAB_NONE) {
+		isr3_err("vocabulary is out of word IDs\n");
+		exit(1);
+	}
+
+	if ((vocab->num_words >> ISR3_VOCAB_CHUNK_SHIFT) == vocab->num_chunks) {
+		isr3_vocab_grow(vocab);
+	}
+
+	uint32_t output = vocab->num_words++, slot;
+	struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, output, &slot);
+
+	/* The caller publishes the ID (with a release store) only after this, so readers see complete columns. */
+	chunk->words[slot] = word;
+	chunk->lengths[slot] = word_len;
+	chunk->heads[slot] = chunk->tails[slot] = ref;
+	chunk->chains[slot] = ISR3_VOCAB_NONE;
+	chunk->doc_freqs[slot] = 1;
+
+	isr3_mem_track(ISR3_MEM_WORD_STRING, word, word_len + 1, 1); /* The tokenizer's buffer becomes the word's string. */
+	isr3_mem_use(ISR3_MEM_VOCAB, ISR3_VOCAB_WORD_BYTES, 1);
+
+	return output;
+}
+
+void isr3_vocab_append(struct isr3_vocab* vocab, uint32_t word, isr3_ref_entry* ref) {
+	uint32_t slot;
+	struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, word, &slot);
+
+	/* Queries may be walking this list right now, so the new entry has to be complete before it is linked. */
+	ref->next = NULL;
+	__atomic_store_n(&chunk->tails[slot]->next, ref, __ATOMIC_RELEASE);
+
+	chunk->tails[slot] = ref;
+	chunk->doc_freqs[slot]++;
+}
+
+uint32_t* isr3_vocab_chain(struct isr3_vocab* vocab, uint32_t word) {
+	uint32_t slot;
+	struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, word, &slot);
+
+	return chunk->chains + slot;
+}
+
+char* isr3_vocab_word(struct isr3_vocab* vocab, uint32_t word, int* word_len) {
+	if (vocab->loaded) {
+		*word_len = vocab->lengths[word];
+		return vocab->strings + vocab->offsets[word];
+	}
+
+	uint32_t slot;
+	struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, word, &slot);
+
+	*word_len = chunk->lengths[slot];
+	return chunk->words[slot];
+}
+
+uint32_t isr3_vocab_doc_freq(struct isr3_vocab* vocab, uint32_t word) {
+	if (vocab->postings_starts) {
+		return vocab->postings_starts[word + 1] - vocab->postings_starts[word];
+	}
+
+	if (vocab->loaded) {
+		return vocab->postings_offsets[word + 1] - vocab->postings_offsets[word];
+	}
+
+	uint32_t slot;
+	struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, word, &slot);
+
+	return chunk->doc_freqs[slot];
+}
+
+uint32_t isr3_vocab_find(struct isr3_vocab* vocab, char* word, int word_len) {
+	/* Loaded words are numbered in sorted order, so this is a binary search over the IDs. */
+	uint32_t low = 0, high = vocab->num_words;
+
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		int cmp = word_cmp(vocab->strings + vocab->offsets[mid], vocab->lengths[mid], word, word_len);
+
+		if (!cmp) {
+			return mid;
+		} else if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return ISR3_VOCAB_NONE;
+}
+
+uint32_t* isr3_vocab_sort(struct isr3_vocab* vocab) {
+	/* The strings and lengths are copied out of the columns into one array, sorted there (see sort.c) and read back as IDs. */
+	uint32_t* output = malloc(sizeof *output * vocab->num_words + 1);
+
+	if (!output) {
+		isr3_err("malloc() failed. System may be out of RAM!\n");
+		exit(1);
+	}
+
+	if (vocab->loaded || vocab->num_words < 2) {
+		for (uint32_t word = 0; word < vocab->num_words; ++word) {
+			output[word] = word;
+		}
+
+		return output;
+	}
+
+	unsigned long start = isr3_stats_now();
+	struct isr3_perf_sample counters;
+	struct isr3_sort_item* items = malloc(sizeof *items * vocab->num_words);
+
+	if (!items) {
+		isr3_err("malloc() failed. System may be out of RAM!\n");
+		exit(1);
+	}
+
+	for (uint32_t i = 0, word = 0; i < vocab->num_chunks; ++i) {
+		struct isr3_vocab_chunk* chunk = vocab->chunks[i];
+
+		for (uint32_t slot = 0; slot < ISR3_VOCAB_CHUNK && word < vocab->num_words; ++slot, ++word) {
+			items[word].str = chunk->words[slot];
+			items[word].len = chunk->lengths[slot];
+			items[word].id = word;
+		}
+	}
+
+	isr3_perf_begin(&counters);
+	isr3_sort_items(items, vocab->num_words);
+	isr3_perf_end(ISR3_PHASE_SORT, &counters);
+
+	for (uint32_t i = 0; i < vocab->num_words; ++i) {
+		output[i] = items[i].id;
+	}
+
+	free(items);
+
+	isr3_stats_phase_end(ISR3_PHASE_SORT, start);
+	return output;
+}
+
+void isr3_vocab_postings(struct isr3_vocab* vocab, uint32_t word, struct isr3_postings* cursor) {
+	cursor->pos = cursor->stop = 0;
+	cursor->frame = -1;
+
+	if (vocab->postings_starts) {
+		/* Nothing is read until the first call to isr3_postings_next(). */
+		cursor->ref = NULL;
+		cursor->next = cursor->end = NULL;
+		cursor->fd = vocab->postings_fd;
+		cursor->pool = vocab->pool;
+		cursor->pos = vocab->postings_starts[word];
+		cursor->stop = vocab->postings_starts[word + 1];
+		return;
+	}
+
+	if (vocab->loaded) {
+		cursor->ref = NULL;
+		cursor->next = vocab->postings + vocab->postings_offsets[word];
+		cursor->end = vocab->postings + vocab->postings_offsets[word + 1];
+		return;
+	}
+
+	uint32_t slot;
+	struct isr3_vocab_chunk* chunk = isr3_vocab_chunk(vocab, word, &slot);
+
+	cursor->ref = chunk->heads[slot];
+	cursor->next = cursor->end = NULL;
+}
+
+int isr3_postings_next(struct isr3_postings* cursor, unsigned int* ref_id) {
+	if (cursor->next == cursor->end && cursor->pos < cursor->stop) {
+		isr3_postings_read(cursor);
+	}
+
+	if (cursor->next != cursor->end) {
+		*ref_id = *cursor->next++;
+		return 1;
+	}
+
+	if (cursor->frame >= 0) {
+		isr3_buffer_pool_unpin(cursor->pool, cursor->frame); /* Walked to the end. */
+		cursor->frame = -1;
+	}
+
+	if (!cursor->ref) {
+		return 0;
+	}
+
+	*ref_id = cursor->ref->ref_id;
+	cursor->ref = __atomic_load_n(&cursor->ref->next, __ATOMIC_ACQUIRE); /* The ingest thread may be appending to this list. */
+
+	return 1;
+}
+
+void isr3_postings_read(struct isr3_postings* cursor) {
+	/* Moves on to the page holding `pos`: the rest of the word's ref IDs on it are the cursor's next ones. */
+	uint64_t page = cursor->pos / ISR3_BUFFER_PAGE_REFS, offset = cursor->pos % ISR3_BUFFER_PAGE_REFS;
+	const uint32_t* data = cursor->buffer;
+	uint32_t count = 0;
+
+	if (cursor->frame >= 0) {
+		isr3_buffer_pool_unpin(cursor->pool, cursor->frame);
+		cursor->frame = -1;
+	}
+
+	if (cursor->pool) {
+		data = isr3_buffer_pool_pin(cursor->pool, cursor->fd, page, cursor->buffer, &count, &cursor->frame);
+	} else {
+		ssize_t read = pread(cursor->fd, cursor->buffer, ISR3_BUFFER_PAGE, page * ISR3_BUFFER_PAGE);
+
+		if (read < 0) {
+			isr3_err("Failed to read postings from disk.\n");
+			data = NULL;
+		}
+
+		count = read > 0 ? read / sizeof *cursor->buffer : 0;
+	}
+
+	if (data && count <= offset) {
+		isr3_err("Postings file is truncated.\n");
+		data = NULL;
+	}
+
+	if (!data) {
+		isr3_buffer_pool_unpin(cursor->pool, cursor->frame);
+		cursor->frame = -1;
+		cursor->pos = cursor->stop; /* Ends the walk. */
+		return;
+	}
+
+	if (cursor->stop - cursor->pos < count - offset) {
+		count = cursor->stop - cursor->pos + offset;
+	}
+
+	cursor->next = data + offset;
+	cursor->end = data + count;
+	cursor->pos += count - offset;
+}
+
+struct isr3_vocab_chunk* isr3_vocab_chunk(struct isr3_vocab* vocab, uint32_t word, uint32_t* slot) {
+	struct isr3_vocab_chunk** chunks = __atomic_load_n(&vocab->chunks, __ATOMIC_ACQUIRE);
+
+	*slot = word & (ISR3_VOCAB_CHUNK - 1);
+	return chunks[word >> ISR3_VOCAB_CHUNK_SHIFT];
+}
+
+void isr3_vocab_grow(struct isr3_vocab* vocab) {
+	/* Chunks and directories are tracked as heap only, the words are counted as they're added. */
+	struct isr3_vocab_chunk* chunk = malloc(sizeof *chunk);
+
+	if (!chunk) {
+		isr3_err("malloc failed with new vocabulary chunk\n");
+		exit(1);
+	}
+
+	isr3_mem_track(ISR3_MEM_VOCAB, chunk, 0, 0);
+
+	if (vocab->num_chunks == vocab->max_chunks) {
+		uint32_t max_chunks = vocab->max_chunks ? vocab->max_chunks * 2 : 4;
+		struct isr3_vocab_chunk** chunks = malloc(sizeof *chunks * max_chunks);
+		struct isr3_vocab_chunk*** old_chunks = realloc(vocab->old_chunks, sizeof *old_chunks * (vocab->num_old_chunks + 1));
+
+		if (!chunks || !old_chunks) {
+			isr3_err("malloc failed with new vocabulary directory\n");
+			exit(1);
+		}
+
+		isr3_mem_track(ISR3_MEM_VOCAB, chunks, 0, 0);
+
+		if (vocab->num_chunks) {
+			memcpy(chunks, vocab->chunks, sizeof *chunks * vocab->num_chunks);
+		}
+
+		chunks[vocab->num_chunks] = chunk;
+
+		/* Readers may still hold the old directory, so it is only freed with the vocabulary. */
+		vocab->old_chunks = old_chunks;
+
+		if (vocab->chunks) {
+			vocab->old_chunks[vocab->num_old_chunks++] = vocab->chunks;
+		}
+
+		vocab->max_chunks = max_chunks;
+		__atomic_store_n(&vocab->chunks, chunks, __ATOMIC_RELEASE);
+	} else {
+		vocab->chunks[vocab->num_chunks] = chunk;
+	}
+
+	vocab->num_chunks++;
+}
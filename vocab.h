@@ -0,0 +1,92 @@
+#ifndef VOCAB_H
+#define VOCAB_H
+
+#include <stdint.h>
+
+#include "bufpool.h"
+#include "entry_types.h"
+
+#define ISR3_VOCAB_NONE UINT32_MAX /* Not a word ID: the end of a hash chain, or a failed lookup. */
+#define ISR3_VOCAB_CHUNK_SHIFT 8
+#define ISR3_VOCAB_CHUNK (1 << ISR3_VOCAB_CHUNK_SHIFT) /* Words per chunk of an in-memory vocabulary. */
+
+/*
+ * A segment's vocabulary, as parallel arrays indexed by word ID. Everything else (the hash tree, the wildcard indexes, the
+ * sort before a flush) refers to words by their ID.
+ *
+ * In-memory vocabularies hand out IDs in insertion order. Their columns are cut into chunks of ISR3_VOCAB_CHUNK words, so a
+ * chunk never moves once a reader can see it; the chunk directory is replaced (and the old one kept) like a pool's, see
+ * pool.h. The strings are the tokenizer's buffers, and the postings stay linked lists of isr3_ref_entry because the writer
+ * appends to them while queries walk them.
+ *
+ * Loaded vocabularies are immutable and number their words in sorted order. The strings are back to back in one buffer,
+ * each NUL-terminated, and the postings (ascending ref IDs) are one flat array, so a word is its string offset, length and
+ * first posting. Its document frequency is the distance to the next word's first posting.
+ *
+ * Vocabularies with postings on disk (an out-of-core index, see disk.h, or any loaded segment with `--buffer-pool`) load
+ * only the word columns, and each word keeps the 64-bit position of its first posting in the postings file. The cursor
+ * reads the file a page at a time, through the buffer pool if there is one (see bufpool.h). It keeps its current page
+ * pinned, so a cursor has to be walked to its end, which releases the pin.
+ */
+
+struct isr3_vocab_chunk {
+	char* words[ISR3_VOCAB_CHUNK];
+	isr3_ref_entry* heads[ISR3_VOCAB_CHUNK], *tails[ISR3_VOCAB_CHUNK];
+	uint32_t lengths[ISR3_VOCAB_CHUNK];
+	uint32_t chains[ISR3_VOCAB_CHUNK]; // The next word in the same hash tree node, see isr3.h.
+	uint32_t doc_freqs[ISR3_VOCAB_CHUNK];
+};
+
+struct isr3_vocab {
+	uint32_t num_words;
+	int loaded;
+
+	/* In-memory columns. */
+	struct isr3_vocab_chunk** chunks;
+	uint32_t num_chunks, max_chunks;
+	struct isr3_vocab_chunk*** old_chunks; // Superseded directories.
+	int num_old_chunks;
+
+	/* Loaded columns. */
+	char* strings;
+	uint32_t* offsets, *lengths, *postings_offsets; // `postings_offsets` has num_words + 1 entries.
+	uint32_t* postings;
+	uint32_t num_postings, num_chars;
+
+	/* Postings on disk, instead of `postings_offsets` and `postings`. */
+	uint64_t* postings_starts; // num_words + 1 entries, counted in ref IDs from the start of the file.
+	int postings_fd; // Owned by whoever loaded the vocabulary.
+	struct isr3_buffer_pool* pool; // NULL to read pages straight into the cursor.
+};
+
+/* Walks one word's postings in any layout. */
+struct isr3_postings {
+	isr3_ref_entry* ref;
+	const uint32_t* next, *end;
+
+	/* Postings on disk: the ref IDs [pos, stop) of the file which haven't been read yet, and the pinned page (-1 for none). */
+	int fd, frame;
+	uint64_t pos, stop;
+	struct isr3_buffer_pool* pool;
+	uint32_t buffer[ISR3_BUFFER_PAGE_REFS]; // Pages which aren't in the pool.
+};
+
+void isr3_vocab_init(struct isr3_vocab* vocab); /* An empty in-memory vocabulary. */
+int isr3_vocab_load(struct isr3_vocab* vocab, uint32_t num_words, uint32_t num_postings, uint32_t num_chars); /* Allocates loaded columns for the caller to fill, 0 on failure. */
+int isr3_vocab_load_words(struct isr3_vocab* vocab, uint32_t num_words, uint32_t num_chars, int postings_fd, struct isr3_buffer_pool* pool); /* The same without the postings, which stay in `postings_fd`. */
+void isr3_vocab_destroy(struct isr3_vocab* vocab); /* Frees every word, string and posting. */
+
+/* In-memory only. add() takes over the word buffer and the first posting, and returns the new ID. Single writer. */
+uint32_t isr3_vocab_add(struct isr3_vocab* vocab, char* word, int word_len, isr3_ref_entry* ref);
+void isr3_vocab_append(struct isr3_vocab* vocab, uint32_t word, isr3_ref_entry* ref);
+uint32_t* isr3_vocab_chain(struct isr3_vocab* vocab, uint32_t word);
+
+char* isr3_vocab_word(struct isr3_vocab* vocab, uint32_t word, int* word_len);
+uint32_t isr3_vocab_doc_freq(struct isr3_vocab* vocab, uint32_t word);
+uint32_t isr3_vocab_find(struct isr3_vocab* vocab, char* word, int word_len); /* Loaded only, in-memory lookups go through the tree. */
+uint32_t* isr3_vocab_sort(struct isr3_vocab* vocab); /* Every ID in word order, free() it. */
+
+void isr3_vocab_postings(struct isr3_vocab* vocab, uint32_t word, struct isr3_postings* cursor);
+int isr3_postings_next(struct isr3_postings* cursor, unsigned int* ref_id); /* 0 past the last posting. */
+
+#endif